@@ -26,10 +26,12 @@ static inline void setup_dma_coherent(unsigned long offset)
 {
 }
 
+#define DMA_ALIGNMENT	64
+
 #define dma_alloc dma_alloc
 static inline void *dma_alloc(size_t size)
 {
-	return xmemalign(64, ALIGN(size, 64));
+	return xmemalign(DMA_ALIGNMENT, ALIGN(size, DMA_ALIGNMENT));
 }
 
 #ifdef CONFIG_MMU
@@ -21,6 +21,7 @@
 #include <driver.h>
 #include <malloc.h>
 #include <mach/linux.h>
+#include <mach/pcap.h>
 #include <init.h>
 #include <errno.h>
 #include <fb.h>
@@ -36,6 +37,18 @@ static struct device_d tap_device = {
 	.name     = "tap",
 };
 
+int barebox_register_pcap(struct pcap_platform_data *pcap)
+{
+	struct device_d *dev;
+
+	dev = xzalloc(sizeof(*dev));
+	strcpy(dev->name, "pcap");
+	dev->id = DEVICE_ID_DYNAMIC;
+	dev->platform_data = pcap;
+
+	return sandbox_add_device(dev);
+}
+
 static struct device_d sdl_device = {
 	.id	  = DEVICE_ID_DYNAMIC,
 	.name     = "sdlfb",
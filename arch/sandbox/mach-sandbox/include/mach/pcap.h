@@ -0,0 +1,13 @@
+#ifndef __ASM_ARCH_PCAP_H
+#define __ASM_ARCH_PCAP_H
+
+struct pcap_platform_data {
+	const void *base;	/* capture to replay, NULL for none */
+	size_t size;
+	char *filename;
+	int txfd;		/* capture file for sent frames, -1 for none */
+};
+
+int barebox_register_pcap(struct pcap_platform_data *pcap);
+
+#endif /* __ASM_ARCH_PCAP_H */
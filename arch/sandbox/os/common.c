@@ -44,6 +44,7 @@
  */
 #include <mach/linux.h>
 #include <mach/hostfile.h>
+#include <mach/pcap.h>
 
 int sdl_xres;
 int sdl_yres;
@@ -265,6 +266,63 @@ err_out:
 	return -1;
 }
 
+static int add_pcap(char *rxfile, char *txfile)
+{
+	struct pcap_platform_data *pcap = malloc(sizeof(*pcap));
+	struct stat s;
+	void *base;
+	int fd;
+
+	if (!pcap)
+		return -1;
+
+	pcap->base = NULL;
+	pcap->size = 0;
+	pcap->filename = rxfile;
+	pcap->txfd = -1;
+
+	if (rxfile) {
+		fd = open(rxfile, O_RDONLY);
+		if (fd < 0) {
+			perror("open");
+			goto err_out;
+		}
+
+		if (fstat(fd, &s)) {
+			perror("fstat");
+			close(fd);
+			goto err_out;
+		}
+
+		base = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (base == MAP_FAILED) {
+			perror("mmap");
+			goto err_out;
+		}
+
+		pcap->base = base;
+		pcap->size = s.st_size;
+	}
+
+	if (txfile) {
+		pcap->txfd = open(txfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (pcap->txfd < 0) {
+			perror("open");
+			goto err_out;
+		}
+	}
+
+	if (barebox_register_pcap(pcap))
+		goto err_out;
+
+	return 0;
+
+err_out:
+	free(pcap);
+	return -1;
+}
+
 static void print_usage(const char*);
 
 static struct option long_options[] = {
@@ -276,10 +334,12 @@ static struct option long_options[] = {
 	{"stdin",  1, 0, 'I'},
 	{"xres",  1, 0, 'x'},
 	{"yres",  1, 0, 'y'},
+	{"pcap",  1, 0, 'p'},
+	{"pcap-out", 1, 0, 'P'},
 	{0, 0, 0, 0},
 };
 
-static const char optstring[] = "hm:i:e:O:I:x:y:";
+static const char optstring[] = "hm:i:e:O:I:x:y:p:P:";
 
 int main(int argc, char *argv[])
 {
@@ -288,6 +348,7 @@ int main(int argc, char *argv[])
 	int malloc_size = 8 * 1024 * 1024;
 	char str[6];
 	int fdno = 0, envno = 0, option_index = 0;
+	char *pcap_in = NULL, *pcap_out = NULL;
 
 	while (1) {
 		option_index = 0;
@@ -332,6 +393,12 @@ int main(int argc, char *argv[])
 		case 'y':
 			sdl_yres = strtoul(optarg, NULL, 0);
 			break;
+		case 'p':
+			pcap_in = optarg;
+			break;
+		case 'P':
+			pcap_out = optarg;
+			break;
 		default:
 			exit(1);
 		}
@@ -379,6 +446,9 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if ((pcap_in || pcap_out) && add_pcap(pcap_in, pcap_out))
+		exit(1);
+
 	barebox_register_console("console", fileno(stdin), fileno(stdout));
 
 	rawmode();
@@ -413,7 +483,11 @@ static void print_usage(const char *prgname)
 "  -I, --stdin=<file>   Register a file as a console capable of doing stdin.\n"
 "                       <file> can be a regular file or a FIFO.\n"
 "  -x, --xres=<res>     SDL width.\n"
-"  -y, --yres=<res>     SDL height.\n",
+"  -y, --yres=<res>     SDL height.\n"
+"  -p, --pcap=<file>    Replay the frames of a packet capture on a pcap network\n"
+"                       device. Use its 'replay' parameter to start.\n"
+"  -P, --pcap-out=<file> Write the frames sent on the pcap network device to a\n"
+"                       packet capture.\n",
 	prgname
 	);
 }
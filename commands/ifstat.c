@@ -0,0 +1,107 @@
+/*
+ * ifstat.c - show network interface statistics
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <common.h>
+#include <command.h>
+#include <complete.h>
+#include <getopt.h>
+#include <net.h>
+
+static void ifstat_clear(struct eth_device *edev)
+{
+	edev->rx_packets = edev->rx_bytes = edev->rx_errors = 0;
+	edev->rx_dropped = edev->rx_ring_max = 0;
+	memset(edev->rx_drop, 0, sizeof(edev->rx_drop));
+	edev->tx_packets = edev->tx_bytes = edev->tx_errors = 0;
+	edev->tx_carrier_errors = edev->tx_ring_max = 0;
+}
+
+static void ifstat_show(struct eth_device *edev)
+{
+	int i;
+
+	printf("%s: mtu %d%s\n", dev_name(&edev->dev), edev->mtu,
+			edev->active ? "" : " (inactive)");
+	printf("  RX: packets %u bytes %u errors %u dropped %u\n",
+			edev->rx_packets, edev->rx_bytes, edev->rx_errors,
+			edev->rx_dropped);
+	printf("      dropped:");
+	for (i = 0; i < ETH_DROP_NUM; i++)
+		printf(" %s %u", eth_drop_names[i], edev->rx_drop[i]);
+	printf("\n");
+	printf("  TX: packets %u bytes %u errors %u carrier %u\n",
+			edev->tx_packets, edev->tx_bytes, edev->tx_errors,
+			edev->tx_carrier_errors);
+	printf("  rings: rx max %d tx max %d\n", edev->rx_ring_max,
+			edev->tx_ring_max);
+}
+
+static int do_ifstat(int argc, char *argv[])
+{
+	struct eth_device *edev;
+	int opt, clear = 0, found = 0;
+
+	while ((opt = getopt(argc, argv, "c")) > 0) {
+		switch (opt) {
+		case 'c':
+			clear = 1;
+			break;
+		default:
+			return COMMAND_ERROR_USAGE;
+		}
+	}
+
+	if (argc > optind + 1)
+		return COMMAND_ERROR_USAGE;
+
+	for_each_netdev(edev) {
+		if (argc > optind && strcmp(dev_name(&edev->dev), argv[optind]))
+			continue;
+
+		found = 1;
+
+		if (clear)
+			ifstat_clear(edev);
+		else
+			ifstat_show(edev);
+	}
+
+	if (!found && argc > optind) {
+		printf("no such net device: %s\n", argv[optind]);
+		return COMMAND_ERROR;
+	}
+
+	return 0;
+}
+
+BAREBOX_CMD_HELP_START(ifstat)
+BAREBOX_CMD_HELP_TEXT("Show the packet counters of all network interfaces or of INTF.")
+BAREBOX_CMD_HELP_TEXT("Dropped frames are broken down by reason: malformed (bad), bad UDP or")
+BAREBOX_CMD_HELP_TEXT("TCP checksum (csum), unsupported protocol (proto), for another host")
+BAREBOX_CMD_HELP_TEXT("(addr), unsubscribed multicast (mcast), no listener (noport) and")
+BAREBOX_CMD_HELP_TEXT("receive ring overruns (overrun). The counters are also available")
+BAREBOX_CMD_HELP_TEXT("as device parameters.")
+BAREBOX_CMD_HELP_TEXT("")
+BAREBOX_CMD_HELP_TEXT("Options:")
+BAREBOX_CMD_HELP_OPT ("-c", "clear the counters")
+BAREBOX_CMD_HELP_END
+
+BAREBOX_CMD_START(ifstat)
+	.cmd		= do_ifstat,
+	BAREBOX_CMD_DESC("show network interface statistics")
+	BAREBOX_CMD_OPTS("[-c] [INTF]")
+	BAREBOX_CMD_GROUP(CMD_GRP_NET)
+	BAREBOX_CMD_HELP(cmd_ifstat_help)
+	BAREBOX_CMD_COMPLETE(eth_complete)
+BAREBOX_CMD_END
@@ -0,0 +1,340 @@
+/*
+ * netbench.c - UDP throughput benchmark
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+/*
+ * The datagrams start with the header iperf 2 uses for UDP tests, so
+ * 'iperf -u -s' can receive what 'netbench -c' sends and 'iperf -u -c'
+ * can send to 'netbench -s'. The end of a stream is marked with negative
+ * sequence numbers.
+ */
+#include <common.h>
+#include <command.h>
+#include <clock.h>
+#include <errno.h>
+#include <getopt.h>
+#include <net.h>
+#include <asm-generic/div64.h>
+#include <linux/err.h>
+
+#define NETBENCH_PORT		5001
+#define NETBENCH_LEN		1470
+#define NETBENCH_FIN_COUNT	10
+
+struct netbench_hdr {
+	int32_t id;
+	uint32_t tv_sec;
+	uint32_t tv_usec;
+} __packed;
+
+struct netbench {
+	uint32_t packets;
+	uint64_t bytes;
+	uint32_t errors;
+	uint32_t lost;
+	uint32_t reordered;
+	int32_t next_id;
+	uint64_t first;
+	uint64_t last;
+	int fin;
+};
+
+static void netbench_report(struct netbench *nb, uint64_t ns)
+{
+	uint64_t pps, kbit;
+	uint32_t us;
+
+	/* sufficient for an hour */
+	do_div(ns, 1000);
+	us = max_t(uint32_t, ns, 1);
+
+	pps = (uint64_t)nb->packets * 1000000;
+	do_div(pps, us);
+	kbit = nb->bytes * 8000;
+	do_div(kbit, us);
+
+	printf("%u packets, %llu bytes in %u.%03us: %u pps, %u.%03u Mbit/s\n",
+			nb->packets, nb->bytes, us / 1000000, us / 1000 % 1000,
+			(uint32_t)pps, (uint32_t)kbit / 1000, (uint32_t)kbit % 1000);
+}
+
+static void netbench_fill(struct netbench_hdr *hdr, int32_t id)
+{
+	uint64_t t = get_time_ns();
+	uint32_t ns;
+
+	ns = do_div(t, 1000000000);
+
+	hdr->id = htonl(id);
+	hdr->tv_sec = htonl(t);
+	hdr->tv_usec = htonl(ns / 1000);
+}
+
+static void netbench_tx_handler(void *ctx, char *pkt, unsigned len)
+{
+	/* iperf answers the end of the stream with a report, ignore it */
+}
+
+static int netbench_client(IPaddr_t ip, int port, int len, int mbit, int secs)
+{
+	struct netbench nb = {};
+	struct net_connection *con;
+	struct netbench_hdr *hdr;
+	uint64_t start, next, interval = 0, tx_ns = 0, t;
+	int ret, i;
+
+	con = net_udp_new(ip, port, netbench_tx_handler, NULL);
+	if (IS_ERR(con))
+		return PTR_ERR(con);
+
+	if (len > net_eth_udp_payload(con->edev)) {
+		printf("length exceeds the MTU of %s\n", dev_name(&con->edev->dev));
+		ret = -EINVAL;
+		goto out;
+	}
+
+	hdr = net_udp_get_payload(con);
+	for (i = sizeof(*hdr); i < len; i++)
+		((char *)hdr)[i] = i;
+
+	/* nanoseconds per datagram, Mbit/s is the same as bits per us */
+	if (mbit)
+		interval = len * 8 * 1000 / mbit;
+
+	start = next = get_time_ns();
+
+	while (!is_timeout(start, secs * SECOND)) {
+		if (ctrlc()) {
+			ret = -EINTR;
+			goto out;
+		}
+
+		if (interval) {
+			while (get_time_ns() < next)
+				net_poll();
+			next += interval;
+		}
+
+		netbench_fill(hdr, nb.packets);
+
+		t = get_time_ns();
+		ret = net_udp_send(con, len);
+		tx_ns += get_time_ns() - t;
+
+		if (ret) {
+			nb.errors++;
+		} else {
+			nb.packets++;
+			nb.bytes += len;
+		}
+
+		/* answer ARP requests and reclaim transmit buffers */
+		net_poll();
+	}
+
+	eth_tx_flush(con->edev);
+	t = get_time_ns() - start;
+
+	for (i = 0; i < NETBENCH_FIN_COUNT; i++) {
+		netbench_fill(hdr, -nb.packets);
+		net_udp_send(con, len);
+	}
+
+	netbench_report(&nb, t);
+
+	do_div(tx_ns, 1000000);
+	printf("%u send errors, %llums spent sending\n", nb.errors, tx_ns);
+
+	ret = 0;
+out:
+	net_unregister(con);
+
+	return ret;
+}
+
+static void netbench_rx_handler(void *ctx, char *pkt, unsigned len)
+{
+	struct netbench *nb = ctx;
+	struct udphdr *udp = net_eth_to_udphdr(pkt);
+	struct netbench_hdr *hdr = (void *)net_eth_to_udp_payload(pkt);
+	int ulen = ntohs(udp->uh_ulen) - sizeof(struct udphdr);
+	int32_t id;
+
+	if (ulen < sizeof(*hdr))
+		return;
+
+	nb->last = get_time_ns();
+	if (!nb->packets)
+		nb->first = nb->last;
+
+	id = ntohl(hdr->id);
+	if (id < 0) {
+		nb->fin = 1;
+		return;
+	}
+
+	nb->packets++;
+	nb->bytes += ulen;
+
+	if (id == nb->next_id) {
+		nb->next_id++;
+	} else if (id > nb->next_id) {
+		nb->lost += id - nb->next_id;
+		nb->next_id = id + 1;
+	} else {
+		/* a late datagram we already counted as lost */
+		nb->reordered++;
+		if (nb->lost)
+			nb->lost--;
+	}
+}
+
+static int netbench_server(int port, int secs)
+{
+	struct netbench nb = {};
+	struct net_connection *con;
+	struct eth_device *edev;
+	uint64_t poll_ns = 0, stack_ns, t;
+	int dropped, ret;
+
+	con = net_udp_new(0xffffffff, 0, netbench_rx_handler, &nb);
+	if (IS_ERR(con))
+		return PTR_ERR(con);
+
+	net_udp_bind(con, port);
+	edev = con->edev;
+	dropped = edev->rx_dropped;
+
+	/* we may not have sent anything yet */
+	ret = eth_open(edev);
+	if (ret)
+		goto out;
+
+	printf("listening on port %d\n", port);
+
+	net_rx_timing(1);
+
+	while (!nb.fin) {
+		if (ctrlc()) {
+			ret = -EINTR;
+			goto out;
+		}
+
+		t = get_time_ns();
+		net_poll();
+		poll_ns += get_time_ns() - t;
+
+		if (!nb.packets) {
+			/* don't account the time waiting for the sender */
+			poll_ns = 0;
+			net_rx_timing(1);
+			continue;
+		}
+
+		/* stop after the test time or when the sender went away */
+		if (is_timeout(nb.first, secs * SECOND) ||
+				is_timeout(nb.last, 2 * SECOND))
+			break;
+	}
+
+	stack_ns = net_rx_time();
+
+	netbench_report(&nb, nb.last - nb.first);
+	printf("%u lost, %u out of order, %d dropped by %s\n", nb.lost,
+			nb.reordered, edev->rx_dropped - dropped,
+			dev_name(&edev->dev));
+
+	do_div(poll_ns, 1000000);
+	do_div(stack_ns, 1000000);
+	printf("%llums polling, %llums of them in the network stack\n",
+			poll_ns, stack_ns);
+
+	ret = 0;
+out:
+	net_rx_timing(0);
+	net_unregister(con);
+
+	return ret;
+}
+
+static int do_netbench(int argc, char *argv[])
+{
+	IPaddr_t ip = 0;
+	int port = NETBENCH_PORT, len = NETBENCH_LEN, mbit = 0, secs = 10;
+	int server = 0, opt, ret;
+
+	while ((opt = getopt(argc, argv, "sc:p:l:b:t:")) > 0) {
+		switch (opt) {
+		case 's':
+			server = 1;
+			break;
+		case 'c':
+			ip = resolv(optarg);
+			if (!ip) {
+				printf("unknown host %s\n", optarg);
+				return COMMAND_ERROR;
+			}
+			break;
+		case 'p':
+			port = simple_strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			len = simple_strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			mbit = simple_strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			secs = simple_strtoul(optarg, NULL, 0);
+			break;
+		default:
+			return COMMAND_ERROR_USAGE;
+		}
+	}
+
+	if (server == !!ip || len < sizeof(struct netbench_hdr))
+		return COMMAND_ERROR_USAGE;
+
+	if (server)
+		ret = netbench_server(port, secs);
+	else
+		ret = netbench_client(ip, port, len, mbit, secs);
+
+	if (ret) {
+		printf("netbench: %s\n", strerror(-ret));
+		return COMMAND_ERROR;
+	}
+
+	return 0;
+}
+
+BAREBOX_CMD_HELP_START(netbench)
+BAREBOX_CMD_HELP_TEXT("Send (-c) or receive (-s) a stream of UDP datagrams and report")
+BAREBOX_CMD_HELP_TEXT("the throughput. The datagrams are compatible with 'iperf -u'.")
+BAREBOX_CMD_HELP_TEXT("")
+BAREBOX_CMD_HELP_TEXT("Options:")
+BAREBOX_CMD_HELP_OPT ("-s",	 "receive datagrams")
+BAREBOX_CMD_HELP_OPT ("-c HOST", "send datagrams to HOST")
+BAREBOX_CMD_HELP_OPT ("-p PORT", "UDP port (default 5001)")
+BAREBOX_CMD_HELP_OPT ("-l LEN",  "datagram payload length (default 1470)")
+BAREBOX_CMD_HELP_OPT ("-b MBIT", "send rate in Mbit/s (default: as fast as possible)")
+BAREBOX_CMD_HELP_OPT ("-t SECS", "test duration (default 10)")
+BAREBOX_CMD_HELP_END
+
+BAREBOX_CMD_START(netbench)
+	.cmd		= do_netbench,
+	BAREBOX_CMD_DESC("UDP throughput benchmark")
+	BAREBOX_CMD_OPTS("-s|-c HOST [-p PORT] [-l LEN] [-b MBIT] [-t SECS]")
+	BAREBOX_CMD_GROUP(CMD_GRP_NET)
+	BAREBOX_CMD_HELP(cmd_netbench_help)
+BAREBOX_CMD_END
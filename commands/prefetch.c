@@ -0,0 +1,81 @@
+/*
+ * prefetch.c - copy files in the background
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <common.h>
+#include <command.h>
+#include <errno.h>
+#include <getopt.h>
+#include <prefetch.h>
+
+static int do_prefetch(int argc, char *argv[])
+{
+	int opt, ret;
+	int wait = 0;
+
+	while ((opt = getopt(argc, argv, "w")) > 0) {
+		switch (opt) {
+		case 'w':
+			wait = 1;
+			break;
+		default:
+			return COMMAND_ERROR_USAGE;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc == 0) {
+		if (!wait) {
+			prefetch_info();
+			return 0;
+		}
+
+		ret = prefetch_wait(NULL);
+		goto out;
+	}
+
+	if (argc != 2)
+		return COMMAND_ERROR_USAGE;
+
+	ret = prefetch_start(argv[0], argv[1]);
+	if (!ret && wait)
+		ret = prefetch_wait(argv[1]);
+out:
+	if (ret) {
+		printf("prefetch: %s\n", strerror(-ret));
+		return COMMAND_ERROR;
+	}
+
+	return 0;
+}
+
+BAREBOX_CMD_HELP_START(prefetch)
+BAREBOX_CMD_HELP_TEXT("Copy SRC to DEST in the background, typically from a network")
+BAREBOX_CMD_HELP_TEXT("filesystem to a ramfs. The copy proceeds while barebox waits for")
+BAREBOX_CMD_HELP_TEXT("input or in 'timeout' and 'sleep', opening DEST waits for it to")
+BAREBOX_CMD_HELP_TEXT("complete.")
+BAREBOX_CMD_HELP_TEXT("Without arguments the pending transfers are listed.")
+BAREBOX_CMD_HELP_TEXT("")
+BAREBOX_CMD_HELP_TEXT("Options:")
+BAREBOX_CMD_HELP_OPT ("-w", "wait for the transfer (all transfers without SRC/DEST)")
+BAREBOX_CMD_HELP_END
+
+BAREBOX_CMD_START(prefetch)
+	.cmd		= do_prefetch,
+	BAREBOX_CMD_DESC("copy files in the background")
+	BAREBOX_CMD_OPTS("[-w] [SRC DEST]")
+	BAREBOX_CMD_GROUP(CMD_GRP_FILE)
+	BAREBOX_CMD_HELP(cmd_prefetch_help)
+BAREBOX_CMD_END
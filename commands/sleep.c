@@ -21,6 +21,7 @@
 #include <command.h>
 #include <complete.h>
 #include <clock.h>
+#include <prefetch.h>
 
 static int do_sleep(int argc, char *argv[])
 {
@@ -36,6 +37,7 @@ static int do_sleep(int argc, char *argv[])
 	while (!is_timeout(start, delay * SECOND)) {
 		if (ctrlc())
 			return 1;
+		prefetch_idle();
 	}
 
 	return 0;
@@ -23,6 +23,7 @@
 #include <getopt.h>
 #include <clock.h>
 #include <environment.h>
+#include <prefetch.h>
 
 #define TIMEOUT_RETURN	(1 << 0)
 #define TIMEOUT_CTRLC	(1 << 1)
@@ -87,6 +88,7 @@ static int do_timeout(int argc, char *argv[])
 			printf("\b\b%2d", countdown--);
 			second += SECOND;
 		}
+		prefetch_idle();
 	} while (!is_timeout(start, timeout * SECOND));
 
 	ret = 0;
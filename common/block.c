@@ -19,8 +19,12 @@
 #include <common.h>
 #include <block.h>
 #include <malloc.h>
+#include <param.h>
 #include <linux/err.h>
 #include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/rbtree.h>
+#include <sizes.h>
 #include <dma.h>
 
 #define BLOCKSIZE(blk)	(1 << blk->blockbits)
@@ -32,43 +36,163 @@ struct chunk {
 	void *data; /* data buffer */
 	int block_start; /* first block in this chunk */
 	int dirty; /* need to write back to device */
+	int dirty_start; /* first dirty block, valid if dirty */
+	int dirty_end; /* block after the last dirty one, valid if dirty */
 	int num; /* number of chunk, debugging only */
-	struct list_head list;
+	struct list_head list; /* position in the LRU or idle list */
+	struct rb_node node; /* position in blk->chunk_tree while cached */
 };
 
 #define BUFSIZE (PAGE_SIZE * 16)
+#define NUM_CHUNKS 8
+#define NUM_READAHEAD 4
+
+/* upper limits for the cache parameters */
+#define MAX_CHUNKS 1024
+#define MAX_CHUNKSIZE SZ_1M
 
 /*
- * Write all dirty chunks back to the device
+ * Pass a request to the driver, split at the largest request it handles
  */
-static int writebuffer_flush(struct block_device *blk)
+static int block_dev_read(struct block_device *blk, void *buf, int block,
+		int num_blocks)
 {
-	struct chunk *chunk;
+	int now, ret;
 
-	if (!IS_ENABLED(CONFIG_BLOCK_WRITE))
-		return 0;
+	while (num_blocks) {
+		now = num_blocks;
+		if (blk->max_blocks)
+			now = min(now, blk->max_blocks);
 
-	list_for_each_entry(chunk, &blk->buffered_blocks, list) {
-		if (chunk->dirty) {
-			blk->ops->write(blk, chunk->data, chunk->block_start, blk->rdbufsize);
-			chunk->dirty = 0;
-		}
+		ret = blk->ops->read(blk, buf, block, now);
+		if (ret)
+			return ret;
+
+		buf += now << blk->blockbits;
+		block += now;
+		num_blocks -= now;
+	}
+
+	return 0;
+}
+
+static int block_dev_write(struct block_device *blk, const void *buf,
+		int block, int num_blocks)
+{
+	int now, ret;
+
+	while (num_blocks) {
+		now = num_blocks;
+		if (blk->max_blocks)
+			now = min(now, blk->max_blocks);
+
+		ret = blk->ops->write(blk, buf, block, now);
+		if (ret)
+			return ret;
+
+		buf += now << blk->blockbits;
+		block += now;
+		num_blocks -= now;
 	}
 
 	return 0;
 }
 
+/*
+ * The block after the last one of a chunk. The last chunk of a device
+ * may be cut off by its end.
+ */
+static int chunk_end(struct block_device *blk, struct chunk *chunk)
+{
+	return min(chunk->block_start + blk->rdbufsize, blk->num_blocks);
+}
+
+static void chunk_mark_dirty(struct chunk *chunk, int block, int num_blocks)
+{
+	if (!chunk->dirty) {
+		chunk->dirty_start = block;
+		chunk->dirty_end = block + num_blocks;
+		chunk->dirty = 1;
+		return;
+	}
+
+	chunk->dirty_start = min(chunk->dirty_start, block);
+	chunk->dirty_end = max(chunk->dirty_end, block + num_blocks);
+}
+
+/*
+ * Requests which span several chunks go through this buffer. It holds
+ * half as many chunks as the cache, but at least one.
+ *
+ * The cache parameters are already updated when a parameter change
+ * writes back the old chunks. The size is therefore taken from the chunks
+ * in use, and once the buffer exists its capacity is what counts.
+ */
+static int block_bounce_chunks(struct block_device *blk)
+{
+	if (blk->bounce_buf)
+		return blk->bounce_chunks;
+
+	return max(blk->cache_chunks / 2, 1);
+}
+
+static void *block_bounce_buf(struct block_device *blk)
+{
+	if (!blk->bounce_buf) {
+		blk->bounce_chunks = block_bounce_chunks(blk);
+		blk->bounce_buf = dma_alloc(blk->bounce_chunks *
+				(blk->rdbufsize << blk->blockbits));
+	}
+
+	return blk->bounce_buf;
+}
+
+static void chunk_tree_insert(struct block_device *blk, struct chunk *new)
+{
+	struct rb_node **p = &blk->chunk_tree.rb_node;
+	struct rb_node *parent = NULL;
+	struct chunk *chunk;
+
+	while (*p) {
+		parent = *p;
+		chunk = rb_entry(parent, struct chunk, node);
+
+		if (new->block_start < chunk->block_start)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+
+	rb_link_node(&new->node, parent, p);
+	rb_insert_color(&new->node, &blk->chunk_tree);
+}
+
 /*
  * get the chunk containing a given block. Will return NULL if the
  * block is not cached, the chunk otherwise.
  */
 static struct chunk *chunk_get_cached(struct block_device *blk, int block)
 {
+	struct rb_node *n = blk->chunk_tree.rb_node;
+	int block_start = block & ~blk->blkmask;
 	struct chunk *chunk;
 
-	list_for_each_entry(chunk, &blk->buffered_blocks, list) {
-		if (block >= chunk->block_start &&
-				block < chunk->block_start + blk->rdbufsize) {
+	if (list_empty(&blk->buffered_blocks))
+		return NULL;
+
+	/* sequential access mostly hits the chunk used last */
+	chunk = list_first_entry(&blk->buffered_blocks, struct chunk, list);
+	if (chunk->block_start == block_start)
+		return chunk;
+
+	while (n) {
+		chunk = rb_entry(n, struct chunk, node);
+
+		if (block_start < chunk->block_start) {
+			n = n->rb_left;
+		} else if (block_start > chunk->block_start) {
+			n = n->rb_right;
+		} else {
 			debug("%s: found %d in %d\n", __func__, block, chunk->num);
 			/*
 			 * move most recently used entry to the head of the list
@@ -81,6 +205,110 @@ static struct chunk *chunk_get_cached(struct block_device *blk, int block)
 	return NULL;
 }
 
+/*
+ * get the first cached chunk which contains the given block or follows
+ * it. This does not change the LRU order.
+ */
+static struct chunk *chunk_lookup_from(struct block_device *blk, int block)
+{
+	struct rb_node *n = blk->chunk_tree.rb_node;
+	int block_start = block & ~blk->blkmask;
+	struct chunk *chunk, *found = NULL;
+
+	while (n) {
+		chunk = rb_entry(n, struct chunk, node);
+
+		if (chunk->block_start < block_start) {
+			n = n->rb_right;
+		} else {
+			found = chunk;
+			n = n->rb_left;
+		}
+	}
+
+	return found;
+}
+
+static struct chunk *chunk_next(struct chunk *chunk)
+{
+	struct rb_node *n = rb_next(&chunk->node);
+
+	return n ? rb_entry(n, struct chunk, node) : NULL;
+}
+
+/*
+ * Write all dirty chunks back to the device. The chunks are written in
+ * the order of their blocks and dirty chunks which follow each other
+ * are combined into one request. Clean blocks between their dirty ranges
+ * are written along, they are the same as on the device.
+ */
+static int writebuffer_flush(struct block_device *blk)
+{
+	struct chunk *chunk, *last, *next, *c;
+	struct rb_node *n;
+	int start, end, num, ret, err = 0;
+	void *buf;
+
+	if (!IS_ENABLED(CONFIG_BLOCK_WRITE))
+		return 0;
+
+	n = rb_first(&blk->chunk_tree);
+	chunk = n ? rb_entry(n, struct chunk, node) : NULL;
+
+	while (chunk) {
+		if (!chunk->dirty) {
+			chunk = chunk_next(chunk);
+			continue;
+		}
+
+		last = chunk;
+		num = 1;
+
+		while ((next = chunk_next(last)) && next->dirty &&
+				next->block_start == chunk_end(blk, last) &&
+				num < block_bounce_chunks(blk)) {
+			last = next;
+			num++;
+		}
+
+		start = chunk->dirty_start;
+		end = last->dirty_end;
+
+		if (num == 1) {
+			buf = chunk->data +
+				((start - chunk->block_start) << blk->blockbits);
+		} else {
+			buf = block_bounce_buf(blk);
+
+			for (c = chunk; c != next; c = chunk_next(c)) {
+				int from = max(start, c->block_start);
+				int to = min(end, chunk_end(blk, c));
+
+				memcpy(buf + ((from - start) << blk->blockbits),
+					c->data + ((from - c->block_start) << blk->blockbits),
+					(to - from) << blk->blockbits);
+			}
+		}
+
+		debug("%s: %d blocks at %d from %d chunks\n", __func__,
+				end - start, start, num);
+
+		ret = block_dev_write(blk, buf, start, end - start);
+		if (ret) {
+			/* keep the data, but report the first error */
+			if (!err)
+				err = ret;
+		} else {
+			for (c = chunk; c != next; c = chunk_next(c))
+				c->dirty = 0;
+		}
+
+		chunk = next;
+	}
+
+	return err;
+}
+
 /*
  * Get the data pointer for a given block. Will return NULL if
  * the block is not cached, the data pointer otherwise.
@@ -99,24 +327,32 @@ static void *block_get_cached(struct block_device *blk, int block)
 /*
  * Get a data chunk, either from the idle list or if the idle list
  * is empty, the least recently used is written back to disk and
- * returned.
+ * returned. If the write back fails, the chunk stays cached and dirty
+ * and an error pointer is returned.
  */
 static struct chunk *get_chunk(struct block_device *blk)
 {
 	struct chunk *chunk;
+	int ret;
 
 	if (list_empty(&blk->idle_blocks)) {
 		/* use last entry which is the most unused */
 		chunk = list_last_entry(&blk->buffered_blocks, struct chunk, list);
 		if (chunk->dirty) {
-			size_t num_blocks = min(blk->rdbufsize,
-					blk->num_blocks - chunk->block_start);
-			blk->ops->write(blk, chunk->data, chunk->block_start,
-					num_blocks);
+			int offset = chunk->dirty_start - chunk->block_start;
+
+			ret = block_dev_write(blk,
+					chunk->data + (offset << blk->blockbits),
+					chunk->dirty_start,
+					chunk->dirty_end - chunk->dirty_start);
+			if (ret)
+				return ERR_PTR(ret);
 			chunk->dirty = 0;
 		}
 
+		rb_erase(&chunk->node, &blk->chunk_tree);
 		list_del(&chunk->list);
+		blk->cache_evictions++;
 	} else {
 		chunk = list_first_entry(&blk->idle_blocks, struct chunk, list);
 		list_del(&chunk->list);
@@ -125,6 +361,50 @@ static struct chunk *get_chunk(struct block_device *blk)
 	return chunk;
 }
 
+/*
+ * Number of chunks to read on a cache miss. The window doubles with every
+ * miss which continues where the last one ended, up to cache_readahead
+ * chunks but never more than half of the cache. Any other miss resets it.
+ */
+static int block_readahead_max(struct block_device *blk)
+{
+	int max_window = min(blk->cache_readahead, block_bounce_chunks(blk));
+
+	/* more than fits into one request gains nothing */
+	if (blk->max_blocks)
+		max_window = min(max_window, blk->max_blocks / blk->rdbufsize);
+
+	return max(max_window, 1);
+}
+
+static int block_readahead_window(struct block_device *blk, int block_start)
+{
+	int max_window = block_readahead_max(blk);
+	int window, i;
+
+	if (block_start == blk->ra_next)
+		window = min(blk->ra_window * 2, max_window);
+	else
+		window = 1;
+
+	window = max(window, 1);
+
+	/* stop at the end of the device or at data we already have */
+	for (i = 1; i < window; i++) {
+		struct chunk *chunk;
+		int start = block_start + i * blk->rdbufsize;
+
+		if (start >= blk->num_blocks)
+			break;
+
+		chunk = chunk_lookup_from(blk, start);
+		if (chunk && chunk->block_start == start)
+			break;
+	}
+
+	return i;
+}
+
 /*
  * read a block into the cache. This assumes that the block is
  * not cached already. By definition block_get_cached() for
@@ -132,24 +412,61 @@ static struct chunk *get_chunk(struct block_device *blk)
  */
 static int block_cache(struct block_device *blk, int block)
 {
-	struct chunk *chunk;
-	size_t num_blocks;
-	int ret;
+	struct chunk *chunk = NULL;
+	int block_start = block & ~blk->blkmask;
+	int window, num_blocks, i, ret;
+	void *buf;
 
-	chunk = get_chunk(blk);
-	chunk->block_start = block & ~blk->blkmask;
+	window = block_readahead_window(blk, block_start);
 
-	debug("%s: %d to %d\n", __func__, chunk->block_start,
-			chunk->num);
+	num_blocks = min(window * blk->rdbufsize, blk->num_blocks - block_start);
+
+	if (window == 1) {
+		chunk = get_chunk(blk);
+		if (IS_ERR(chunk))
+			return PTR_ERR(chunk);
+		buf = chunk->data;
+	} else {
+		buf = block_bounce_buf(blk);
+	}
 
-	num_blocks = min(blk->rdbufsize, blk->num_blocks - chunk->block_start);
+	debug("%s: %d, %d chunks\n", __func__, block_start, window);
 
-	ret = blk->ops->read(blk, chunk->data, chunk->block_start, num_blocks);
+	ret = block_dev_read(blk, buf, block_start, num_blocks);
 	if (ret) {
-		list_add_tail(&chunk->list, &blk->idle_blocks);
+		if (window == 1)
+			list_add_tail(&chunk->list, &blk->idle_blocks);
+		blk->ra_window = 0;
 		return ret;
 	}
-	list_add(&chunk->list, &blk->buffered_blocks);
+
+	/*
+	 * Insert the last chunk first so that the chunk which was asked for
+	 * ends up as the most recently used one, followed by the chunks read
+	 * ahead in the order they will be needed.
+	 */
+	for (i = window - 1; i >= 0; i--) {
+		int start = block_start + i * blk->rdbufsize;
+
+		if (window > 1) {
+			chunk = get_chunk(blk);
+			if (IS_ERR(chunk)) {
+				blk->ra_window = 0;
+				return PTR_ERR(chunk);
+			}
+			memcpy(chunk->data,
+				buf + ((i * blk->rdbufsize) << blk->blockbits),
+				min(blk->rdbufsize, blk->num_blocks - start) <<
+				blk->blockbits);
+		}
+
+		chunk->block_start = start;
+		list_add(&chunk->list, &blk->buffered_blocks);
+		chunk_tree_insert(blk, chunk);
+	}
+
+	blk->ra_window = window;
+	blk->ra_next = block_start + window * blk->rdbufsize;
 
 	return 0;
 }
@@ -167,8 +484,12 @@ static void *block_get(struct block_device *blk, int block)
 		return ERR_PTR(-ENXIO);
 
 	outdata = block_get_cached(blk, block);
-	if (outdata)
+	if (outdata) {
+		blk->cache_hits++;
 		return outdata;
+	}
+
+	blk->cache_misses++;
 
 	ret = block_cache(blk, block);
 	if (ret)
@@ -181,6 +502,70 @@ static void *block_get(struct block_device *blk, int block)
 	return outdata;
 }
 
+/*
+ * Transfers of at least a chunk into a suitably aligned buffer bypass
+ * the cache. They need neither the extra copy nor the split into
+ * chunk sized device requests.
+ */
+static int block_direct(struct block_device *blk, const void *buf, int block,
+		int num_blocks)
+{
+	return num_blocks >= blk->rdbufsize &&
+		block + num_blocks <= blk->num_blocks &&
+		IS_ALIGNED((unsigned long)buf, DMA_ALIGNMENT);
+}
+
+/*
+ * Get the overlap of a chunk with a range of blocks. Returns the first
+ * block of the overlap and stores the number of blocks in *num.
+ */
+static int chunk_overlap(struct block_device *blk, struct chunk *chunk,
+		int block, int num_blocks, int *num)
+{
+	int start = max(block, chunk->block_start);
+	int end = min(block + num_blocks, chunk_end(blk, chunk));
+
+	*num = end - start;
+
+	return start;
+}
+
+/*
+ * Read blocks from the device into buf. Dirty blocks in the cache are
+ * newer than the device, so they are copied over what was read.
+ */
+static int block_read_direct(struct block_device *blk, void *buf, int block,
+		int num_blocks)
+{
+	struct chunk *chunk;
+	int ret, start, num;
+
+	ret = block_dev_read(blk, buf, block, num_blocks);
+	if (ret)
+		return ret;
+
+	for (chunk = chunk_lookup_from(blk, block);
+			chunk && chunk->block_start < block + num_blocks;
+			chunk = chunk_next(chunk)) {
+		if (!chunk->dirty)
+			continue;
+
+		start = max(block, chunk->dirty_start);
+		num = min(block + num_blocks, chunk->dirty_end) - start;
+		if (num <= 0)
+			continue;
+
+		memcpy(buf + ((start - block) << blk->blockbits),
+			chunk->data + ((start - chunk->block_start) << blk->blockbits),
+			num << blk->blockbits);
+	}
+
+	/* a following small read continues the stream */
+	blk->ra_next = block + num_blocks;
+
+	return 0;
+}
+
 static ssize_t block_op_read(struct cdev *cdev, void *buf, size_t count,
 		loff_t offset, unsigned long flags)
 {
@@ -207,6 +592,18 @@ static ssize_t block_op_read(struct cdev *cdev, void *buf, size_t count,
 
 	blocks = count >> blk->blockbits;
 
+	if (block_direct(blk, buf, block, blocks)) {
+		int ret = block_read_direct(blk, buf, block, blocks);
+
+		if (ret)
+			return ret;
+
+		buf += blocks << blk->blockbits;
+		count -= blocks << blk->blockbits;
+		block += blocks;
+		blocks = 0;
+	}
+
 	while (blocks) {
 		void *iobuf = block_get(blk, block);
 
@@ -253,7 +650,70 @@ static int block_put(struct block_device *blk, const void *buf, int block)
 	memcpy(data, buf, 1 << blk->blockbits);
 
 	chunk = chunk_get_cached(blk, block);
-	chunk->dirty = 1;
+	chunk_mark_dirty(chunk, block, 1);
+
+	return 0;
+}
+
+/*
+ * Put the data of a whole chunk into the cache. Unlike block_put() this
+ * does not read the chunk from the device first, all of it is replaced.
+ * Returns the number of blocks put or a negative error code.
+ */
+static int chunk_put(struct block_device *blk, const void *buf, int block)
+{
+	struct chunk *chunk;
+	int num_blocks = min(blk->rdbufsize, blk->num_blocks - block);
+
+	chunk = chunk_get_cached(blk, block);
+	if (!chunk) {
+		chunk = get_chunk(blk);
+		if (IS_ERR(chunk))
+			return PTR_ERR(chunk);
+		chunk->block_start = block;
+		list_add(&chunk->list, &blk->buffered_blocks);
+		chunk_tree_insert(blk, chunk);
+	}
+
+	memcpy(chunk->data, buf, num_blocks << blk->blockbits);
+	chunk_mark_dirty(chunk, block, num_blocks);
+
+	return num_blocks;
+}
+
+/*
+ * Write blocks from buf to the device. Cached chunks which are completely
+ * overwritten are dropped, the others get a copy of the new data.
+ */
+static int block_write_direct(struct block_device *blk, const void *buf,
+		int block, int num_blocks)
+{
+	struct chunk *chunk, *next;
+	int ret, start, num;
+
+	ret = block_dev_write(blk, buf, block, num_blocks);
+	if (ret)
+		return ret;
+
+	for (chunk = chunk_lookup_from(blk, block);
+			chunk && chunk->block_start < block + num_blocks;
+			chunk = next) {
+		next = chunk_next(chunk);
+
+		start = chunk_overlap(blk, chunk, block, num_blocks, &num);
+
+		if (start == chunk->block_start &&
+				start + num == chunk_end(blk, chunk)) {
+			rb_erase(&chunk->node, &blk->chunk_tree);
+			list_move_tail(&chunk->list, &blk->idle_blocks);
+			chunk->dirty = 0;
+			continue;
+		}
+
+		memcpy(chunk->data + ((start - chunk->block_start) << blk->blockbits),
+			buf + ((start - block) << blk->blockbits),
+			num << blk->blockbits);
+	}
 
 	return 0;
 }
@@ -288,15 +748,35 @@ static ssize_t block_op_write(struct cdev *cdev, const void *buf, size_t count,
 
 	blocks = count >> blk->blockbits;
 
-	while (blocks) {
-		ret = block_put(blk, buf, block);
+	if (block_direct(blk, buf, block, blocks)) {
+		ret = block_write_direct(blk, buf, block, blocks);
 		if (ret)
 			return ret;
 
-		buf += BLOCKSIZE(blk);
-		blocks--;
-		block++;
-		count -= BLOCKSIZE(blk);
+		buf += blocks << blk->blockbits;
+		count -= blocks << blk->blockbits;
+		block += blocks;
+		blocks = 0;
+	}
+
+	while (blocks) {
+		int num = 1;
+
+		if (!(block & blk->blkmask) && block < blk->num_blocks &&
+				blocks >= min_t(int, blk->rdbufsize, blk->num_blocks - block)) {
+			num = chunk_put(blk, buf, block);
+			if (num < 0)
+				return num;
+		} else {
+			ret = block_put(blk, buf, block);
+			if (ret)
+				return ret;
+		}
+
+		buf += num << blk->blockbits;
+		blocks -= num;
+		block += num;
+		count -= num << blk->blockbits;
 	}
 
 	if (count) {
@@ -339,36 +819,139 @@ static struct file_operations block_ops = {
 	.lseek	= dev_lseek_default,
 };
 
-int blockdevice_register(struct block_device *blk)
+static void block_free_chunks(struct list_head *list)
 {
-	loff_t size = (loff_t)blk->num_blocks * BLOCKSIZE(blk);
-	int ret;
-	int i;
+	struct chunk *chunk, *tmp;
 
-	blk->cdev.size = size;
-	blk->cdev.dev = blk->dev;
-	blk->cdev.ops = &block_ops;
-	blk->cdev.priv = blk;
-	blk->rdbufsize = BUFSIZE >> blk->blockbits;
+	list_for_each_entry_safe(chunk, tmp, list, list) {
+		dma_free(chunk->data);
+		free(chunk);
+	}
+}
 
+/*
+ * (Re)allocate the chunks after the number or the size of the chunks
+ * changed. Dirty data is written back before the old chunks are freed,
+ * the change fails if that is not possible.
+ */
+static int block_alloc_chunks(struct block_device *blk)
+{
+	int i, ret;
+
+	if (blk->cache_chunks < 1 || blk->cache_chunks > MAX_CHUNKS ||
+			blk->cache_chunksize < BLOCKSIZE(blk) ||
+			blk->cache_chunksize > MAX_CHUNKSIZE ||
+			!is_power_of_2(blk->cache_chunksize))
+		return -EINVAL;
+
+	/* don't throw away data which didn't make it to the device */
+	ret = writebuffer_flush(blk);
+	if (ret)
+		return ret;
+
+	block_free_chunks(&blk->buffered_blocks);
+	block_free_chunks(&blk->idle_blocks);
 	INIT_LIST_HEAD(&blk->buffered_blocks);
 	INIT_LIST_HEAD(&blk->idle_blocks);
+	blk->chunk_tree = RB_ROOT;
+
+	dma_free(blk->bounce_buf);
+	blk->bounce_buf = NULL;
+	blk->ra_window = 0;
+
+	blk->rdbufsize = blk->cache_chunksize >> blk->blockbits;
 	blk->blkmask = blk->rdbufsize - 1;
 
 	debug("%s: rdbufsize: %d blockbits: %d blkmask: 0x%08x\n", __func__, blk->rdbufsize, blk->blockbits,
 			blk->blkmask);
 
-	for (i = 0; i < 8; i++) {
+	for (i = 0; i < blk->cache_chunks; i++) {
 		struct chunk *chunk = xzalloc(sizeof(*chunk));
-		chunk->data = dma_alloc(BUFSIZE);
+		chunk->data = dma_alloc(blk->cache_chunksize);
 		chunk->num = i;
 		list_add_tail(&chunk->list, &blk->idle_blocks);
 	}
 
+	return 0;
+}
+
+static int block_set_cache(struct param_d *p, void *priv)
+{
+	return block_alloc_chunks(priv);
+}
+
+/* The read ahead limit is checked on each miss, the cache stays as it is */
+static int block_set_readahead(struct param_d *p, void *priv)
+{
+	struct block_device *blk = priv;
+
+	if (blk->cache_readahead < 0 || blk->cache_readahead > MAX_CHUNKS)
+		return -EINVAL;
+
+	blk->ra_window = 0;
+
+	return 0;
+}
+
+static void block_add_param(struct block_device *blk, int i, const char *name,
+		int (*set)(struct param_d *p, void *priv), int *value)
+{
+	struct device_d *dev = blk->dev;
+	char *pname;
+
+	/* several block devices can share a device, e.g. the eMMC boot partitions */
+	if (get_param_by_name(dev, name))
+		pname = asprintf("%s_%s", blk->cdev.name, name);
+	else
+		pname = xstrdup(name);
+
+	blk->cache_params[i] = dev_add_param_int(dev, pname, set, NULL, value,
+			"%u", blk);
+
+	free(pname);
+}
+
+static void block_add_params(struct block_device *blk)
+{
+	block_add_param(blk, 0, "cache_chunks", block_set_cache,
+			&blk->cache_chunks);
+	block_add_param(blk, 1, "cache_chunksize", block_set_cache,
+			&blk->cache_chunksize);
+	block_add_param(blk, 2, "cache_readahead", block_set_readahead,
+			&blk->cache_readahead);
+	block_add_param(blk, 3, "cache_hits", NULL, &blk->cache_hits);
+	block_add_param(blk, 4, "cache_misses", NULL, &blk->cache_misses);
+	block_add_param(blk, 5, "cache_evictions", NULL, &blk->cache_evictions);
+}
+
+int blockdevice_register(struct block_device *blk)
+{
+	loff_t size = (loff_t)blk->num_blocks * BLOCKSIZE(blk);
+	int ret;
+
+	blk->cdev.size = size;
+	blk->cdev.dev = blk->dev;
+	blk->cdev.ops = &block_ops;
+	blk->cdev.priv = blk;
+
+	INIT_LIST_HEAD(&blk->buffered_blocks);
+	INIT_LIST_HEAD(&blk->idle_blocks);
+
+	blk->cache_chunks = NUM_CHUNKS;
+	blk->cache_chunksize = max_t(int, BUFSIZE, BLOCKSIZE(blk));
+	blk->cache_readahead = NUM_READAHEAD;
+
+	ret = block_alloc_chunks(blk);
+	if (ret)
+		return ret;
+
 	ret = devfs_create(&blk->cdev);
 	if (ret)
 		return ret;
 
+	if (blk->dev)
+		block_add_params(blk);
+
 	list_add_tail(&blk->list, &block_device_list);
 
 	return 0;
@@ -376,19 +959,17 @@ int blockdevice_register(struct block_device *blk)
 
 int blockdevice_unregister(struct block_device *blk)
 {
-	struct chunk *chunk, *tmp;
+	int i;
 
 	writebuffer_flush(blk);
 
-	list_for_each_entry_safe(chunk, tmp, &blk->buffered_blocks, list) {
-		dma_free(chunk->data);
-		free(chunk);
-	}
+	block_free_chunks(&blk->buffered_blocks);
+	block_free_chunks(&blk->idle_blocks);
+	dma_free(blk->bounce_buf);
 
-	list_for_each_entry_safe(chunk, tmp, &blk->idle_blocks, list) {
-		dma_free(chunk->data);
-		free(chunk);
-	}
+	for (i = 0; i < ARRAY_SIZE(blk->cache_params); i++)
+		if (!IS_ERR_OR_NULL(blk->cache_params[i]))
+			dev_remove_param(blk->cache_params[i]);
 
 	devfs_remove(&blk->cdev);
 	list_del(&blk->list);
@@ -31,6 +31,7 @@
 #include <kfifo.h>
 #include <module.h>
 #include <poller.h>
+#include <prefetch.h>
 #include <magicvar.h>
 #include <globalvar.h>
 #include <linux/list.h>
@@ -281,6 +282,10 @@ int getc(void)
 		if (is_timeout(start, 100 * USECOND) &&
 				kfifo_len(console_input_fifo))
 			break;
+
+		/* waiting for the user, nothing else is in progress */
+		if (!kfifo_len(console_input_fifo))
+			prefetch_idle();
 	}
 
 	kfifo_getc(console_input_fifo, &ch);
@@ -0,0 +1,245 @@
+/*
+ * prefetch.c - copy files in the background
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+/*
+ * A prefetch copies a file, usually from a network filesystem to a ramfs,
+ * while barebox waits for the user. Each time prefetch_idle() is called,
+ * one chunk of every running transfer is copied. Opening the destination
+ * file waits for its transfer to finish, so users never see a partial file.
+ */
+#include <common.h>
+#include <clock.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fs.h>
+#include <libbb.h>
+#include <malloc.h>
+#include <prefetch.h>
+#include <sizes.h>
+#include <asm-generic/div64.h>
+#include <linux/list.h>
+
+#define PREFETCH_CHUNK	SZ_16K
+
+struct prefetch {
+	struct list_head list;
+	char *src;
+	char *dst;
+	int in, out;
+	void *buf;
+	loff_t done;
+	int err;		/* 0 while running, 1 when finished */
+	uint64_t start;
+	uint64_t end;
+};
+
+static LIST_HEAD(prefetch_list);
+static int prefetch_running;
+static int prefetch_busy;
+
+static void prefetch_close(struct prefetch *p, int err)
+{
+	close(p->in);
+	close(p->out);
+	free(p->buf);
+	p->buf = NULL;
+	p->err = err;
+	p->end = get_time_ns();
+	prefetch_running--;
+}
+
+/* Copy the next chunk of a running transfer */
+static void prefetch_step(struct prefetch *p)
+{
+	int now, ret;
+
+	now = read(p->in, p->buf, PREFETCH_CHUNK);
+	if (now <= 0) {
+		prefetch_close(p, now ? now : 1);
+		return;
+	}
+
+	ret = write_full(p->out, p->buf, now);
+	if (ret < 0) {
+		prefetch_close(p, ret);
+		return;
+	}
+
+	p->done += now;
+}
+
+/**
+ * prefetch_idle - advance the background transfers
+ *
+ * Call this only where barebox waits for the user and no other operation
+ * is in progress. The pollers are no such place: they also run from the
+ * busy loops of filesystems and drivers, which the read() and write() of a
+ * transfer would re-enter.
+ */
+void prefetch_idle(void)
+{
+	struct prefetch *p;
+
+	if (!prefetch_running || prefetch_busy)
+		return;
+
+	prefetch_busy = 1;
+
+	list_for_each_entry(p, &prefetch_list, list)
+		if (!p->err)
+			prefetch_step(p);
+
+	prefetch_busy = 0;
+}
+
+static struct prefetch *prefetch_find(const char *dst)
+{
+	struct prefetch *p;
+
+	list_for_each_entry(p, &prefetch_list, list)
+		if (!strcmp(p->dst, dst))
+			return p;
+
+	return NULL;
+}
+
+static void prefetch_free(struct prefetch *p)
+{
+	list_del(&p->list);
+	free(p->src);
+	free(p->dst);
+	free(p);
+}
+
+/**
+ * prefetch_start - start copying a file in the background
+ * @src: file to copy, usually on a network filesystem
+ * @dst: destination file, usually on a ramfs
+ *
+ * The copy proceeds whenever barebox waits for the user, see
+ * prefetch_idle(). A following open() of @dst waits until it is complete.
+ */
+int prefetch_start(const char *src, const char *dst)
+{
+	struct prefetch *p;
+	char *path;
+	int ret;
+
+	path = normalise_path(dst);
+
+	p = prefetch_find(path);
+	if (p) {
+		if (!p->err) {
+			free(path);
+			return -EBUSY;
+		}
+		prefetch_free(p);
+	}
+
+	p = xzalloc(sizeof(*p));
+	p->dst = path;
+	p->src = xstrdup(src);
+	p->buf = xmalloc(PREFETCH_CHUNK);
+
+	p->in = open(src, O_RDONLY);
+	if (p->in < 0) {
+		ret = p->in;
+		goto err_free;
+	}
+
+	p->out = open(dst, O_WRONLY | O_CREAT | O_TRUNC);
+	if (p->out < 0) {
+		ret = p->out;
+		goto err_close;
+	}
+
+	p->start = get_time_ns();
+	list_add_tail(&p->list, &prefetch_list);
+	prefetch_running++;
+
+	return 0;
+
+err_close:
+	close(p->in);
+err_free:
+	free(p->buf);
+	free(p->src);
+	free(p->dst);
+	free(p);
+
+	return ret;
+}
+
+/**
+ * prefetch_wait - finish a background transfer
+ * @dst: destination of the transfer, NULL for all of them
+ *
+ * Return 0 if the transfer completed or none was started for @dst, a
+ * negative error code if it failed.
+ */
+int prefetch_wait(const char *dst)
+{
+	struct prefetch *p, *tmp;
+	char *path = NULL;
+	int ret = 0;
+
+	if (list_empty(&prefetch_list) || prefetch_busy)
+		return 0;
+
+	if (dst)
+		path = normalise_path(dst);
+
+	prefetch_busy = 1;
+
+	list_for_each_entry_safe(p, tmp, &prefetch_list, list) {
+		if (path && strcmp(p->dst, path))
+			continue;
+
+		while (!p->err) {
+			if (ctrlc()) {
+				prefetch_close(p, -EINTR);
+				break;
+			}
+			prefetch_step(p);
+		}
+
+		if (p->err < 0) {
+			ret = p->err;
+			unlink(p->dst);
+		}
+
+		prefetch_free(p);
+	}
+
+	prefetch_busy = 0;
+
+	free(path);
+
+	return ret;
+}
+
+void prefetch_info(void)
+{
+	struct prefetch *p;
+
+	list_for_each_entry(p, &prefetch_list, list) {
+		uint64_t ms = (p->err ? p->end : get_time_ns()) - p->start;
+
+		do_div(ms, MSECOND);
+		printf("%s -> %s: %lld bytes in %llums, %s\n", p->src, p->dst,
+				p->done, ms,
+				p->err > 0 ? "done" :
+				p->err < 0 ? strerror(-p->err) : "running");
+	}
+}
@@ -173,6 +173,8 @@ static inline uint32_t dwmci_readl(struct dwmci_host *host, int reg)
 }
 
 #define DW_MMC_NUM_IDMACS	(PAGE_SIZE / sizeof(struct dwmci_idmac))
+/* each descriptor transfers up to 8 blocks of 512 bytes, one page */
+#define DW_MMC_MAX_BLOCKS	(DW_MMC_NUM_IDMACS * 8)
 
 static inline struct dwmci_host *to_dwmci_host(struct mci_host *mci)
 {
@@ -207,7 +209,7 @@ static int dwmci_prepare_data(struct dwmci_host *host,
 
 	blk_cnt = data->blocks;
 
-	if (blk_cnt > DW_MMC_NUM_IDMACS)
+	if (blk_cnt > DW_MMC_MAX_BLOCKS)
 		return -EINVAL;
 
 	dwmci_wait_reset(host, DWMCI_CTRL_FIFO_RESET);
@@ -238,7 +240,7 @@ static int dwmci_prepare_data(struct dwmci_host *host,
 
 		dev_dbg(host->dev, "desc@ 0x%p 0x%08x 0x%08x 0x%08x 0x%08x\n",
 				desc, flags, cnt, desc->addr, desc->next_addr);
-		if (blk_cnt < 8)
+		if (blk_cnt <= 8)
 			break;
 
 		blk_cnt -= 8;
@@ -573,6 +575,7 @@ static int dw_mmc_probe(struct device_d *dev)
 	host->mci.hw_dev = dev;
 	host->mci.voltages = MMC_VDD_32_33 | MMC_VDD_33_34;
 	host->mci.host_caps = MMC_CAP_4_BIT_DATA | MMC_CAP_8_BIT_DATA;
+	host->mci.max_req_size = DW_MMC_MAX_BLOCKS * 512;
 
 	dev->detect = dw_mmc_detect;
 
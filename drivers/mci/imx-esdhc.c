@@ -574,6 +574,8 @@ static int fsl_esdhc_probe(struct device_d *dev)
 	host->mci.init = esdhc_init;
 	host->mci.card_present = esdhc_card_present;
 	host->mci.hw_dev = dev;
+	/* the block count register is 16 bits wide */
+	host->mci.max_req_size = 0xffff * 512;
 
 	dev->detect = fsl_esdhc_detect,
 
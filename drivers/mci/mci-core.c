@@ -35,6 +35,7 @@
 #include <block.h>
 #include <disks.h>
 #include <of.h>
+#include <sizes.h>
 #include <linux/err.h>
 
 #define MAX_BUFFER_NUMBER 0xffffffff
@@ -1570,7 +1571,7 @@ static const char *mci_boot_names[] = {
 static int mci_card_probe(struct mci *mci)
 {
 	struct mci_host *host = mci->host;
-	int i, rc, disknum, ret;
+	int i, rc, disknum, ret, max_req_blocks;
 
 	if (host->card_present && !host->card_present(host) &&
 	    !host->non_removable) {
@@ -1631,6 +1632,15 @@ static int mci_card_probe(struct mci *mci)
 	dev_dbg(&mci->dev, "Card is up and running now, registering as a disk\n");
 	mci->ready_for_use = 1;	/* TODO now or later? */
 
+	/*
+	 * Many hosts don't tell how many blocks they can transfer at once.
+	 * Give them no larger requests than the block cache always used.
+	 */
+	if (host->max_req_size)
+		max_req_blocks = host->max_req_size >> SECTOR_SHIFT;
+	else
+		max_req_blocks = SZ_64K >> SECTOR_SHIFT;
+
 	for (i = 0; i < mci->nr_parts; i++) {
 		struct mci_part *part = &mci->part[i];
 
@@ -1640,6 +1650,7 @@ static int mci_card_probe(struct mci *mci)
 		 */
 		part->blk.dev = &mci->dev;
 		part->blk.ops = &mci_ops;
+		part->blk.max_blocks = max_req_blocks;
 
 		rc = blockdevice_register(&part->blk);
 		if (rc != 0) {
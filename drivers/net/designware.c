@@ -38,6 +38,8 @@ struct dw_eth_dev {
 	void (*fix_mac_speed)(int speed);
 	u8 macaddr[6];
 	u32 tx_currdescnum;
+	u32 tx_dirtydescnum;	/* oldest descriptor still owned by the DMA */
+	u32 tx_pending;
 	u32 rx_currdescnum;
 
 	struct dmamacdescr *tx_mac_descrtable;
@@ -51,6 +53,11 @@ struct dw_eth_dev {
 	int phy_addr;
 	phy_interface_t interface;
 	int enh_desc;
+	int rx_coe;
+
+	/* jumbo frame spread over several receive descriptors */
+	u8 *rx_frame;
+	int rx_frame_len;
 };
 
 struct dw_eth_drvdata {
@@ -227,7 +234,22 @@ static int dwc_ether_init(struct eth_device *dev)
 	writel(FIXEDBURST | PRIORXTX_41 | BURST_16, &dma_p->busmode);
 	writel(FLUSHTXFIFO | readl(&dma_p->opmode), &dma_p->opmode);
 	writel(STOREFORWARD | TXSECONDFRAME, &dma_p->opmode);
-	writel(FRAMEBURSTENABLE | DISABLERXOWN, &mac_p->conf);
+	if (ETH_MAX_MTU > ETH_DATA_LEN)
+		writel(FRAMEBURSTENABLE | DISABLERXOWN | JUMBOFRAME,
+		       &mac_p->conf);
+	else
+		writel(FRAMEBURSTENABLE | DISABLERXOWN, &mac_p->conf);
+
+	/*
+	 * The checksum offload bit is read-only zero on cores synthesized
+	 * without the receive checksum engine. Status bits of enhanced
+	 * descriptors differ, only use it with normal ones.
+	 */
+	if (!priv->enh_desc) {
+		writel(readl(&mac_p->conf) | CHECKSUMOFFLOAD, &mac_p->conf);
+		priv->rx_coe = !!(readl(&mac_p->conf) & CHECKSUMOFFLOAD);
+	}
+
 	return 0;
 }
 
@@ -285,92 +307,235 @@ static int dwc_ether_open(struct eth_device *dev)
 	return 0;
 }
 
+static int dwc_ether_tx_reap(struct eth_device *dev)
+{
+	struct dw_eth_dev *priv = dev->priv;
+	u32 owndma;
+
+	owndma = priv->enh_desc ? DESC_ENH_TXSTS_OWNBYDMA : DESC_TXSTS_OWNBYDMA;
+
+	while (priv->tx_pending) {
+		struct dmamacdescr *desc_p =
+			&priv->tx_mac_descrtable[priv->tx_dirtydescnum];
+
+		if (desc_p->txrx_status & owndma)
+			break;
+
+		if (++priv->tx_dirtydescnum >= CONFIG_TX_DESCR_NUM)
+			priv->tx_dirtydescnum = 0;
+		priv->tx_pending--;
+	}
+
+	return priv->tx_pending;
+}
+
+/*
+ * Frames longer than a descriptor buffer, i.e. jumbo frames, are spread
+ * over several descriptors.
+ */
+#define DWC_SEG_SIZE	MAC_MAX_FRAME_SZ
+
+static void dwc_ether_tx_segment(struct dw_eth_dev *priv,
+				 struct dmamacdescr *desc_p, int len,
+				 int first, int last)
+{
+	if (priv->enh_desc) {
+		desc_p->txrx_status &= ~(DESC_ENH_TXSTS_TXFIRST |
+					 DESC_ENH_TXSTS_TXLAST |
+					 DESC_ENH_TXSTS_MSK);
+		if (first)
+			desc_p->txrx_status |= DESC_ENH_TXSTS_TXFIRST;
+		if (last)
+			desc_p->txrx_status |= DESC_ENH_TXSTS_TXLAST;
+
+		desc_p->dmamac_cntl &= ~DESC_ENH_TXCTRL_SIZE1MASK;
+		desc_p->dmamac_cntl |= (len << DESC_ENH_TXCTRL_SIZE1SHFT) &
+				       DESC_ENH_TXCTRL_SIZE1MASK;
+	} else {
+		desc_p->dmamac_cntl &= ~(DESC_TXCTRL_SIZE1MASK |
+					 DESC_TXCTRL_TXFIRST |
+					 DESC_TXCTRL_TXLAST);
+		desc_p->dmamac_cntl |= (len << DESC_TXCTRL_SIZE1SHFT) &
+				       DESC_TXCTRL_SIZE1MASK;
+		if (first)
+			desc_p->dmamac_cntl |= DESC_TXCTRL_TXFIRST;
+		if (last)
+			desc_p->dmamac_cntl |= DESC_TXCTRL_TXLAST;
+
+		desc_p->txrx_status = 0;
+	}
+}
+
 static int dwc_ether_send(struct eth_device *dev, void *packet, int length)
 {
 	struct dw_eth_dev *priv = dev->priv;
 	struct eth_dma_regs *dma_p = priv->dma_regs_p;
 	u32 owndma, desc_num = priv->tx_currdescnum;
-	struct dmamacdescr *desc_p = &priv->tx_mac_descrtable[desc_num];
+	struct dmamacdescr *desc_p, *first_p = NULL;
+	int nsegs = DIV_ROUND_UP(length, DWC_SEG_SIZE);
+	int offset, len;
+	uint64_t start;
 
 	owndma = priv->enh_desc ? DESC_ENH_TXSTS_OWNBYDMA : DESC_TXSTS_OWNBYDMA;
-	/* Check if the descriptor is owned by CPU */
-	if (desc_p->txrx_status & owndma) {
-		dev_err(&dev->dev, "CPU not owner of tx frame\n");
-		return -1;
+
+	if (nsegs > CONFIG_TX_DESCR_NUM)
+		return -EMSGSIZE;
+
+	/* Wait for the DMA to release enough descriptors if all are queued */
+	start = get_time_ns();
+	while (CONFIG_TX_DESCR_NUM - dwc_ether_tx_reap(dev) < nsegs) {
+		if (is_timeout(start, SECOND)) {
+			dev_err(&dev->dev, "CPU not owner of tx frame\n");
+			return -ETIMEDOUT;
+		}
 	}
 
-	memcpy((void *)desc_p->dmamac_addr, packet, length);
-	dma_flush_range((unsigned long)desc_p->dmamac_addr,
-			(unsigned long)desc_p->dmamac_addr + length);
+	for (offset = 0; offset < length; offset += len) {
+		desc_p = &priv->tx_mac_descrtable[desc_num];
+		len = min(length - offset, DWC_SEG_SIZE);
 
-	if (priv->enh_desc) {
-		desc_p->txrx_status |= DESC_ENH_TXSTS_TXFIRST | DESC_ENH_TXSTS_TXLAST;
-		desc_p->dmamac_cntl |= (length << DESC_ENH_TXCTRL_SIZE1SHFT) &
-				       DESC_ENH_TXCTRL_SIZE1MASK;
+		memcpy((void *)desc_p->dmamac_addr, packet + offset, len);
+		dma_flush_range((unsigned long)desc_p->dmamac_addr,
+				(unsigned long)desc_p->dmamac_addr + len);
 
-		desc_p->txrx_status &= ~(DESC_ENH_TXSTS_MSK);
-		desc_p->txrx_status |= DESC_ENH_TXSTS_OWNBYDMA;
-	} else {
-		desc_p->dmamac_cntl |= ((length << DESC_TXCTRL_SIZE1SHFT) &
-				       DESC_TXCTRL_SIZE1MASK) | DESC_TXCTRL_TXLAST |
-				       DESC_TXCTRL_TXFIRST;
+		dwc_ether_tx_segment(priv, desc_p, len, !offset,
+				     offset + len == length);
+
+		/* Hand over the first descriptor once the frame is complete */
+		if (first_p)
+			desc_p->txrx_status |= owndma;
+		else
+			first_p = desc_p;
 
-		desc_p->txrx_status = DESC_TXSTS_OWNBYDMA;
+		/* Test the wrap-around condition. */
+		if (++desc_num >= CONFIG_TX_DESCR_NUM)
+			desc_num = 0;
 	}
 
-	/* Test the wrap-around condition. */
-	if (++desc_num >= CONFIG_TX_DESCR_NUM)
-		desc_num = 0;
+	first_p->txrx_status |= owndma;
 
 	priv->tx_currdescnum = desc_num;
+	priv->tx_pending += nsegs;
 
-	/* Start the transmission */
+	/* Start the transmission, dwc_ether_tx_reap() reclaims the descriptor */
 	writel(POLL_DATA, &dma_p->txpolldemand);
 	return 0;
 }
 
-static int dwc_ether_rx(struct eth_device *dev)
+/*
+ * Collect a frame spread over several descriptors. The length field of the
+ * last descriptor holds the length of the whole frame.
+ */
+static void dwc_ether_rx_segment(struct eth_device *dev,
+				 struct dmamacdescr *desc_p, u32 status)
 {
 	struct dw_eth_dev *priv = dev->priv;
-	u32 desc_num = priv->rx_currdescnum;
-	struct dmamacdescr *desc_p = &priv->rx_mac_descrtable[desc_num];
+	int len;
 
-	u32 status = desc_p->txrx_status;
-	int length = 0;
+	if (status & DESC_RXSTS_RXFIRST)
+		priv->rx_frame_len = 0;
+	else if (priv->rx_frame_len < 0)
+		return;
 
-	/* Check  if the owner is the CPU */
-	if (status & DESC_RXSTS_OWNBYDMA)
-		return 0;
+	if (status & DESC_RXSTS_RXLAST)
+		len = ((status & DESC_RXSTS_FRMLENMSK) >> DESC_RXSTS_FRMLENSHFT) -
+		      priv->rx_frame_len;
+	else
+		len = DWC_SEG_SIZE;
 
-	length = (status & DESC_RXSTS_FRMLENMSK) >>
-		 DESC_RXSTS_FRMLENSHFT;
+	if (len < 0 || priv->rx_frame_len + len > eth_max_frame(dev)) {
+		dev->rx_errors++;
+		priv->rx_frame_len = -1;
+		return;
+	}
 
-	/*
-	 * Make the current descriptor valid again and go to
-	 * the next one
-	 */
 	dma_inv_range((unsigned long)desc_p->dmamac_addr,
-		      (unsigned long)desc_p->dmamac_addr + length);
+		      (unsigned long)desc_p->dmamac_addr + len);
+	memcpy(priv->rx_frame + priv->rx_frame_len, desc_p->dmamac_addr, len);
+	priv->rx_frame_len += len;
+
+	if (status & DESC_RXSTS_RXLAST) {
+		/* the error summary is only valid in the last descriptor */
+		if (status & DESC_RXSTS_ERROR)
+			dev->rx_errors++;
+		else
+			net_receive(dev, priv->rx_frame, priv->rx_frame_len);
+		priv->rx_frame_len = -1;
+	}
+}
 
-	net_receive(dev, desc_p->dmamac_addr, length);
+static int dwc_ether_rx(struct eth_device *dev, int budget)
+{
+	struct dw_eth_dev *priv = dev->priv;
+	u32 desc_num = priv->rx_currdescnum;
+	struct dmamacdescr *desc_p;
+	u32 status;
+	int length;
+	int count = 0;
+
+	while (count < budget) {
+		desc_p = &priv->rx_mac_descrtable[desc_num];
+		status = desc_p->txrx_status;
+
+		/* Check  if the owner is the CPU */
+		if (status & DESC_RXSTS_OWNBYDMA)
+			break;
+
+		if ((status & (DESC_RXSTS_RXFIRST | DESC_RXSTS_RXLAST)) !=
+		    (DESC_RXSTS_RXFIRST | DESC_RXSTS_RXLAST)) {
+			dwc_ether_rx_segment(dev, desc_p, status);
+			goto next;
+		}
 
-	desc_p->txrx_status |= DESC_RXSTS_OWNBYDMA;
+		length = (status & DESC_RXSTS_FRMLENMSK) >>
+			 DESC_RXSTS_FRMLENSHFT;
 
-	/* Test the wrap-around condition. */
-	if (++desc_num >= CONFIG_RX_DESCR_NUM)
-		desc_num = 0;
+		/*
+		 * Make the current descriptor valid again and go to
+		 * the next one
+		 */
+		dma_inv_range((unsigned long)desc_p->dmamac_addr,
+			      (unsigned long)desc_p->dmamac_addr + length);
+
+		/* IPv4 frame with correct header and payload checksums */
+		if (priv->rx_coe &&
+		    (status & DESC_RXSTS_RXCSUMMSK) == DESC_RXSTS_RXCSUMOK)
+			net_receive_csum(dev, desc_p->dmamac_addr, length,
+					 NET_RX_CSUM_IP | NET_RX_CSUM_L4);
+		else
+			net_receive(dev, desc_p->dmamac_addr, length);
+next:
+		desc_p->txrx_status |= DESC_RXSTS_OWNBYDMA;
+
+		/* Test the wrap-around condition. */
+		if (++desc_num >= CONFIG_RX_DESCR_NUM)
+			desc_num = 0;
+
+		count++;
+	}
 
 	priv->rx_currdescnum = desc_num;
 
-	return length;
+	/* Frames lost because the ring was full can only occur with a busy ring */
+	if (count) {
+		u32 missed = readl(&priv->dma_regs_p->missedframecount);
+
+		missed = MISSEDFRM_BUFFER(missed) + MISSEDFRM_FIFO(missed);
+		dev->rx_dropped += missed;
+		dev->rx_drop[ETH_DROP_OVERRUN] += missed;
+	}
+
+	return count;
 }
 
 static void dwc_ether_halt (struct eth_device *dev)
 {
 	struct dw_eth_dev *priv = dev->priv;
 
+	eth_tx_flush(dev);
 	mac_reset(dev);
 	priv->tx_currdescnum = priv->rx_currdescnum = 0;
+	priv->tx_dirtydescnum = priv->tx_pending = 0;
 }
 
 static int dwc_ether_get_ethaddr(struct eth_device *dev, u8 adr[6])
@@ -449,6 +614,7 @@ static int dwc_ether_probe(struct device_d *dev)
 		CONFIG_RX_DESCR_NUM * sizeof(struct dmamacdescr));
 	priv->txbuffs = dma_alloc(TX_TOTAL_BUFSIZE);
 	priv->rxbuffs = dma_alloc(RX_TOTAL_BUFSIZE);
+	priv->rx_frame_len = -1;
 
 	edev = &priv->netdev;
 	miibus = &priv->miibus;
@@ -458,7 +624,10 @@ static int dwc_ether_probe(struct device_d *dev)
 	edev->init = dwc_ether_init;
 	edev->open = dwc_ether_open;
 	edev->send = dwc_ether_send;
-	edev->recv = dwc_ether_rx;
+	edev->tx_reap = dwc_ether_tx_reap;
+	edev->max_mtu = ETH_MAX_MTU;
+	priv->rx_frame = xmalloc(eth_max_frame(edev));
+	edev->recv_batch = dwc_ether_rx;
 	edev->halt = dwc_ether_halt;
 	edev->get_ethaddr = dwc_ether_get_ethaddr;
 	edev->set_ethaddr = dwc_ether_set_ethaddr;
@@ -45,10 +45,12 @@ struct eth_mac_regs {
 
 /* MAC configuration register definitions */
 #define FRAMEBURSTENABLE	(1 << 21)
+#define JUMBOFRAME		(1 << 20)
 #define MII_PORTSELECT		(1 << 15)
 #define FES_100			(1 << 14)
 #define DISABLERXOWN		(1 << 13)
 #define FULLDPLXMODE		(1 << 11)
+#define CHECKSUMOFFLOAD		(1 << 10)
 #define RXENABLE		(1 << 2)
 #define TXENABLE		(1 << 3)
 
@@ -77,7 +79,8 @@ struct eth_dma_regs {
 	u32 status;		/* 0x14 */
 	u32 opmode;		/* 0x18 */
 	u32 intenable;		/* 0x1c */
-	u8 reserved[40];
+	u32 missedframecount;	/* 0x20 */
+	u8 reserved[36];
 	u32 currhosttxdesc;	/* 0x48 */
 	u32 currhostrxdesc;	/* 0x4c */
 	u32 currhosttxbuffaddr;	/* 0x50 */
@@ -101,6 +104,10 @@ struct eth_dma_regs {
 #define RXHIGHPRIO		(1 << 1)
 #define DMAMAC_SRST		(1 << 0)
 
+/* Missed frame counter definitions, cleared on read */
+#define MISSEDFRM_BUFFER(x)	((x) & 0xffff)
+#define MISSEDFRM_FIFO(x)	(((x) >> 17) & 0x7ff)
+
 /* Poll demand definitions */
 #define POLL_DATA		(0xFFFFFFFF)
 
@@ -162,6 +169,13 @@ struct dmamacdescr {
 #define DESC_RXSTS_RXMIIERROR		(1 << 3)
 #define DESC_RXSTS_RXDRIBBLING		(1 << 2)
 #define DESC_RXSTS_RXCRC		(1 << 1)
+#define DESC_RXSTS_RXPAYLOADERR		(1 << 0)
+
+/* Receive checksum offload result, valid with CHECKSUMOFFLOAD */
+#define DESC_RXSTS_RXCSUMMSK		(DESC_RXSTS_RXIPC_GIANT | \
+					 DESC_RXSTS_RXFRAMEETHER | \
+					 DESC_RXSTS_RXPAYLOADERR)
+#define DESC_RXSTS_RXCSUMOK		DESC_RXSTS_RXFRAMEETHER
 
 /*
  * dmamac_cntl definitions
@@ -22,6 +22,7 @@
 #include <fec.h>
 #include <io.h>
 #include <clock.h>
+#include <dma.h>
 #include <xfuncs.h>
 #include <linux/phy.h>
 #include <linux/clk.h>
@@ -153,19 +154,17 @@ static int fec_tx_task_disable(struct fec_priv *fec)
 
 /**
  * Swap endianess to send data on an i.MX28 based platform
+ * @param data Destination for the big endian data
  * @param buf Pointer to little endian data
  * @param len Size in words (max. 1500 bytes)
- * @return Pointer to the big endian data
  */
-static void *imx28_fix_endianess_wr(uint32_t *buf, unsigned wlen)
+static void imx28_fix_endianess_wr(uint32_t *data, uint32_t *buf,
+		unsigned wlen)
 {
 	unsigned u;
-	static uint32_t data[376];	/* = 1500 bytes + 4 bytes */
 
 	for (u = 0; u < wlen; u++, buf++)
 		data[u] = __swab32(*buf);
-
-	return data;
 }
 
 /**
@@ -216,19 +215,29 @@ static int fec_rbd_init(struct fec_priv *fec, int count, int size)
  * Initialize transmit task's buffer descriptors
  * @param[in] fec all we know about the device yet
  *
- * Transmit buffers are created externally. We only have to init the BDs here.\n
+ * Each BD owns one of the transmit buffers, frames are copied there so
+ * fec_send() can return while the hardware is still sending them.\n
  * Note: There is a race condition in the hardware. When only one BD is in
  * use it must be marked with the WRAP bit to use it for every transmit.
  * This bit in combination with the READY bit results into double transmit
  * of each data buffer. It seems the state machine checks READY earlier then
  * resetting it after the first transfer.
- * Using two BDs solves this issue.
+ * Using more than one BD solves this issue.
  */
 static void fec_tbd_init(struct fec_priv *fec)
 {
-	writew(0x0000, &fec->tbd_base[0].status);
-	writew(FEC_TBD_WRAP, &fec->tbd_base[1].status);
+	int ix;
+
+	for (ix = 0; ix < FEC_TBD_NUM; ix++) {
+		writel(virt_to_phys(fec->tbd_buf + ix * FEC_MAX_PKT_SIZE),
+				&fec->tbd_base[ix].data_pointer);
+		writew(0x0000, &fec->tbd_base[ix].status);
+	}
+	writew(FEC_TBD_WRAP, &fec->tbd_base[FEC_TBD_NUM - 1].status);
+
 	fec->tbd_index = 0;
+	fec->tbd_dirty = 0;
+	fec->tbd_pending = 0;
 }
 
 /**
@@ -420,6 +429,9 @@ static void fec_halt(struct eth_device *dev)
 	struct fec_priv *fec = (struct fec_priv *)dev->priv;
 	uint64_t tmo;
 
+	/* let the frames still queued go out */
+	eth_tx_flush(dev);
+
 	/* issue graceful stop command to the FEC transmitter if necessary */
 	writel(readl(fec->regs + FEC_X_CNTRL) | FEC_ECNTRL_RESET,
 			fec->regs + FEC_X_CNTRL);
@@ -444,6 +456,28 @@ static void fec_halt(struct eth_device *dev)
 	writel(0, fec->regs + FEC_ECNTRL);
 	fec->rbd_index = 0;
 	fec->tbd_index = 0;
+	fec->tbd_dirty = 0;
+	fec->tbd_pending = 0;
+}
+
+/**
+ * Reclaim the transmit BDs the hardware is done with
+ * @param[in] dev Our ethernet device to handle
+ * @return Number of frames still queued
+ */
+static int fec_tx_reap(struct eth_device *dev)
+{
+	struct fec_priv *fec = (struct fec_priv *)dev->priv;
+
+	while (fec->tbd_pending) {
+		if (readw(&fec->tbd_base[fec->tbd_dirty].status) & FEC_TBD_READY)
+			break;
+
+		fec->tbd_dirty = (fec->tbd_dirty + 1) % FEC_TBD_NUM;
+		fec->tbd_pending--;
+	}
+
+	return fec->tbd_pending;
 }
 
 /**
@@ -457,35 +491,41 @@ static int fec_send(struct eth_device *dev, void *eth_data, int data_length)
 {
 	unsigned int status;
 	uint64_t tmo;
+	void *buf;
 
 	/*
-	 * This routine transmits one frame.  This routine only accepts
+	 * This routine queues one frame.  This routine only accepts
 	 * 6-byte Ethernet addresses.
 	 */
 	struct fec_priv *fec = (struct fec_priv *)dev->priv;
 
 	/* Check for valid length of data. */
-	if ((data_length > 1500) || (data_length <= 0)) {
+	if ((data_length > ETHER_HDR_SIZE + ETH_DATA_LEN) || (data_length <= 0)) {
 		dev_err(&dev->dev, "Payload (%d) to large!\n", data_length);
 		return -1;
 	}
 
-	if ((uint32_t)eth_data & (DB_DATA_ALIGNMENT-1))
-		dev_warn(&dev->dev, "Transmit data not aligned: %p!\n", eth_data);
+	/* wait for a free BD if the ring is full */
+	tmo = get_time_ns();
+	while (fec_tx_reap(dev) == FEC_TBD_NUM) {
+		if (is_timeout(tmo, 1 * SECOND)) {
+			dev_err(&dev->dev, "transmission timeout\n");
+			return -ETIMEDOUT;
+		}
+	}
 
 	/*
-	 * Setup the transmit buffer
-	 * Note: We are always using the first buffer for transmission,
-	 * the second will be empty and only used to stop the DMA engine
+	 * Setup the transmit buffer. The frame is copied, so the caller may
+	 * reuse its packet while this one is still on the way.
 	 */
+	buf = fec->tbd_buf + fec->tbd_index * FEC_MAX_PKT_SIZE;
 	if (fec_is_imx28(fec))
-		eth_data = imx28_fix_endianess_wr(eth_data, (data_length + 3) >> 2);
+		imx28_fix_endianess_wr(buf, eth_data, (data_length + 3) >> 2);
+	else
+		memcpy(buf, eth_data, data_length);
 
 	writew(data_length, &fec->tbd_base[fec->tbd_index].data_length);
-
-	writel((uint32_t)(eth_data), &fec->tbd_base[fec->tbd_index].data_pointer);
-	dma_flush_range((unsigned long)eth_data,
-			(unsigned long)(eth_data + data_length));
+	dma_flush_range((unsigned long)buf, (unsigned long)(buf + data_length));
 	/*
 	 * update BD's status now
 	 * This block:
@@ -500,35 +540,25 @@ static int fec_send(struct eth_device *dev, void *eth_data, int data_length)
 	/* Enable SmartDMA transmit task */
 	fec_tx_task_enable(fec);
 
-	/* wait until frame is sent */
-	tmo = get_time_ns();
-	while (readw(&fec->tbd_base[fec->tbd_index].status) & FEC_TBD_READY) {
-		if (is_timeout(tmo, 1 * SECOND)) {
-			dev_err(&dev->dev, "transmission timeout\n");
-			break;
-		}
-	}
-
-	/* for next transmission use the other buffer */
-	if (fec->tbd_index)
-		fec->tbd_index = 0;
-	else
-		fec->tbd_index = 1;
+	/* the frame is reclaimed by fec_tx_reap() once it is sent */
+	fec->tbd_index = (fec->tbd_index + 1) % FEC_TBD_NUM;
+	fec->tbd_pending++;
 
 	return 0;
 }
 
 /**
- * Pull one frame from the card
+ * Pull all ready frames from the card
  * @param[in] dev Our ethernet device to handle
- * @return Length of packet read
+ * @param[in] budget Maximum number of descriptors to process
+ * @return Number of descriptors processed
  */
-static int fec_recv(struct eth_device *dev)
+static int fec_recv(struct eth_device *dev, int budget)
 {
 	struct fec_priv *fec = (struct fec_priv *)dev->priv;
-	struct buffer_descriptor __iomem *rbd = &fec->rbd_base[fec->rbd_index];
+	struct buffer_descriptor __iomem *rbd;
 	uint32_t ievent;
-	int frame_length, len = 0;
+	int frame_length, count = 0;
 	struct fec_frame *frame;
 	uint16_t bd_status;
 
@@ -562,12 +592,17 @@ static int fec_recv(struct eth_device *dev)
 		}
 	}
 
-	/*
-	 * ensure reading the right buffer status
-	 */
-	bd_status = readw(&rbd->status);
+	while (count < budget) {
+		rbd = &fec->rbd_base[fec->rbd_index];
+
+		/*
+		 * ensure reading the right buffer status
+		 */
+		bd_status = readw(&rbd->status);
+
+		if (bd_status & FEC_RBD_EMPTY)
+			break;
 
-	if (!(bd_status & FEC_RBD_EMPTY)) {
 		if ((bd_status & FEC_RBD_LAST) && !(bd_status & FEC_RBD_ERR) &&
 			((readw(&rbd->data_length) - 4) > 14)) {
 
@@ -582,11 +617,14 @@ static int fec_recv(struct eth_device *dev)
 			frame = phys_to_virt(readl(&rbd->data_pointer));
 			frame_length = readw(&rbd->data_length) - 4;
 			net_receive(dev, frame->data, frame_length);
-			len = frame_length;
 		} else {
 			if (bd_status & FEC_RBD_ERR) {
 				dev_warn(&dev->dev, "error frame: 0x%p 0x%08x\n", rbd, bd_status);
 			}
+			if (bd_status & FEC_RBD_OV)
+				eth_rx_drop(dev, ETH_DROP_OVERRUN);
+			else
+				dev->rx_errors++;
 		}
 		/*
 		 * free the current buffer, restart the engine
@@ -595,9 +633,10 @@ static int fec_recv(struct eth_device *dev)
 		fec_rbd_clean(fec->rbd_index == (FEC_RBD_NUM - 1) ? 1 : 0, rbd);
 		fec_rx_task_enable(fec);
 		fec->rbd_index = (fec->rbd_index + 1) % FEC_RBD_NUM;
+		count++;
 	}
 
-	return len;
+	return count;
 }
 
 static int fec_alloc_receive_packets(struct fec_priv *fec, int count, int size)
@@ -663,7 +702,8 @@ static int fec_probe(struct device_d *dev)
 	edev->priv = fec;
 	edev->open = fec_open;
 	edev->send = fec_send;
-	edev->recv = fec_recv;
+	edev->tx_reap = fec_tx_reap;
+	edev->recv_batch = fec_recv;
 	edev->halt = fec_halt;
 	edev->get_ethaddr = fec_get_hwaddr;
 	edev->set_ethaddr = fec_set_hwaddr;
@@ -703,7 +743,7 @@ static int fec_probe(struct device_d *dev)
 	 * reserve memory for both buffer descriptor chains at once
 	 * Datasheet forces the startaddress of each chain is 16 byte aligned
 	 */
-	base = dma_alloc_coherent((2 + FEC_RBD_NUM) *
+	base = dma_alloc_coherent((FEC_TBD_NUM + FEC_RBD_NUM) *
 			sizeof(struct buffer_descriptor));
 	fec->rbd_base = base;
 	base += FEC_RBD_NUM * sizeof(struct buffer_descriptor);
@@ -713,6 +753,7 @@ static int fec_probe(struct device_d *dev)
 	writel(virt_to_phys(fec->rbd_base), fec->regs + FEC_ERDSR);
 
 	fec_alloc_receive_packets(fec, FEC_RBD_NUM, FEC_MAX_PKT_SIZE);
+	fec->tbd_buf = dma_alloc(FEC_TBD_NUM * FEC_MAX_PKT_SIZE);
 
 	if (dev->device_node) {
 		ret = fec_probe_dt(dev, fec);
@@ -139,6 +139,9 @@ struct fec_priv {
 	int rbd_index;				/* next receive BD to read   */
 	struct buffer_descriptor __iomem *tbd_base;	/* TBD ring                  */
 	int tbd_index;				/* next transmit BD to write */
+	int tbd_dirty;				/* oldest BD still sending   */
+	int tbd_pending;			/* number of BDs sending     */
+	void *tbd_buf;				/* transmit buffers          */
 	int phy_addr;
 	phy_interface_t interface;
 	u32 phy_flags;
@@ -171,6 +174,14 @@ static inline int fec_is_imx6(struct fec_priv *priv)
  */
 #define FEC_RBD_NUM		64
 
+/**
+ * @brief Numbers of buffer descriptors for transmitting
+ *
+ * Up to this many frames are queued before fec_send() has to wait for the
+ * hardware. Must be at least two, see fec_tbd_init().
+ */
+#define FEC_TBD_NUM		8
+
 /**
  * @brief Define the ethernet packet size limit in memory
  *
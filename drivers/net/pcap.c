@@ -0,0 +1,251 @@
+/*
+ * pcap.c - replay packet captures on the sandbox
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+/*
+ * The frames of a capture file are passed to the network stack as fast as
+ * it polls for them, which makes it possible to measure the stack without a
+ * network. Frames sent on the device can be written to another capture.
+ */
+#include <common.h>
+#include <clock.h>
+#include <driver.h>
+#include <errno.h>
+#include <init.h>
+#include <malloc.h>
+#include <net.h>
+#include <param.h>
+#include <asm-generic/div64.h>
+#include <linux/swab.h>
+#include <mach/linux.h>
+#include <mach/pcap.h>
+
+#define PCAP_MAGIC		0xa1b2c3d4
+#define PCAP_MAGIC_NSEC		0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET	1
+
+struct pcap_file_header {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_record_header {
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+struct pcap_priv {
+	struct eth_device edev;
+	struct pcap_platform_data *pdata;
+	size_t pos;		/* offset of the next record to replay */
+	int swapped;		/* capture has the other byte order */
+	int replay;
+	int loop;
+	void *rxbuf;
+};
+
+static uint32_t pcap_u32(struct pcap_priv *priv, uint32_t val)
+{
+	return priv->swapped ? swab32(val) : val;
+}
+
+static int pcap_eth_send(struct eth_device *edev, void *packet, int length)
+{
+	struct pcap_priv *priv = edev->priv;
+	struct pcap_record_header rec;
+	uint64_t t = get_time_ns();
+	uint32_t ns;
+
+	if (priv->pdata->txfd < 0)
+		return 0;
+
+	ns = do_div(t, 1000000000);
+
+	rec.ts_sec = t;
+	rec.ts_usec = ns / 1000;
+	rec.incl_len = rec.orig_len = length;
+
+	linux_write(priv->pdata->txfd, &rec, sizeof(rec));
+	linux_write(priv->pdata->txfd, packet, length);
+
+	return 0;
+}
+
+static int pcap_eth_rx(struct eth_device *edev, int budget)
+{
+	struct pcap_priv *priv = edev->priv;
+	const void *base = priv->pdata->base;
+	size_t size = priv->pdata->size;
+	struct pcap_record_header rec;
+	int count = 0, len;
+
+	while (priv->replay && count < budget) {
+		if (priv->pos + sizeof(rec) > size) {
+			/* end of the capture, start over if it isn't empty */
+			if (priv->loop && size > sizeof(struct pcap_file_header) +
+					sizeof(rec)) {
+				priv->pos = sizeof(struct pcap_file_header);
+				continue;
+			}
+			priv->replay = 0;
+			break;
+		}
+
+		memcpy(&rec, base + priv->pos, sizeof(rec));
+		len = pcap_u32(priv, rec.incl_len);
+		priv->pos += sizeof(rec);
+
+		if (priv->pos + len > size) {
+			/* truncated capture */
+			priv->pos = size;
+			break;
+		}
+
+		if (len > eth_max_frame(edev)) {
+			edev->rx_errors++;
+		} else {
+			memcpy(priv->rxbuf, base + priv->pos, len);
+			net_receive(edev, priv->rxbuf, len);
+		}
+
+		priv->pos += len;
+		count++;
+	}
+
+	return count;
+}
+
+static int pcap_eth_open(struct eth_device *edev)
+{
+	return 0;
+}
+
+static void pcap_eth_halt(struct eth_device *edev)
+{
+}
+
+static int pcap_get_ethaddr(struct eth_device *edev, unsigned char *adr)
+{
+	return -1;
+}
+
+static int pcap_set_ethaddr(struct eth_device *edev, unsigned char *adr)
+{
+	return 0;
+}
+
+/* (Re)starting the replay always starts from the beginning */
+static int pcap_set_replay(struct param_d *param, void *_priv)
+{
+	struct pcap_priv *priv = _priv;
+
+	if (priv->replay && !priv->pdata->base)
+		return -ENOENT;
+
+	priv->pos = sizeof(struct pcap_file_header);
+
+	return 0;
+}
+
+static int pcap_check_header(struct device_d *dev, struct pcap_priv *priv)
+{
+	const struct pcap_file_header *hdr = priv->pdata->base;
+
+	if (priv->pdata->size < sizeof(*hdr))
+		goto err;
+
+	if (hdr->magic == swab32(PCAP_MAGIC) ||
+			hdr->magic == swab32(PCAP_MAGIC_NSEC))
+		priv->swapped = 1;
+	else if (hdr->magic != PCAP_MAGIC && hdr->magic != PCAP_MAGIC_NSEC)
+		goto err;
+
+	if (pcap_u32(priv, hdr->linktype) != PCAP_LINKTYPE_ETHERNET) {
+		dev_err(dev, "%s: not an ethernet capture\n",
+				priv->pdata->filename);
+		return -EINVAL;
+	}
+
+	return 0;
+err:
+	dev_err(dev, "%s: not a pcap file\n", priv->pdata->filename);
+	return -EINVAL;
+}
+
+static int pcap_probe(struct device_d *dev)
+{
+	struct pcap_platform_data *pdata = dev->platform_data;
+	struct pcap_file_header hdr = {
+		.magic = PCAP_MAGIC,
+		.version_major = 2,
+		.version_minor = 4,
+		.snaplen = ETH_FRAME_SIZE(ETH_MAX_MTU),
+		.linktype = PCAP_LINKTYPE_ETHERNET,
+	};
+	struct pcap_priv *priv;
+	struct eth_device *edev;
+	int ret;
+
+	priv = xzalloc(sizeof(*priv));
+	priv->pdata = pdata;
+
+	if (pdata->base) {
+		ret = pcap_check_header(dev, priv);
+		if (ret)
+			goto err;
+	}
+
+	if (pdata->txfd >= 0)
+		linux_write(pdata->txfd, &hdr, sizeof(hdr));
+
+	edev = &priv->edev;
+	edev->priv = priv;
+	edev->parent = dev;
+
+	edev->init = pcap_eth_open;
+	edev->open = pcap_eth_open;
+	edev->send = pcap_eth_send;
+	edev->recv_batch = pcap_eth_rx;
+	edev->halt = pcap_eth_halt;
+	edev->get_ethaddr = pcap_get_ethaddr;
+	edev->set_ethaddr = pcap_set_ethaddr;
+	edev->max_mtu = ETH_MAX_MTU;
+	priv->rxbuf = xmalloc(eth_max_frame(edev));
+
+	ret = eth_register(edev);
+	if (ret)
+		goto err;
+
+	dev_add_param_bool(&edev->dev, "replay", pcap_set_replay, NULL,
+			&priv->replay, priv);
+	dev_add_param_bool(&edev->dev, "loop", NULL, NULL, &priv->loop, priv);
+
+	return 0;
+err:
+	free(priv->rxbuf);
+	free(priv);
+	return ret;
+}
+
+static struct driver_d pcap_driver = {
+	.name  = "pcap",
+	.probe = pcap_probe,
+};
+device_platform_driver(pcap_driver);
@@ -27,6 +27,8 @@
 struct tap_priv {
 	int fd;
 	char *name;
+	void *rxbuf;
+	int rxbuf_size;
 };
 
 int tap_eth_send (struct eth_device *edev, void *packet, int length)
@@ -37,17 +39,22 @@ int tap_eth_send (struct eth_device *edev, void *packet, int length)
 	return 0;
 }
 
-int tap_eth_rx (struct eth_device *edev)
+int tap_eth_rx(struct eth_device *edev, int budget)
 {
 	struct tap_priv *priv = edev->priv;
-	int length;
+	int length, count = 0;
 
-	length = linux_read_nonblock(priv->fd, NetRxPackets[0], PKTSIZE);
+	while (count < budget) {
+		length = linux_read_nonblock(priv->fd, priv->rxbuf,
+				priv->rxbuf_size);
+		if (length <= 0)
+			break;
 
-	if (length > 0)
-		net_receive(edev, NetRxPackets[0], length);
+		net_receive(edev, priv->rxbuf, length);
+		count++;
+	}
 
-	return 0;
+	return count;
 }
 
 int tap_eth_open(struct eth_device *edev)
@@ -77,7 +84,8 @@ int tap_probe(struct device_d *dev)
 	int ret = 0;
 
 	priv = xzalloc(sizeof(struct tap_priv));
-	priv->name = "barebox";
+	/* tap_alloc() copies the name of the host interface back */
+	priv->name = xstrdup("barebox");
 
 	priv->fd = tap_alloc(priv->name);
 	if (priv->fd < 0) {
@@ -92,10 +100,14 @@ int tap_probe(struct device_d *dev)
 	edev->init = tap_eth_open;
 	edev->open = tap_eth_open;
 	edev->send = tap_eth_send;
-	edev->recv = tap_eth_rx;
+	edev->recv_batch = tap_eth_rx;
 	edev->halt = tap_eth_halt;
 	edev->get_ethaddr = tap_get_ethaddr;
 	edev->set_ethaddr = tap_set_ethaddr;
+	edev->max_mtu = ETH_MAX_MTU;
+
+	priv->rxbuf_size = eth_max_frame(edev);
+	priv->rxbuf = xmalloc(priv->rxbuf_size);
 
 	eth_register(edev);
 
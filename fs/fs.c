@@ -33,6 +33,7 @@
 #include <environment.h>
 #include <libgen.h>
 #include <block.h>
+#include <prefetch.h>
 
 void *read_file(const char *filename, size_t *size)
 {
@@ -686,6 +687,18 @@ int open(const char *pathname, int flags, ...)
 	char *freep;
 	int ret;
 
+	/*
+	 * Don't hand out a file that is still being copied in the background.
+	 * A failed copy was removed, report why instead of opening whatever
+	 * is there now.
+	 */
+	ret = prefetch_wait(pathname);
+	if (ret) {
+		printf("prefetch of %s failed: %s\n", pathname, strerror(-ret));
+		errno = -ret;
+		return ret;
+	}
+
 	path = realfile(pathname, &s);
 
 	if (IS_ERR(path)) {
@@ -0,0 +1,625 @@
+/*
+ * http.c - read files from an HTTP server
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+/*
+ * Files are fetched with HTTP/1.1 GET requests for the rest of the file
+ * from the read position on. A read following on the previous one
+ * continues the same response, so reading a file sequentially takes a
+ * single request. Reads elsewhere, or after the connection broke, start a
+ * new request with a Range header. Connections are kept alive, and one
+ * idle connection per mount is kept for the next request.
+ */
+#include <common.h>
+#include <driver.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fs.h>
+#include <init.h>
+#include <malloc.h>
+#include <net.h>
+#include <sizes.h>
+#include <linux/ctype.h>
+#include <linux/err.h>
+#include <linux/stat.h>
+
+#define HTTP_PORT		80
+#define HTTP_BUF_SIZE		SZ_4K
+#define HTTP_MAX_DISCARD	SZ_64K	/* largest error body we read */
+
+struct http_priv {
+	IPaddr_t server;
+	uint16_t port;
+	char *host;		/* contents of the Host header */
+	char *root;		/* path of the mount on the server */
+	struct tcp_socket *idle;	/* connection kept for the next request */
+	int requests;
+	int connects;
+	int retransmits;
+};
+
+struct http_file {
+	struct http_priv *priv;
+	char *path;		/* escaped path on the server */
+	struct tcp_socket *sock;
+	int keepalive;		/* the server keeps the connection open */
+	loff_t size;		/* FILE_SIZE_STREAM if unknown */
+	loff_t pos;		/* file offset of the next body byte */
+	loff_t remaining;	/* body bytes left, -1 if up to the close */
+	char *buf;		/* received data not consumed yet */
+	int buf_start;
+	int buf_len;
+};
+
+static struct tcp_socket *http_connect(struct http_priv *priv)
+{
+	struct tcp_socket *sock = priv->idle;
+
+	if (sock) {
+		priv->idle = NULL;
+		return sock;
+	}
+
+	priv->connects++;
+
+	return tcp_connect(priv->server, priv->port);
+}
+
+/* Keep the connection of @hf for the next request, or drop it */
+static void http_release(struct http_file *hf, int reuse)
+{
+	struct http_priv *priv = hf->priv;
+	struct tcp_socket *sock = hf->sock;
+
+	if (!sock)
+		return;
+
+	hf->sock = NULL;
+	hf->buf_len = 0;
+
+	if (reuse && hf->keepalive && !priv->idle) {
+		priv->idle = sock;
+		return;
+	}
+
+	priv->retransmits += tcp_retransmits(sock);
+
+	if (reuse)
+		tcp_close(sock);
+	else
+		tcp_abort(sock);
+}
+
+/* Read up to @len bytes of the response, buffered data first */
+static int http_recv(struct http_file *hf, void *buf, int len)
+{
+	int now;
+
+	if (!hf->buf_len)
+		return tcp_recv(hf->sock, buf, len);
+
+	now = min(len, hf->buf_len);
+	memcpy(buf, hf->buf + hf->buf_start, now);
+	hf->buf_start += now;
+	hf->buf_len -= now;
+
+	return now;
+}
+
+/* Read a header line without the line end, return its length */
+static int http_getline(struct http_file *hf, char *line, int size)
+{
+	int len = 0, ret;
+
+	while (1) {
+		if (!hf->buf_len) {
+			ret = tcp_recv(hf->sock, hf->buf, HTTP_BUF_SIZE);
+			if (ret <= 0)
+				return ret ? ret : -ECONNRESET;
+			hf->buf_start = 0;
+			hf->buf_len = ret;
+		}
+
+		hf->buf_len--;
+		line[len] = hf->buf[hf->buf_start++];
+		if (line[len] == '\n')
+			break;
+		if (len < size - 1)
+			len++;
+	}
+
+	if (len && line[len - 1] == '\r')
+		len--;
+	line[len] = 0;
+
+	return len;
+}
+
+/* Skip @len bytes of the response */
+static int http_discard(struct http_file *hf, loff_t len)
+{
+	char *buf = xmalloc(HTTP_BUF_SIZE);
+	int ret = 0;
+
+	while (len) {
+		ret = http_recv(hf, buf, min_t(loff_t, len, HTTP_BUF_SIZE));
+		if (ret <= 0) {
+			ret = ret ? ret : -ECONNRESET;
+			break;
+		}
+		len -= ret;
+		ret = 0;
+	}
+
+	free(buf);
+
+	return ret;
+}
+
+static int http_send_request(struct http_file *hf, const char *method,
+		loff_t offset)
+{
+	struct http_priv *priv = hf->priv;
+	char *req;
+	int ret;
+
+	if (offset >= 0)
+		req = asprintf("%s %s HTTP/1.1\r\nHost: %s\r\n"
+				"Range: bytes=%lld-\r\n"
+				"User-Agent: barebox\r\n\r\n",
+				method, hf->path, priv->host, offset);
+	else
+		req = asprintf("%s %s HTTP/1.1\r\nHost: %s\r\n"
+				"User-Agent: barebox\r\n\r\n",
+				method, hf->path, priv->host);
+
+	priv->requests++;
+	ret = tcp_send(hf->sock, req, strlen(req));
+	free(req);
+
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Parse the response header. Return -EAGAIN if the connection closed
+ * before the status line, which happens when the server timed out an idle
+ * connection.
+ */
+static int http_parse_response(struct http_file *hf, int head, loff_t offset)
+{
+	char line[256], *val;
+	loff_t length = -1, start = 0, total = -1;
+	int status, chunked = 0, ret;
+
+	ret = http_getline(hf, line, sizeof(line));
+	if (ret < 0)
+		return -EAGAIN;
+
+	if (strncmp(line, "HTTP/1.", 7) || strlen(line) < 12)
+		return -EPROTO;
+
+	hf->keepalive = line[7] == '1';
+	status = simple_strtoul(line + 9, NULL, 10);
+
+	while (1) {
+		ret = http_getline(hf, line, sizeof(line));
+		if (ret < 0) {
+			hf->keepalive = 0;
+			return ret;
+		}
+		if (!ret)
+			break;
+
+		val = strchr(line, ':');
+		if (!val)
+			continue;
+		*val++ = 0;
+		while (*val == ' ')
+			val++;
+
+		if (!strcasecmp(line, "Content-Length")) {
+			length = simple_strtoull(val, NULL, 10);
+		} else if (!strcasecmp(line, "Content-Range")) {
+			/* "bytes START-END/TOTAL", without START-END for 416 */
+			if (!strncasecmp(val, "bytes ", 6) && isdigit(val[6]))
+				start = simple_strtoull(val + 6, NULL, 10);
+			val = strchr(val, '/');
+			if (val && isdigit(val[1]))
+				total = simple_strtoull(val + 1, NULL, 10);
+		} else if (!strcasecmp(line, "Connection")) {
+			if (!strcasecmp(val, "close"))
+				hf->keepalive = 0;
+			else if (!strcasecmp(val, "keep-alive"))
+				hf->keepalive = 1;
+		} else if (!strcasecmp(line, "Transfer-Encoding")) {
+			chunked = strcasecmp(val, "identity");
+		}
+	}
+
+	if (chunked && !head) {
+		printf("http: chunked transfers are not supported\n");
+		/* the body is still pending, the connection can't be reused */
+		hf->keepalive = 0;
+		return -EPROTONOSUPPORT;
+	}
+
+	/* without a length, the body ends with the connection */
+	if (length < 0 && !head)
+		hf->keepalive = 0;
+
+	ret = 0;
+
+	switch (status) {
+	case 200:
+		hf->size = length < 0 ? FILE_SIZE_STREAM : length;
+		hf->pos = 0;
+		hf->remaining = length;
+		break;
+	case 206:
+		hf->size = total < 0 ? FILE_SIZE_STREAM : total;
+		hf->pos = start;
+		hf->remaining = length;
+		break;
+	case 416:
+		/* reading at the end of the file */
+		if (total >= 0)
+			hf->size = total;
+		hf->pos = offset;
+		hf->remaining = 0;
+		goto discard;
+	case 401:
+	case 403:
+		ret = -EACCES;
+		goto discard;
+	case 404:
+	case 410:
+		ret = -ENOENT;
+		goto discard;
+	default:
+		pr_debug("http: %s: status %d\n", hf->path, status);
+		ret = -EIO;
+		goto discard;
+	}
+
+	return 0;
+
+discard:
+	/* keep the connection if the body is small */
+	if (!head && (length < 0 || length > HTTP_MAX_DISCARD ||
+			http_discard(hf, length)))
+		hf->keepalive = 0;
+
+	return ret;
+}
+
+/*
+ * Send a request and parse the response header. With an @offset >= 0 the
+ * file is requested from there on.
+ */
+static int http_request(struct http_file *hf, const char *method,
+		loff_t offset)
+{
+	struct http_priv *priv = hf->priv;
+	int retry, reused, ret = 0;
+
+	for (retry = 0; retry < 2; retry++) {
+		if (!hf->sock) {
+			reused = !!priv->idle;
+			hf->sock = http_connect(priv);
+			if (IS_ERR(hf->sock)) {
+				ret = PTR_ERR(hf->sock);
+				hf->sock = NULL;
+				return ret;
+			}
+		} else {
+			reused = 1;
+		}
+
+		hf->buf_len = 0;
+		hf->remaining = 0;
+		hf->keepalive = 0;
+
+		ret = http_send_request(hf, method, offset);
+		if (!ret)
+			ret = http_parse_response(hf,
+					!strcmp(method, "HEAD"), offset);
+		else
+			ret = -EAGAIN;
+
+		if (ret != -EAGAIN)
+			break;
+
+		/* the server closed a kept alive connection, try a new one */
+		http_release(hf, 0);
+		if (!reused)
+			break;
+	}
+
+	if (ret == -EAGAIN)
+		ret = -ECONNRESET;
+
+	/* HEAD responses and errors have no body left to read */
+	if (ret || !strcmp(method, "HEAD"))
+		hf->remaining = 0;
+
+	if (!hf->remaining)
+		http_release(hf, 1);
+
+	return ret;
+}
+
+/* Request the file from @offset on, dropping a response in progress */
+static int http_get(struct http_file *hf, loff_t offset)
+{
+	int ret;
+
+	if (hf->sock && hf->remaining)
+		http_release(hf, 0);
+
+	ret = http_request(hf, "GET", offset);
+	if (ret)
+		return ret;
+
+	/* the server ignored the Range header */
+	if (hf->pos < offset) {
+		ret = -EIO;
+		if (hf->remaining < 0 || hf->remaining >= offset - hf->pos)
+			ret = http_discard(hf, offset - hf->pos);
+		if (ret) {
+			http_release(hf, 0);
+			return ret;
+		}
+		if (hf->remaining > 0)
+			hf->remaining -= offset - hf->pos;
+		hf->pos = offset;
+	}
+
+	return 0;
+}
+
+/* Escape the characters not allowed in the path of a URL */
+static char *http_escape(const char *root, const char *filename)
+{
+	char *path = xmalloc(3 * (strlen(root) + strlen(filename)) + 2);
+	const char *s;
+	char *p = path;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		for (s = i ? filename : root; *s; s++) {
+			if (isalnum(*s) || strchr("/-._~", *s))
+				*p++ = *s;
+			else
+				p += sprintf(p, "%%%02X", (unsigned char)*s);
+		}
+	}
+	*p = 0;
+
+	if (!*path)
+		strcpy(path, "/");
+
+	return path;
+}
+
+static struct http_file *http_file_new(struct device_d *dev,
+		const char *filename)
+{
+	struct http_file *hf = xzalloc(sizeof(*hf));
+
+	hf->priv = dev->priv;
+	hf->path = http_escape(hf->priv->root, filename);
+	hf->buf = xmalloc(HTTP_BUF_SIZE);
+
+	return hf;
+}
+
+static void http_file_free(struct http_file *hf)
+{
+	http_release(hf, !hf->remaining);
+	free(hf->buf);
+	free(hf->path);
+	free(hf);
+}
+
+static int http_open(struct device_d *dev, FILE *file, const char *filename)
+{
+	struct http_file *hf = http_file_new(dev, filename);
+	int ret;
+
+	/* start the transfer right away, the response tells the size */
+	ret = http_get(hf, 0);
+	if (ret) {
+		http_file_free(hf);
+		return ret;
+	}
+
+	file->inode = hf;
+	file->size = hf->size;
+
+	return 0;
+}
+
+static int http_close(struct device_d *dev, FILE *f)
+{
+	http_file_free(f->inode);
+
+	return 0;
+}
+
+static int http_read(struct device_d *dev, FILE *f, void *buf, size_t insize)
+{
+	struct http_file *hf = f->inode;
+	size_t done = 0;
+	int ret, now;
+
+	if (f->size != FILE_SIZE_STREAM && f->pos >= f->size)
+		return 0;
+
+	if (hf->pos != f->pos || !hf->remaining) {
+		ret = http_get(hf, f->pos);
+		if (ret)
+			return ret;
+	}
+
+	while (done < insize && hf->remaining) {
+		now = min_t(size_t, insize - done, INT_MAX);
+		if (hf->remaining > 0)
+			now = min_t(loff_t, now, hf->remaining);
+
+		ret = http_recv(hf, buf + done, now);
+		if (ret <= 0) {
+			/* end of a response without length */
+			if (!ret && hf->remaining < 0) {
+				hf->remaining = 0;
+				break;
+			}
+
+			/* the next read starts over from here */
+			http_release(hf, 0);
+			hf->remaining = 0;
+			if (done)
+				break;
+			return ret ? ret : -ECONNRESET;
+		}
+
+		done += ret;
+		hf->pos += ret;
+		if (hf->remaining > 0)
+			hf->remaining -= ret;
+	}
+
+	if (!hf->remaining)
+		http_release(hf, 1);
+
+	return done;
+}
+
+static loff_t http_lseek(struct device_d *dev, FILE *f, loff_t pos)
+{
+	f->pos = pos;
+
+	return pos;
+}
+
+static DIR *http_opendir(struct device_d *dev, const char *pathname)
+{
+	/* HTTP has no directory listing */
+	return NULL;
+}
+
+static int http_stat(struct device_d *dev, const char *filename,
+		struct stat *s)
+{
+	struct http_file *hf = http_file_new(dev, filename);
+	int ret;
+
+	ret = http_request(hf, "HEAD", -1);
+	if (!ret) {
+		s->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+		s->st_size = hf->size == FILE_SIZE_STREAM ?
+			FILESIZE_MAX : hf->size;
+	}
+
+	http_file_free(hf);
+
+	return ret;
+}
+
+static int http_probe(struct device_d *dev)
+{
+	struct fs_device_d *fsdev = dev_to_fs_device(dev);
+	struct http_priv *priv = xzalloc(sizeof(*priv));
+	const char *url = fsdev->backingstore;
+	char *host, *p;
+	int len;
+
+	if (!strncmp(url, "http://", 7))
+		url += 7;
+
+	/* SERVER[:PORT][/PATH] */
+	priv->host = xstrdup(url);
+	p = strchr(priv->host, '/');
+	if (p) {
+		priv->root = xstrdup(p);
+		*p = 0;
+		/* the file names start with a slash */
+		len = strlen(priv->root);
+		if (priv->root[len - 1] == '/')
+			priv->root[len - 1] = 0;
+	} else {
+		priv->root = xstrdup("");
+	}
+
+	host = xstrdup(priv->host);
+	p = strchr(host, ':');
+	if (p) {
+		*p++ = 0;
+		priv->port = simple_strtoul(p, NULL, 10);
+	} else {
+		priv->port = HTTP_PORT;
+	}
+
+	priv->server = resolv(host);
+	free(host);
+
+	if (!priv->server || !priv->port) {
+		free(priv->host);
+		free(priv->root);
+		free(priv);
+		return -EINVAL;
+	}
+
+	dev->priv = priv;
+
+	dev_add_param_int(dev, "requests", NULL, NULL, &priv->requests,
+			"%u", NULL);
+	dev_add_param_int(dev, "connects", NULL, NULL, &priv->connects,
+			"%u", NULL);
+	dev_add_param_int(dev, "retransmits", NULL, NULL, &priv->retransmits,
+			"%u", NULL);
+
+	return 0;
+}
+
+static void http_remove(struct device_d *dev)
+{
+	struct http_priv *priv = dev->priv;
+
+	if (priv->idle)
+		tcp_close(priv->idle);
+
+	free(priv->host);
+	free(priv->root);
+	free(priv);
+}
+
+static struct fs_driver_d http_driver = {
+	.open      = http_open,
+	.close     = http_close,
+	.read      = http_read,
+	.lseek     = http_lseek,
+	.opendir   = http_opendir,
+	.stat      = http_stat,
+	.flags     = 0,
+	.drv = {
+		.probe  = http_probe,
+		.remove = http_remove,
+		.name = "http",
+	}
+};
+
+static int http_init(void)
+{
+	return register_fs_driver(&http_driver);
+}
+coredevice_initcall(http_init);
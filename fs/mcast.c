@@ -0,0 +1,624 @@
+/*
+ * mcast.c - reliable multicast file receiver
+ *
+ * See file CREDITS for list of people who contributed to this
+ * project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+/*
+ * Receive-only file transfer in the spirit of FLUTE/UFTP. The client asks
+ * the server for a file over unicast and learns the session parameters and
+ * the multicast group. The server sends the file as a carousel of numbered
+ * blocks to the group, shared by all clients receiving the same file. Lost
+ * blocks are requested with NACKs over unicast; the server sends them to
+ * the group again, so they repair all clients missing them.
+ *
+ * Blocks are stored in a window ahead of the read position and copied
+ * straight into the reader's buffer where possible. Blocks beyond the
+ * window are dropped and picked up again on a later pass of the carousel
+ * or requested once the reader gets there.
+ */
+#include <common.h>
+#include <net.h>
+#include <driver.h>
+#include <clock.h>
+#include <fs.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <init.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <linux/stat.h>
+#include <linux/err.h>
+#include <globalvar.h>
+#include <magicvar.h>
+
+#define MCAST_PORT		1760	/* server control port */
+#define MCAST_VERSION		1
+
+#define MCAST_OP_OPEN		1
+#define MCAST_OP_INFO		2
+#define MCAST_OP_DATA		3
+#define MCAST_OP_NACK		4
+#define MCAST_OP_CLOSE		5
+#define MCAST_OP_ERROR		6
+
+#define MCAST_CLOSE_DONE	0
+#define MCAST_CLOSE_ABORT	1
+
+#define MCAST_MAX_RANGES	64
+
+/* Resend the OPEN request after this time without an answer */
+#define MCAST_RESEND_TIMEOUT	SECOND
+/* Give up after this time without progress */
+#define MCAST_TIMEOUT		(15 * SECOND)
+/* Wait this long for a missing block before asking for it */
+#define MCAST_NACK_INTERVAL	(200 * MSECOND)
+/* Spread the NACKs of many clients over this time, in ms */
+#define MCAST_NACK_JITTER	100
+
+static int mcast_window = 1024;
+
+struct mcast_hdr {
+	uint8_t		op;
+	uint8_t		version;
+	uint16_t	reserved;
+	uint32_t	session;
+} __attribute__ ((packed));
+
+struct mcast_open {
+	struct mcast_hdr hdr;
+	uint16_t	max_blksize;
+	char		filename[0];
+} __attribute__ ((packed));
+
+struct mcast_info {
+	struct mcast_hdr hdr;
+	uint32_t	size;
+	uint16_t	blksize;
+	uint16_t	group_port;
+	uint32_t	group_addr;
+} __attribute__ ((packed));
+
+struct mcast_data {
+	struct mcast_hdr hdr;
+	uint32_t	block;
+	unsigned char	data[0];
+} __attribute__ ((packed));
+
+struct mcast_range {
+	uint32_t	start;
+	uint32_t	count;
+} __attribute__ ((packed));
+
+struct mcast_nack {
+	struct mcast_hdr hdr;
+	uint16_t	nranges;
+	struct mcast_range range[0];
+} __attribute__ ((packed));
+
+struct mcast_close {
+	struct mcast_hdr hdr;
+	uint16_t	status;
+} __attribute__ ((packed));
+
+struct mcast_error {
+	struct mcast_hdr hdr;
+	uint16_t	code;
+	char		msg[0];
+} __attribute__ ((packed));
+
+struct file_priv {
+	struct net_connection *con;	/* unicast to the server */
+	struct net_connection *mcast_con;
+	const char *filename;
+	IPaddr_t server;
+	int err;
+	int opened;
+
+	uint32_t session;
+	uint32_t size;
+	int blksize;
+	uint32_t nblocks;
+	IPaddr_t group_addr;
+	uint16_t group_port;
+
+	/*
+	 * Ring of window blocks following read_block. present[] marks the
+	 * slots holding their block.
+	 */
+	unsigned char *buf;
+	uint8_t *present;
+	uint32_t window;
+	uint32_t read_block;	/* next block to hand to the reader */
+	int read_offset;	/* offset into read_block */
+
+	/* destination of a pending read */
+	void *read_buf;
+	size_t read_len;
+
+	uint64_t progress_timeout;
+	uint64_t nack_time;
+	uint64_t nack_delay;
+};
+
+struct mcast_priv {
+	IPaddr_t server;
+};
+
+static void mcast_fill_hdr(struct file_priv *priv, struct mcast_hdr *hdr,
+		int op)
+{
+	hdr->op = op;
+	hdr->version = MCAST_VERSION;
+	hdr->reserved = 0;
+	hdr->session = htonl(priv->session);
+}
+
+static int mcast_max_blksize(struct file_priv *priv)
+{
+	return net_eth_udp_payload(priv->con->edev) - NET_BLKSIZE_SLACK;
+}
+
+static int mcast_send_open(struct file_priv *priv)
+{
+	struct mcast_open *open = net_udp_get_payload(priv->con);
+	int len;
+
+	mcast_fill_hdr(priv, &open->hdr, MCAST_OP_OPEN);
+	open->max_blksize = htons(mcast_max_blksize(priv));
+	len = sprintf(open->filename, "%s", priv->filename) + 1;
+
+	return net_udp_send(priv->con, sizeof(*open) + len);
+}
+
+static int mcast_send_close(struct file_priv *priv, int status)
+{
+	struct mcast_close *close = net_udp_get_payload(priv->con);
+
+	mcast_fill_hdr(priv, &close->hdr, MCAST_OP_CLOSE);
+	close->status = htons(status);
+
+	return net_udp_send(priv->con, sizeof(*close));
+}
+
+static int mcast_block_len(struct file_priv *priv, uint32_t block)
+{
+	if (block == priv->nblocks - 1)
+		return priv->size - block * priv->blksize;
+
+	return priv->blksize;
+}
+
+static unsigned char *mcast_slot(struct file_priv *priv, uint32_t block)
+{
+	return priv->buf + (block % priv->window) * priv->blksize;
+}
+
+static uint8_t *mcast_present(struct file_priv *priv, uint32_t block)
+{
+	return &priv->present[block % priv->window];
+}
+
+/*
+ * Ask the server for the blocks missing in the window. The server sends
+ * them to the group, so the NACKs of other clients may repair our losses
+ * as well.
+ */
+static int mcast_send_nack(struct file_priv *priv)
+{
+	struct mcast_nack *nack = net_udp_get_payload(priv->con);
+	uint32_t block, end;
+	int n = 0;
+
+	end = min(priv->read_block + priv->window, priv->nblocks);
+
+	for (block = priv->read_block; block < end; block++) {
+		if (*mcast_present(priv, block))
+			continue;
+
+		if (n && ntohl(nack->range[n - 1].start) +
+				ntohl(nack->range[n - 1].count) == block) {
+			nack->range[n - 1].count =
+				htonl(ntohl(nack->range[n - 1].count) + 1);
+			continue;
+		}
+
+		if (n == MCAST_MAX_RANGES)
+			break;
+
+		nack->range[n].start = htonl(block);
+		nack->range[n].count = htonl(1);
+		n++;
+	}
+
+	if (!n)
+		return 0;
+
+	debug("%s: %d ranges from %u\n", __func__, n, priv->read_block);
+
+	mcast_fill_hdr(priv, &nack->hdr, MCAST_OP_NACK);
+	nack->nranges = htons(n);
+
+	return net_udp_send(priv->con, sizeof(*nack) + n * sizeof(nack->range[0]));
+}
+
+static void mcast_nack_reset(struct file_priv *priv)
+{
+	priv->nack_time = get_time_ns();
+	priv->nack_delay = MCAST_NACK_INTERVAL +
+		(rand() % MCAST_NACK_JITTER) * MSECOND;
+}
+
+/*
+ * Move the read position past block, which has been handed to the reader
+ * completely, and free its slot for block + window.
+ */
+static void mcast_advance(struct file_priv *priv)
+{
+	*mcast_present(priv, priv->read_block) = 0;
+	priv->read_block++;
+	priv->read_offset = 0;
+	mcast_nack_reset(priv);
+}
+
+static void mcast_handle_data(struct file_priv *priv, struct mcast_data *data,
+		int len)
+{
+	uint32_t block = ntohl(data->block);
+
+	len -= sizeof(*data);
+
+	if (block < priv->read_block || block >= priv->nblocks ||
+			block - priv->read_block >= priv->window)
+		return;
+
+	if (len != mcast_block_len(priv, block) || *mcast_present(priv, block))
+		return;
+
+	priv->progress_timeout = get_time_ns();
+
+	/* The block the reader waits for goes straight into its buffer */
+	if (block == priv->read_block && !priv->read_offset &&
+			priv->read_len >= len) {
+		memcpy(priv->read_buf, data->data, len);
+		priv->read_buf += len;
+		priv->read_len -= len;
+		mcast_advance(priv);
+		return;
+	}
+
+	memcpy(mcast_slot(priv, block), data->data, len);
+	*mcast_present(priv, block) = 1;
+}
+
+static void mcast_handle_info(struct file_priv *priv, struct mcast_info *info,
+		struct udphdr *udp)
+{
+	if (priv->opened)
+		return;
+
+	priv->session = ntohl(info->hdr.session);
+	priv->size = ntohl(info->size);
+	priv->blksize = ntohs(info->blksize);
+	priv->group_port = ntohs(info->group_port);
+	priv->group_addr = net_read_ip(&info->group_addr);
+
+	if (!priv->blksize || priv->blksize > mcast_max_blksize(priv) ||
+			!is_multicast_ip_addr(priv->group_addr)) {
+		priv->err = -EINVAL;
+		return;
+	}
+
+	priv->nblocks = DIV_ROUND_UP(priv->size, priv->blksize);
+
+	/* further requests go to the port serving this session */
+	priv->con->udp->uh_dport = udp->uh_sport;
+	priv->opened = 1;
+}
+
+static void mcast_handler(void *ctx, char *packet, unsigned len)
+{
+	struct file_priv *priv = ctx;
+	struct udphdr *udp = net_eth_to_udphdr(packet);
+	struct mcast_hdr *hdr = (void *)net_eth_to_udp_payload(packet);
+	struct mcast_error *error;
+
+	len = net_eth_to_udplen(packet);
+	if (len < sizeof(*hdr) || hdr->version != MCAST_VERSION)
+		return;
+
+	if (hdr->op != MCAST_OP_INFO && priv->opened &&
+			ntohl(hdr->session) != priv->session)
+		return;
+
+	switch (hdr->op) {
+	case MCAST_OP_INFO:
+		if (len >= sizeof(struct mcast_info))
+			mcast_handle_info(priv, (void *)hdr, udp);
+		break;
+	case MCAST_OP_DATA:
+		if (priv->opened && len >= sizeof(struct mcast_data))
+			mcast_handle_data(priv, (void *)hdr, len);
+		break;
+	case MCAST_OP_ERROR:
+		if (len < sizeof(*error))
+			break;
+		error = (void *)hdr;
+		debug("mcast error: %d\n", ntohs(error->code));
+		priv->err = ntohs(error->code) == 1 ? -ENOENT : -EIO;
+		break;
+	default:
+		break;
+	}
+}
+
+static int mcast_poll(struct file_priv *priv)
+{
+	if (ctrlc())
+		return -EINTR;
+
+	if (is_timeout(priv->progress_timeout, MCAST_TIMEOUT))
+		return -ETIMEDOUT;
+
+	net_poll();
+
+	return priv->err;
+}
+
+static void mcast_do_close(struct file_priv *priv)
+{
+	if (priv->opened)
+		mcast_send_close(priv, priv->read_block == priv->nblocks ?
+				MCAST_CLOSE_DONE : MCAST_CLOSE_ABORT);
+
+	if (priv->mcast_con)
+		net_unregister(priv->mcast_con);
+	net_unregister(priv->con);
+	free(priv->buf);
+	free(priv->present);
+	free(priv);
+}
+
+static struct file_priv *mcast_do_open(struct device_d *dev,
+		const char *filename, int join)
+{
+	struct mcast_priv *mpriv = dev->priv;
+	struct file_priv *priv;
+	uint64_t resend;
+	int ret;
+
+	priv = xzalloc(sizeof(*priv));
+	priv->filename = filename + 1;
+	priv->server = mpriv->server;
+
+	priv->con = net_udp_new(priv->server, MCAST_PORT, mcast_handler, priv);
+	if (IS_ERR(priv->con)) {
+		ret = PTR_ERR(priv->con);
+		free(priv);
+		return ERR_PTR(ret);
+	}
+
+	priv->progress_timeout = resend = get_time_ns();
+
+	ret = mcast_send_open(priv);
+	if (ret)
+		goto out;
+
+	while (!priv->opened) {
+		if (is_timeout(resend, MCAST_RESEND_TIMEOUT)) {
+			resend = get_time_ns();
+			ret = mcast_send_open(priv);
+			if (ret)
+				goto out;
+		}
+
+		ret = mcast_poll(priv);
+		if (ret)
+			goto out;
+	}
+
+	if (!join)
+		return priv;
+
+	priv->window = clamp_t(uint32_t, mcast_window, 1, priv->nblocks ? : 1);
+	priv->buf = malloc(priv->window * priv->blksize);
+	priv->present = xzalloc(priv->window);
+	if (!priv->buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* Only accept data for the group sent by our server */
+	priv->mcast_con = net_udp_new_ssm(priv->group_addr, priv->server,
+			priv->group_port, mcast_handler, priv);
+	if (IS_ERR(priv->mcast_con)) {
+		ret = PTR_ERR(priv->mcast_con);
+		priv->mcast_con = NULL;
+		goto out;
+	}
+
+	net_udp_bind(priv->mcast_con, priv->group_port);
+
+	priv->progress_timeout = get_time_ns();
+	mcast_nack_reset(priv);
+
+	return priv;
+out:
+	mcast_do_close(priv);
+
+	return ERR_PTR(ret);
+}
+
+static int mcast_open(struct device_d *dev, FILE *file, const char *filename)
+{
+	struct file_priv *priv;
+
+	if ((file->flags & O_ACCMODE) != O_RDONLY)
+		return -ENOSYS;
+
+	priv = mcast_do_open(dev, filename, 1);
+	if (IS_ERR(priv))
+		return PTR_ERR(priv);
+
+	file->inode = priv;
+	file->size = priv->size;
+
+	return 0;
+}
+
+static int mcast_close(struct device_d *dev, FILE *f)
+{
+	mcast_do_close(f->inode);
+
+	return 0;
+}
+
+static int mcast_read(struct device_d *dev, FILE *f, void *buf, size_t insize)
+{
+	struct file_priv *priv = f->inode;
+	size_t now;
+	int ret;
+
+	priv->read_buf = buf;
+	priv->read_len = insize;
+
+	while (priv->read_len && priv->read_block < priv->nblocks) {
+		if (*mcast_present(priv, priv->read_block)) {
+			now = min_t(size_t, priv->read_len,
+					mcast_block_len(priv, priv->read_block) -
+					priv->read_offset);
+			memcpy(priv->read_buf, mcast_slot(priv, priv->read_block) +
+					priv->read_offset, now);
+			priv->read_buf += now;
+			priv->read_len -= now;
+			priv->read_offset += now;
+
+			if (priv->read_offset ==
+					mcast_block_len(priv, priv->read_block))
+				mcast_advance(priv);
+			continue;
+		}
+
+		if (is_timeout(priv->nack_time, priv->nack_delay)) {
+			mcast_send_nack(priv);
+			mcast_nack_reset(priv);
+		}
+
+		ret = mcast_poll(priv);
+		if (ret) {
+			priv->read_len = 0;
+			return ret;
+		}
+	}
+
+	now = insize - priv->read_len;
+	priv->read_len = 0;
+
+	/* Leave the group as soon as we have the whole file */
+	if (priv->read_block == priv->nblocks && priv->mcast_con) {
+		net_unregister(priv->mcast_con);
+		priv->mcast_con = NULL;
+	}
+
+	return now;
+}
+
+static int mcast_write(struct device_d *_dev, FILE *f, const void *inbuf,
+		size_t insize)
+{
+	return -ENOSYS;
+}
+
+static loff_t mcast_lseek(struct device_d *dev, FILE *f, loff_t pos)
+{
+	return -ENOSYS;
+}
+
+static DIR *mcast_opendir(struct device_d *dev, const char *pathname)
+{
+	return NULL;
+}
+
+static int mcast_stat(struct device_d *dev, const char *filename,
+		struct stat *s)
+{
+	struct file_priv *priv;
+
+	priv = mcast_do_open(dev, filename, 0);
+	if (IS_ERR(priv))
+		return PTR_ERR(priv);
+
+	s->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+	s->st_size = priv->size;
+
+	mcast_do_close(priv);
+
+	return 0;
+}
+
+static int mcast_probe(struct device_d *dev)
+{
+	struct fs_device_d *fsdev = dev_to_fs_device(dev);
+	struct mcast_priv *priv = xzalloc(sizeof(struct mcast_priv));
+
+	dev->priv = priv;
+
+	priv->server = resolv(fsdev->backingstore);
+	if (!priv->server) {
+		free(priv);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void mcast_remove(struct device_d *dev)
+{
+	struct mcast_priv *priv = dev->priv;
+
+	free(priv);
+}
+
+static struct fs_driver_d mcast_driver = {
+	.open      = mcast_open,
+	.close     = mcast_close,
+	.read      = mcast_read,
+	.write     = mcast_write,
+	.lseek     = mcast_lseek,
+	.opendir   = mcast_opendir,
+	.stat      = mcast_stat,
+	.flags     = 0,
+	.drv = {
+		.probe  = mcast_probe,
+		.remove = mcast_remove,
+		.name = "mcast",
+	}
+};
+
+static int mcast_init(void)
+{
+	return register_fs_driver(&mcast_driver);
+}
+coredevice_initcall(mcast_init);
+
+static int mcast_global_init(void)
+{
+	globalvar_add_simple_int("mcast.window", &mcast_window, "%d");
+
+	return 0;
+}
+late_initcall(mcast_global_init);
+
+BAREBOX_MAGICVAR_NAMED(global_mcast_window, global.mcast.window,
+		"Number of blocks the multicast receiver buffers ahead of the reader");
@@ -32,7 +32,6 @@
 #include <init.h>
 #include <linux/stat.h>
 #include <linux/err.h>
-#include <kfifo.h>
 #include <sizes.h>
 #include <byteorder.h>
 
@@ -57,6 +56,7 @@
 #define NFSPROC3_READLINK	5
 #define NFSPROC3_READ		6
 #define NFSPROC3_READDIR	16
+#define NFSPROC3_FSINFO		19
 
 #define NFS3_FHSIZE      64
 #define NFS3_COOKIEVERFSIZE	8
@@ -127,23 +127,64 @@ struct rpc_reply {
 #define NFS_TIMEOUT	(2 * SECOND)
 #define NFS_MAX_RESEND	5
 
+/*
+ * Default READ size. It is chosen so that a READ reply fits into a single
+ * frame on the interface, 1024 bytes on standard ethernet. With IP fragment
+ * reassembly it is at least 8192 bytes. Larger values can be set with the
+ * rsize mount option.
+ */
+#define NFS_RSIZE_REASSEMBLY	8192
+#define NFS_READ_REPLY_HDR	128	/* RPC and NFS headers of a READ reply */
+#define NFS_RSIZE_MIN		512
+#define NFS_RSIZE_MAX		32768
+
+/* Number of READ requests kept in flight per file */
+#define NFS_READ_DEPTH		8
+
 struct nfs_priv {
 	struct net_connection *con;
 	IPaddr_t server;
 	char *path;
 	unsigned short mount_port;
 	unsigned short nfs_port;
+	unsigned short rsize;
 	uint32_t rpc_id;
 	uint32_t rootfh_len;
 	char rootfh[NFS3_FHSIZE];
+	struct file_priv *reader;	/* file owning the READ pipeline */
+	int retransmits;		/* requests repeated after a timeout */
+};
+
+#define NFS_SLOT_FREE	0
+#define NFS_SLOT_SENT	1
+#define NFS_SLOT_DONE	2
+
+struct nfs_read_slot {
+	int state;
+	uint32_t xid;
+	uint64_t offset;
+	uint32_t count;		/* bytes requested */
+	uint32_t len;		/* bytes received */
+	uint32_t pos;		/* bytes already handed out */
+	int eof;
+	int err;
+	int tries;
+	uint64_t start;
+	void *buf;
 };
 
 struct file_priv {
-	struct kfifo *fifo;
 	void *buf;
 	uint32_t filefh_len;
 	char filefh[NFS3_FHSIZE];
 	struct nfs_priv *npriv;
+
+	/* READ pipeline, slots[head] holds the data at read_pos */
+	struct nfs_read_slot slots[NFS_READ_DEPTH];
+	int head;
+	int inflight;
+	uint64_t read_pos;
+	uint64_t next_offset;
 };
 
 static uint64_t nfs_timer_start;
@@ -347,13 +388,9 @@ static int rpc_check_reply(unsigned char *pkt,
 
 	memcpy(&rpc, pkt, sizeof(rpc));
 
-	if (ntoh32(rpc.id) != rpc_id) {
-		if (rpc_id - ntoh32(rpc.id) == 1)
-			/* stale packet, wait a bit longer */
-			return 0;
-
-		return -EINVAL;
-	}
+	if (ntoh32(rpc.id) != rpc_id)
+		/* stale packet or a late READ reply, wait a bit longer */
+		return -EAGAIN;
 
 	if (rpc.rstatus  ||
 	    rpc.verifier ||
@@ -374,21 +411,16 @@ static int rpc_check_reply(unsigned char *pkt,
 }
 
 /*
- * rpc_req - synchronous RPC request
+ * rpc_send - send a RPC call without waiting for the reply
  */
-static int rpc_req(struct nfs_priv *npriv, int rpc_prog, int rpc_proc,
-		uint32_t *data, int datalen)
+static int rpc_send(struct nfs_priv *npriv, uint32_t rpc_id, int rpc_prog,
+		int rpc_proc, uint32_t *data, int datalen)
 {
 	struct rpc_call pkt;
 	unsigned short dport;
-	int ret;
 	unsigned char *payload = net_udp_get_payload(npriv->con);
-	int nfserr;
-	int tries = 0;
-
-	npriv->rpc_id++;
 
-	pkt.id = hton32(npriv->rpc_id);
+	pkt.id = hton32(rpc_id);
 	pkt.type = hton32(MSG_CALL);
 	pkt.rpcvers = hton32(2);	/* use RPC version 2 */
 	pkt.prog = hton32(rpc_prog);
@@ -412,9 +444,24 @@ static int rpc_req(struct nfs_priv *npriv, int rpc_prog, int rpc_proc,
 
 	npriv->con->udp->uh_dport = hton16(dport);
 
-again:
-	ret = net_udp_send(npriv->con,
+	return net_udp_send(npriv->con,
 			sizeof(pkt) + datalen * sizeof(uint32_t));
+}
+
+/*
+ * rpc_req - synchronous RPC request
+ */
+static int rpc_req(struct nfs_priv *npriv, int rpc_prog, int rpc_proc,
+		uint32_t *data, int datalen)
+{
+	int ret;
+	int nfserr;
+	int tries = 0;
+
+	npriv->rpc_id++;
+
+again:
+	ret = rpc_send(npriv, npriv->rpc_id, rpc_prog, rpc_proc, data, datalen);
 
 	nfs_timer_start = get_time_ns();
 
@@ -432,6 +479,7 @@ again:
 			tries++;
 			if (tries == NFS_MAX_RESEND)
 				return -ETIMEDOUT;
+			npriv->retransmits++;
 			goto again;
 		}
 
@@ -441,6 +489,11 @@ again:
 			ret = nfserr;
 			break;
 		}
+
+		if (ret == -EAGAIN) {
+			nfs_state = STATE_START;
+			nfs_packet = NULL;
+		}
 	}
 
 	return ret;
@@ -645,6 +698,64 @@ static int nfs_mount_req(struct nfs_priv *npriv)
 	return 0;
 }
 
+/*
+ * nfs_fsinfo_req - Query the server's transfer sizes
+ */
+static int nfs_fsinfo_req(struct nfs_priv *npriv)
+{
+	uint32_t data[32];	/* credentials and file handle */
+	uint32_t *p;
+	uint32_t rtmax;
+	int len;
+	int ret;
+
+	/*
+	 * struct FSINFO3args {
+	 * 	nfs_fh3 fsroot;
+	 * };
+	 *
+	 * struct FSINFO3resok {
+	 * 	post_op_attr obj_attributes;
+	 * 	uint32 rtmax;
+	 * 	uint32 rtpref;
+	 * 	uint32 rtmult;
+	 * 	...
+	 * };
+	 */
+	p = &(data[0]);
+	p = rpc_add_credentials(p);
+
+	p = nfs_add_fh3(p, npriv->rootfh_len, npriv->rootfh);
+
+	len = p - &(data[0]);
+
+	ret = rpc_req(npriv, PROG_NFS, NFSPROC3_FSINFO, data, len);
+	if (ret)
+		return ret;
+
+	p = nfs_packet + sizeof(struct rpc_reply) + 4;
+
+	p = nfs_read_post_op_attr(p, NULL);
+
+	rtmax = ntoh32(net_read_uint32(p));
+	if (rtmax && rtmax < npriv->rsize)
+		npriv->rsize = max_t(uint32_t, rtmax, NFS_RSIZE_MIN);
+
+	return 0;
+}
+
+static int nfs_rsize_default(struct eth_device *edev)
+{
+	int rsize;
+
+	rsize = rounddown(net_eth_udp_payload(edev) - NFS_READ_REPLY_HDR, 1024);
+
+	if (IS_ENABLED(CONFIG_NET_IP_REASSEMBLY))
+		rsize = max(rsize, NFS_RSIZE_REASSEMBLY);
+
+	return max(rsize, NFS_RSIZE_MIN);
+}
+
 /*
  * nfs_umountall_req - Unmount all our NFS Filesystems on the Server
  */
@@ -868,16 +979,16 @@ static void *nfs_readdirattr_req(struct file_priv *priv, struct nfs_dir *dir)
 }
 
 /*
- * nfs_read_req - Read File on NFS Server
+ * nfs_read_send - send the READ request for a pipeline slot
+ *
+ * A resend keeps the xid of the original request, so whichever reply
+ * arrives first completes the slot.
  */
-static int nfs_read_req(struct file_priv *priv, uint64_t offset,
-		uint32_t readlen)
+static int nfs_read_send(struct file_priv *priv, struct nfs_read_slot *slot)
 {
-	uint32_t data[1024];
+	uint32_t data[32];	/* credentials, file handle, offset and count */
 	uint32_t *p;
 	int len;
-	int ret;
-	uint32_t rlen, eof;
 
 	/*
 	 * struct READ3args {
@@ -885,7 +996,49 @@ static int nfs_read_req(struct file_priv *priv, uint64_t offset,
 	 * 	offset3 offset;
 	 * 	count3 count;
 	 * };
-	 *
+	 */
+	p = &(data[0]);
+	p = rpc_add_credentials(p);
+
+	p = nfs_add_fh3(p, priv->filefh_len, priv->filefh);
+	p = nfs_add_uint64(p, slot->offset);
+	p = nfs_add_uint32(p, slot->count);
+
+	len = p - &(data[0]);
+
+	slot->state = NFS_SLOT_SENT;
+	slot->start = get_time_ns();
+
+	return rpc_send(priv->npriv, slot->xid, PROG_NFS, NFSPROC3_READ,
+			data, len);
+}
+
+static int nfs_read_queue(struct file_priv *priv, struct nfs_read_slot *slot)
+{
+	slot->xid = ++priv->npriv->rpc_id;
+	slot->len = 0;
+	slot->pos = 0;
+	slot->eof = 0;
+	slot->err = 0;
+	slot->tries = 0;
+
+	return nfs_read_send(priv, slot);
+}
+
+/*
+ * nfs_read_reply - handle a READ reply for one of our pipeline slots
+ *
+ * Returns 1 if the packet was consumed, 0 if it belongs to someone else.
+ */
+static int nfs_read_reply(struct file_priv *priv, char *pkt, int len)
+{
+	struct rpc_reply rpc;
+	struct nfs_read_slot *slot = NULL;
+	uint32_t *p;
+	uint32_t rlen;
+	int i, status;
+
+	/*
 	 * struct READ3resok {
 	 * 	post_op_attr file_attributes;
 	 * 	count3 count;
@@ -904,20 +1057,35 @@ static int nfs_read_req(struct file_priv *priv, uint64_t offset,
 	 * 	READ3resfail resfail;
 	 * };
 	 */
-	p = &(data[0]);
-	p = rpc_add_credentials(p);
+	if (len < sizeof(rpc) + 4)
+		return 0;
 
-	p = nfs_add_fh3(p, priv->filefh_len, priv->filefh);
-	p = nfs_add_uint64(p, offset);
-	p = nfs_add_uint32(p, readlen);
+	memcpy(&rpc, pkt, sizeof(rpc));
 
-	len = p - &(data[0]);
+	for (i = 0; i < NFS_READ_DEPTH; i++) {
+		if (priv->slots[i].state == NFS_SLOT_SENT &&
+		    priv->slots[i].xid == ntoh32(rpc.id)) {
+			slot = &priv->slots[i];
+			break;
+		}
+	}
 
-	ret = rpc_req(priv->npriv, PROG_NFS, NFSPROC3_READ, data, len);
-	if (ret)
-		return ret;
+	if (!slot)
+		return 0;
 
-	p = nfs_packet + sizeof(struct rpc_reply) + 4;
+	slot->state = NFS_SLOT_DONE;
+
+	if (rpc.rstatus || rpc.verifier || rpc.astatus) {
+		slot->err = -EINVAL;
+		return 1;
+	}
+
+	p = (uint32_t *)(pkt + sizeof(rpc));
+	status = ntoh32(net_read_uint32(p++));
+	if (status) {
+		slot->err = -status;
+		return 1;
+	}
 
 	p = nfs_read_post_op_attr(p, NULL);
 
@@ -926,7 +1094,7 @@ static int nfs_read_req(struct file_priv *priv, uint64_t offset,
 	/* skip over count */
 	p += 1;
 
-	eof = ntoh32(net_read_uint32(p));
+	slot->eof = ntoh32(net_read_uint32(p));
 
 	/*
 	 * skip over eof and count embedded in the representation of data
@@ -934,18 +1102,134 @@ static int nfs_read_req(struct file_priv *priv, uint64_t offset,
 	 */
 	p += 2;
 
-	if (readlen && !rlen && !eof)
-		return -EIO;
+	if (rlen > slot->count || (char *)p + rlen > pkt + len) {
+		slot->err = -EIO;
+		return 1;
+	}
+
+	memcpy(slot->buf, p, rlen);
+	slot->len = rlen;
+
+	return 1;
+}
+
+static void nfs_read_reset(struct file_priv *priv, uint64_t pos)
+{
+	int i;
+
+	for (i = 0; i < NFS_READ_DEPTH; i++)
+		priv->slots[i].state = NFS_SLOT_FREE;
+
+	priv->head = 0;
+	priv->inflight = 0;
+	priv->read_pos = pos;
+	priv->next_offset = pos;
+}
+
+/*
+ * nfs_read_fill - keep up to NFS_READ_DEPTH READ requests in flight
+ */
+static int nfs_read_fill(struct file_priv *priv, uint64_t size)
+{
+	struct nfs_read_slot *slot;
+	int ret;
+
+	while (priv->inflight < NFS_READ_DEPTH && priv->next_offset < size) {
+		slot = &priv->slots[(priv->head + priv->inflight) %
+				NFS_READ_DEPTH];
+
+		slot->offset = priv->next_offset;
+		slot->count = min_t(uint64_t, size - slot->offset,
+				priv->npriv->rsize);
+
+		ret = nfs_read_queue(priv, slot);
+		if (ret)
+			return ret;
+
+		priv->next_offset += slot->count;
+		priv->inflight++;
+	}
+
+	return 0;
+}
+
+static int nfs_read_check_timeouts(struct file_priv *priv)
+{
+	struct nfs_read_slot *slot;
+	int i, ret;
+
+	for (i = 0; i < priv->inflight; i++) {
+		slot = &priv->slots[(priv->head + i) % NFS_READ_DEPTH];
+
+		if (slot->state != NFS_SLOT_SENT ||
+		    !is_timeout(slot->start, NFS_TIMEOUT))
+			continue;
+
+		if (++slot->tries == NFS_MAX_RESEND)
+			return -ETIMEDOUT;
 
-	kfifo_put(priv->fifo, (char *)p, rlen);
+		priv->npriv->retransmits++;
+		ret = nfs_read_send(priv, slot);
+		if (ret)
+			return ret;
+	}
 
 	return 0;
 }
 
+/*
+ * nfs_read_consume - copy data out of the completed head slot
+ *
+ * Returns the number of bytes copied or a negative error code.
+ */
+static int nfs_read_consume(struct file_priv *priv, void *buf, size_t size)
+{
+	struct nfs_read_slot *slot = &priv->slots[priv->head];
+	uint32_t now;
+	int ret;
+
+	if (slot->err)
+		return slot->err;
+
+	if (!slot->len && !slot->eof)
+		return -EIO;
+
+	now = min_t(size_t, slot->len - slot->pos, size);
+	memcpy(buf, slot->buf + slot->pos, now);
+	slot->pos += now;
+	priv->read_pos += now;
+
+	if (slot->pos < slot->len)
+		return now;
+
+	if (slot->len < slot->count && !slot->eof) {
+		/* short read, ask for the rest of this slot's range */
+		slot->offset += slot->len;
+		slot->count -= slot->len;
+
+		ret = nfs_read_queue(priv, slot);
+		if (ret)
+			return ret;
+
+		return now;
+	}
+
+	slot->state = NFS_SLOT_FREE;
+	priv->head = (priv->head + 1) % NFS_READ_DEPTH;
+	priv->inflight--;
+
+	return now;
+}
+
 static void nfs_handler(void *ctx, char *packet, unsigned len)
 {
+	struct nfs_priv *npriv = ctx;
 	char *pkt = net_eth_to_udp_payload(packet);
 
+	if (npriv->reader &&
+	    nfs_read_reply(npriv->reader, pkt, net_eth_to_udplen(packet)))
+		return;
+
 	nfs_state = STATE_DONE;
 	nfs_packet = pkt;
 	nfs_len = len;
@@ -1029,9 +1313,10 @@ out:
 
 static void nfs_do_close(struct file_priv *priv)
 {
-	if (priv->fifo)
-		kfifo_free(priv->fifo);
+	if (priv->npriv->reader == priv)
+		priv->npriv->reader = NULL;
 
+	free(priv->buf);
 	free(priv);
 }
 
@@ -1139,6 +1424,7 @@ static int nfs_open(struct device_d *dev, FILE *file, const char *filename)
 {
 	struct file_priv *priv;
 	struct stat s;
+	int i;
 
 	priv = nfs_do_stat(dev, filename, &s);
 	if (IS_ERR(priv))
@@ -1147,12 +1433,17 @@ static int nfs_open(struct device_d *dev, FILE *file, const char *filename)
 	file->inode = priv;
 	file->size = s.st_size;
 
-	priv->fifo = kfifo_alloc(1024);
-	if (!priv->fifo) {
+	priv->buf = malloc(NFS_READ_DEPTH * priv->npriv->rsize);
+	if (!priv->buf) {
 		free(priv);
 		return -ENOMEM;
 	}
 
+	for (i = 0; i < NFS_READ_DEPTH; i++)
+		priv->slots[i].buf = priv->buf + i * priv->npriv->rsize;
+
+	nfs_read_reset(priv, 0);
+
 	return 0;
 }
 
@@ -1174,17 +1465,59 @@ static int nfs_write(struct device_d *_dev, FILE *file, const void *inbuf,
 static int nfs_read(struct device_d *dev, FILE *file, void *buf, size_t insize)
 {
 	struct file_priv *priv = file->inode;
+	struct nfs_priv *npriv = priv->npriv;
+	size_t outsize = 0;
+	int ret = 0;
+
+	if (file->pos != priv->read_pos)
+		nfs_read_reset(priv, file->pos);
+
+	/*
+	 * The reader stays attached between calls so that replies to READs
+	 * still in flight are accepted. Another file taking over the pipeline
+	 * has to restart its own requests.
+	 */
+	if (npriv->reader != priv) {
+		if (npriv->reader)
+			nfs_read_reset(npriv->reader, npriv->reader->read_pos);
+		npriv->reader = priv;
+	}
+
+	while (outsize < insize) {
+		ret = nfs_read_fill(priv, file->size);
+		if (ret || !priv->inflight)
+			break;
+
+		if (priv->slots[priv->head].state == NFS_SLOT_DONE) {
+			ret = nfs_read_consume(priv, buf + outsize,
+					insize - outsize);
+			if (ret < 0)
+				break;
+
+			outsize += ret;
+			ret = 0;
+			continue;
+		}
+
+		if (ctrlc()) {
+			ret = -EINTR;
+			break;
+		}
 
-	if (insize > 1024)
-		insize = 1024;
+		net_poll();
 
-	if (insize && !kfifo_len(priv->fifo)) {
-		int ret = nfs_read_req(priv, file->pos, insize);
+		ret = nfs_read_check_timeouts(priv);
 		if (ret)
+			break;
+	}
+
+	if (ret < 0) {
+		nfs_read_reset(priv, priv->read_pos);
+		if (!outsize)
 			return ret;
 	}
 
-	return kfifo_get(priv->fifo, buf, insize);
+	return outsize;
 }
 
 static loff_t nfs_lseek(struct device_d *dev, FILE *file, loff_t pos)
@@ -1192,7 +1525,7 @@ static loff_t nfs_lseek(struct device_d *dev, FILE *file, loff_t pos)
 	struct file_priv *priv = file->inode;
 
 	file->pos = pos;
-	kfifo_reset(priv->fifo);
+	nfs_read_reset(priv, pos);
 
 	return file->pos;
 }
@@ -1316,6 +1649,9 @@ static int nfs_probe(struct device_d *dev)
 
 	dev->priv = npriv;
 
+	dev_add_param_int(dev, "retransmits", NULL, NULL, &npriv->retransmits,
+			"%u", NULL);
+
 	debug("nfs: mount: %s\n", fsdev->backingstore);
 
 	path = strchr(tmp, ':');
@@ -1363,12 +1699,23 @@ static int nfs_probe(struct device_d *dev)
 	}
 	debug("nfs port: %d\n", npriv->nfs_port);
 
+	npriv->rsize = nfs_rsize_default(npriv->con->edev);
+	parseopt_hu(fsdev->options, "rsize", &npriv->rsize);
+	npriv->rsize = clamp_t(unsigned short, npriv->rsize,
+			NFS_RSIZE_MIN, NFS_RSIZE_MAX);
+
 	ret = nfs_mount_req(npriv);
 	if (ret) {
 		printf("mounting failed with %d\n", ret);
 		goto err2;
 	}
 
+	ret = nfs_fsinfo_req(npriv);
+	if (ret)
+		debug("fsinfo failed with %d, using rsize %hu\n", ret,
+				npriv->rsize);
+	debug("nfs rsize: %hu\n", npriv->rsize);
+
 	free(tmp);
 
 	return 0;
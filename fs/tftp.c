@@ -32,8 +32,9 @@
 #include <linux/err.h>
 #include <kfifo.h>
 #include <sizes.h>
-
-#define TFTP_PORT	69	/* Well known TFTP port number */
+#include <globalvar.h>
+#include <magicvar.h>
+#include <tftp.h>
 
 /* Seconds to wait before remote server is allowed to resend a lost packet */
 #define TIMEOUT		5
@@ -44,16 +45,6 @@
 /* After this time without progress we will bail out */
 #define TFTP_TIMEOUT		((TIMEOUT * 3) * SECOND)
 
-/*
- *	TFTP operations.
- */
-#define TFTP_RRQ	1
-#define TFTP_WRQ	2
-#define TFTP_DATA	3
-#define TFTP_ACK	4
-#define TFTP_ERROR	5
-#define TFTP_OACK	6
-
 #define STATE_RRQ	1
 #define STATE_WRQ	2
 #define STATE_RDATA	3
@@ -63,13 +54,29 @@
 #define STATE_LAST	7
 #define STATE_DONE	8
 
-#define TFTP_BLOCK_SIZE		512	/* default TFTP block size */
 #define TFTP_FIFO_SIZE		4096
 
 #define TFTP_ERR_RESEND	1
 
+static int tftp_multicast;
+static int tftp_windowsize = 1;
+static int tftp_mcast_max = 4096;
+
+/*
+ * A received block which could not be handed to the reader yet. Used in
+ * multicast mode where blocks arrive in whatever order the server sends
+ * them to the group.
+ */
+struct tftp_block {
+	struct list_head list;
+	uint32_t id;
+	int len;
+	unsigned char data[];
+};
+
 struct file_priv {
 	struct net_connection *tftp_con;
+	struct tftp_priv *tpriv;
 	int push;
 	uint16_t block;
 	uint16_t last_block;
@@ -83,11 +90,40 @@ struct file_priv {
 	struct kfifo *fifo;
 	void *buf;
 	int blocksize;
+	int blksize_req;	/* block size asked for in the request */
 	int block_requested;
+
+	/* RFC 7440 window state */
+	int windowsize;
+	int window_count;	/* blocks received since the last ACK */
+	int window_lost;	/* we already asked to restart this window */
+	int win_count;		/* blocks sent and waiting for an ACK */
+	int final_len;		/* length of the last block in the window */
+
+	/* destination of a pending read */
+	void *read_buf;
+	size_t read_len;
+
+	/* RFC 2090 multicast state */
+	int multicast;
+	int master;
+	IPaddr_t mcast_addr;
+	uint16_t mcast_port;
+	struct net_connection *mcast_con;
+	uint32_t rx_id;		/* all blocks up to this one are received */
+	uint32_t read_id;	/* next block to hand to the reader */
+	uint32_t last_id;	/* final (short) block, 0 if not yet seen */
+	int read_offset;	/* offset into block read_id */
+	struct list_head blocks;	/* received blocks, sorted by id */
 };
 
 struct tftp_priv {
 	IPaddr_t server;
+
+	/* statistics of all transfers, exported as device parameters */
+	int retransmits;	/* requests repeated after a timeout */
+	int window_restarts;	/* windows restarted after a lost block */
+	int duplicates;		/* blocks received twice */
 };
 
 static int tftp_create(struct device_d *dev, const char *pathname, mode_t mode)
@@ -143,15 +179,24 @@ static int tftp_send(struct file_priv *priv)
 				"tsize%c"
 				"%d%c"
 				"blksize%c"
-				"1432",
+				"%d",
 				priv->filename, 0,
 				0,
 				0,
 				TIMEOUT, 0,
 				0,
 				priv->filesize, 0,
-				0);
+				0,
+				priv->blksize_req);
 		pkt++;
+		if (priv->windowsize > 1) {
+			pkt += sprintf((unsigned char *)pkt, "windowsize%c%d%c",
+					0, priv->windowsize, 0);
+		}
+		if (priv->state == STATE_RRQ && tftp_multicast) {
+			pkt += sprintf((unsigned char *)pkt, "multicast%c", 0);
+			*pkt++ = 0;
+		}
 		len = pkt - xp;
 		break;
 
@@ -174,25 +219,98 @@ static int tftp_send(struct file_priv *priv)
 	return ret;
 }
 
-static int tftp_send_write(struct file_priv *priv, void *buf, int len)
+/*
+ * Send block i of the current window. The window holds the blocks starting
+ * at priv->block which are sent but not yet acknowledged.
+ */
+static int tftp_send_write(struct file_priv *priv, int i)
 {
 	uint16_t *s;
 	unsigned char *pkt = net_udp_get_payload(priv->tftp_con);
-	int ret;
+	int len = priv->blocksize;
+
+	if (priv->state == STATE_LAST && i == priv->win_count - 1)
+		len = priv->final_len;
 
 	s = (uint16_t *)pkt;
 	*s++ = htons(TFTP_DATA);
-	*s++ = htons(priv->block);
-	memcpy((void *)s, buf, len);
-	if (len < priv->blocksize)
-		priv->state = STATE_LAST;
+	*s++ = htons(priv->block + i);
+	memcpy((void *)s, priv->buf + i * priv->blocksize, len);
 	len += 4;
 
-	ret = net_udp_send(priv->tftp_con, len);
-	priv->last_block = priv->block;
-	priv->state = STATE_WAITACK;
+	return net_udp_send(priv->tftp_con, len);
+}
 
-	return ret;
+static int tftp_send_window(struct file_priv *priv)
+{
+	int i, ret;
+
+	for (i = 0; i < priv->win_count; i++) {
+		ret = tftp_send_write(priv, i);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * The server acknowledged the first 'acked' blocks of the window. Any blocks
+ * left in the window were lost or dropped by the server, so per RFC 7440 we
+ * continue sending right after the acknowledged block.
+ */
+static void tftp_window_ack(struct file_priv *priv, int acked)
+{
+	priv->block += acked;
+	priv->win_count -= acked;
+	memmove(priv->buf, priv->buf + acked * priv->blocksize,
+			priv->win_count * priv->blocksize);
+
+	if (priv->win_count) {
+		tftp_send_window(priv);
+		return;
+	}
+
+	if (priv->state == STATE_LAST)
+		priv->state = STATE_DONE;
+	else
+		priv->state = STATE_WDATA;
+}
+
+static int tftp_poll(struct file_priv *priv);
+
+/*
+ * Move len bytes from the fifo into the window and send them as the next
+ * block, waiting for a free slot in the window first. A block shorter than
+ * the blocksize ends the transfer.
+ */
+static int tftp_write_block(struct file_priv *priv, int len)
+{
+	int ret;
+
+	while (priv->win_count == priv->windowsize) {
+		priv->state = STATE_WAITACK;
+		ret = tftp_poll(priv);
+		if (ret == TFTP_ERR_RESEND)
+			tftp_send_window(priv);
+		if (ret < 0)
+			return ret;
+		if (priv->state == STATE_DONE)
+			return priv->err ? priv->err : -EIO;
+	}
+
+	kfifo_get(priv->fifo, priv->buf + priv->win_count * priv->blocksize,
+			len);
+	priv->win_count++;
+
+	if (len < priv->blocksize) {
+		priv->final_len = len;
+		priv->state = STATE_LAST;
+	}
+
+	priv->resend_timeout = get_time_ns();
+
+	return tftp_send_write(priv, priv->win_count - 1);
 }
 
 static int tftp_poll(struct file_priv *priv)
@@ -205,6 +323,7 @@ static int tftp_poll(struct file_priv *priv)
 
 	if (is_timeout(priv->resend_timeout, TFTP_RESEND_TIMEOUT)) {
 		printf("T ");
+		priv->tpriv->retransmits++;
 		priv->resend_timeout = get_time_ns();
 		priv->block_requested = -1;
 		return TFTP_ERR_RESEND;
@@ -221,9 +340,39 @@ static int tftp_poll(struct file_priv *priv)
 	return 0;
 }
 
+/*
+ * Parse the value of the RFC 2090 multicast option: "addr,port,mc". The
+ * address and port are only sent in the first OACK, later OACKs only change
+ * the master client status.
+ */
+static void tftp_parse_multicast(struct file_priv *priv, char *val)
+{
+	char *port, *mc;
+	IPaddr_t addr;
+
+	port = strchr(val, ',');
+	if (!port)
+		return;
+	*port++ = 0;
+
+	mc = strchr(port, ',');
+	if (!mc)
+		return;
+	*mc++ = 0;
+
+	if (*val && !string_to_ip(val, &addr) && is_multicast_ip_addr(addr))
+		priv->mcast_addr = addr;
+	if (*port)
+		priv->mcast_port = simple_strtoul(port, NULL, 10);
+
+	priv->master = simple_strtoul(mc, NULL, 10) == 1;
+	priv->multicast = 1;
+}
+
 static void tftp_parse_oack(struct file_priv *priv, unsigned char *pkt, int len)
 {
 	unsigned char *opt, *val, *s;
+	int windowsize = 1;
 
 	pkt[len - 1] = 0;
 
@@ -238,14 +387,22 @@ static void tftp_parse_oack(struct file_priv *priv, unsigned char *pkt, int len)
 		opt = s;
 		val = s + strlen(s) + 1;
 		if (val > s + len)
-			return;
+			break;
 		if (!strcmp(opt, "tsize"))
 			priv->filesize = simple_strtoul(val, NULL, 10);
 		if (!strcmp(opt, "blksize"))
 			priv->blocksize = simple_strtoul(val, NULL, 10);
+		if (!strcmp(opt, "windowsize"))
+			windowsize = clamp_t(int, simple_strtoul(val, NULL, 10),
+					1, priv->windowsize);
 		debug("OACK opt: %s val: %s\n", opt, val);
 		s = val + strlen(val) + 1;
+		if (!strcmp(opt, "multicast"))
+			tftp_parse_multicast(priv, val);
 	}
+
+	/* servers not knowing the option don't acknowledge it */
+	priv->windowsize = windowsize;
 }
 
 static void tftp_timer_reset(struct file_priv *priv)
@@ -253,6 +410,193 @@ static void tftp_timer_reset(struct file_priv *priv)
 	priv->progress_timeout = priv->resend_timeout = get_time_ns();
 }
 
+/*
+ * Hand received data to the reader. While a read is pending the data goes
+ * straight into the reader's buffer, only what does not fit is queued in
+ * the fifo.
+ */
+static void tftp_put_data(struct file_priv *priv, unsigned char *data, int len)
+{
+	int now = min_t(size_t, len, priv->read_len);
+
+	if (now) {
+		memcpy(priv->read_buf, data, now);
+		priv->read_buf += now;
+		priv->read_len -= now;
+	}
+
+	kfifo_put(priv->fifo, data + now, len - now);
+}
+
+static void tftp_handler(void *ctx, char *packet, unsigned len);
+
+/*
+ * Multicast clients may join a transfer at any point, so blocks are not
+ * necessarily received in order. Up to global.tftp.mcast_max_blocks blocks
+ * are buffered ahead of the last block received in order, never more than
+ * the file has when the server told us its size. The limit stays below
+ * 32768 so that the 16bit block numbers can be extended unambiguously.
+ */
+static int tftp_mcast_max_blocks(struct file_priv *priv)
+{
+	int max = clamp(tftp_mcast_max, 1, 32767);
+
+	if (priv->filesize)
+		max = min(max, priv->filesize / priv->blocksize + 1 -
+				(int)priv->rx_id);
+
+	return max;
+}
+
+/*
+ * Extend a block number to 32bit relative to the last block received in
+ * order. Blocks behind it and those beyond the buffer limit give 0 and are
+ * dropped, a late joiner missing more than the limit requests them again
+ * once it becomes master.
+ */
+static uint32_t tftp_mcast_block_id(struct file_priv *priv, uint16_t block)
+{
+	uint16_t ahead = block - (uint16_t)priv->rx_id;
+
+	if (ahead > tftp_mcast_max_blocks(priv))
+		return 0;
+
+	return priv->rx_id + ahead;
+}
+
+static void tftp_mcast_ack(struct file_priv *priv)
+{
+	priv->block = priv->rx_id;
+	tftp_send(priv);
+}
+
+/*
+ * Insert a block into the sorted list of received blocks. Returns 1 if the
+ * block is new, 0 if we already have it.
+ */
+static int tftp_mcast_put(struct file_priv *priv, uint32_t id, void *buf,
+		int len)
+{
+	struct tftp_block *b, *pos;
+
+	if (id <= priv->rx_id)
+		return 0;
+
+	/*
+	 * Blocks normally arrive in ascending order, so check the tail first.
+	 * Retransmissions requested to fill holes belong near the head.
+	 */
+	pos = list_last_entry(&priv->blocks, struct tftp_block, list);
+	if (!list_empty(&priv->blocks) && pos->id >= id) {
+		list_for_each_entry(pos, &priv->blocks, list) {
+			if (pos->id == id)
+				return 0;
+			if (pos->id > id)
+				break;
+		}
+		pos = list_entry(pos->list.prev, struct tftp_block, list);
+	}
+
+	b = xmalloc(sizeof(*b) + len);
+	b->id = id;
+	b->len = len;
+	memcpy(b->data, buf, len);
+	list_add(&b->list, &pos->list);
+
+	if (len < priv->blocksize)
+		priv->last_id = id;
+
+	if (id != priv->rx_id + 1)
+		return 1;
+
+	list_for_each_entry_from(b, &priv->blocks, list) {
+		if (b->id != priv->rx_id + 1)
+			break;
+		priv->rx_id++;
+	}
+
+	return 1;
+}
+
+static void tftp_mcast_free(struct file_priv *priv)
+{
+	struct tftp_block *b, *tmp;
+
+	list_for_each_entry_safe(b, tmp, &priv->blocks, list) {
+		list_del(&b->list);
+		free(b);
+	}
+
+	if (priv->mcast_con)
+		net_unregister(priv->mcast_con);
+}
+
+static void tftp_mcast_oack(struct file_priv *priv, struct udphdr *udp)
+{
+	if (priv->state == STATE_RRQ) {
+		priv->server_port = ntohs(udp->uh_sport);
+		priv->tftp_con->udp->uh_dport = udp->uh_sport;
+
+		if (!priv->mcast_addr || !priv->mcast_port) {
+			printf("error: server sent no multicast group\n");
+			priv->err = -EINVAL;
+			priv->state = STATE_DONE;
+			return;
+		}
+
+		priv->mcast_con = net_udp_new(priv->mcast_addr,
+				priv->mcast_port, tftp_handler, priv);
+		if (IS_ERR(priv->mcast_con)) {
+			priv->err = PTR_ERR(priv->mcast_con);
+			priv->mcast_con = NULL;
+			priv->state = STATE_DONE;
+			return;
+		}
+
+		net_udp_bind(priv->mcast_con, priv->mcast_port);
+		priv->state = STATE_RDATA;
+	}
+
+	debug("%s: master: %d\n", __func__, priv->master);
+
+	/* As new master client we request the first block we miss */
+	if (priv->master) {
+		priv->block_requested = -1;
+		tftp_mcast_ack(priv);
+	}
+}
+
+static void tftp_mcast_data(struct file_priv *priv, struct udphdr *udp,
+		unsigned char *pkt, int len)
+{
+	uint32_t id;
+
+	if (priv->state != STATE_RDATA)
+		return;
+
+	if (ntohs(udp->uh_sport) != priv->server_port)
+		return;
+
+	id = tftp_mcast_block_id(priv, ntohs(*(uint16_t *)pkt));
+
+	if (tftp_mcast_put(priv, id, pkt + 2, len))
+		tftp_timer_reset(priv);
+	else
+		/* the server is still alive, serving other clients */
+		priv->progress_timeout = get_time_ns();
+
+	if (priv->last_id && priv->rx_id == priv->last_id) {
+		/* Send the final ACK so the server can drop us */
+		tftp_mcast_ack(priv);
+		priv->err = 0;
+		priv->state = STATE_DONE;
+		return;
+	}
+
+	if (priv->master)
+		tftp_mcast_ack(priv);
+}
+
 static void tftp_handler(void *ctx, char *packet, unsigned len)
 {
 	struct file_priv *priv = ctx;
@@ -260,6 +604,8 @@ static void tftp_handler(void *ctx, char *packet, unsigned len)
 	uint16_t *s;
 	char *pkt = net_eth_to_udp_payload(packet);
 	struct udphdr *udp = net_eth_to_udphdr(packet);
+	uint16_t block;
+	int acked;
 
 	len = net_eth_to_udplen(packet);
 	if (len < 2)
@@ -282,26 +628,31 @@ static void tftp_handler(void *ctx, char *packet, unsigned len)
 		if (!priv->push)
 			break;
 
-		priv->block = ntohs(*(uint16_t *)pkt);
-		if (priv->block != priv->last_block) {
-			debug("ack %d != %d\n", priv->block, priv->last_block);
+		block = ntohs(*(uint16_t *)pkt);
+		acked = (uint16_t)(block - priv->block + 1);
+		if (acked > priv->win_count) {
+			debug("ack %d outside of window %d+%d\n", block,
+					priv->block, priv->win_count);
 			break;
 		}
 
-		priv->block++;
-
 		tftp_timer_reset(priv);
 
-		if (priv->state == STATE_LAST) {
-			priv->state = STATE_DONE;
-			break;
-		}
+		if (priv->state == STATE_WRQ)
+			/* plain ACK instead of OACK: no windowing */
+			priv->windowsize = 1;
+
 		priv->tftp_con->udp->uh_dport = udp->uh_sport;
-		priv->state = STATE_WDATA;
+		tftp_window_ack(priv, acked);
 		break;
 
 	case TFTP_OACK:
 		tftp_parse_oack(priv, pkt, len);
+		if (priv->multicast) {
+			tftp_mcast_oack(priv, udp);
+			break;
+		}
+
 		priv->server_port = ntohs(udp->uh_sport);
 		priv->tftp_con->udp->uh_dport = udp->uh_sport;
 
@@ -321,7 +672,17 @@ static void tftp_handler(void *ctx, char *packet, unsigned len)
 		if (len < 2)
 			return;
 		len -= 2;
-		priv->block = ntohs(*(uint16_t *)pkt);
+
+		if (priv->multicast) {
+			tftp_mcast_data(priv, udp, pkt, len);
+			break;
+		}
+
+		block = ntohs(*(uint16_t *)pkt);
+
+		if (priv->state == STATE_RRQ)
+			/* plain DATA instead of OACK: no windowing */
+			priv->windowsize = 1;
 
 		if (priv->state == STATE_RRQ || priv->state == STATE_OACK) {
 			/* first block received */
@@ -330,29 +691,54 @@ static void tftp_handler(void *ctx, char *packet, unsigned len)
 			priv->server_port = ntohs(udp->uh_sport);
 			priv->last_block = 0;
 
-			if (priv->block != 1) {	/* Assertion */
+			if (block != 1 && priv->windowsize == 1) { /* Assertion */
 				printf("error: First block is not block 1 (%d)\n",
-					priv->block);
+					block);
 				priv->err = -EINVAL;
 				priv->state = STATE_DONE;
 				break;
 			}
 		}
 
-		if (priv->block == priv->last_block)
-			/* Same block again; ignore it. */
+		if (block != (uint16_t)(priv->last_block + 1)) {
+			/*
+			 * A block ahead of the expected one means we lost a
+			 * block of the current window. Acknowledge the last
+			 * block received in order once, so that the server
+			 * restarts the window from there. Anything else is
+			 * the same block again; ignore it.
+			 */
+			if ((int16_t)(block - priv->last_block) <= 0) {
+				priv->tpriv->duplicates++;
+			} else if (!priv->window_lost) {
+				priv->tpriv->window_restarts++;
+				priv->window_lost = 1;
+				priv->window_count = 0;
+				priv->block = priv->last_block;
+				priv->block_requested = -1;
+			}
 			break;
+		}
 
-		priv->last_block = priv->block;
+		priv->window_lost = 0;
+		priv->last_block = block;
 
 		tftp_timer_reset(priv);
 
-		kfifo_put(priv->fifo, pkt + 2, len);
+		tftp_put_data(priv, pkt + 2, len);
 
 		if (len < priv->blocksize) {
+			priv->block = block;
 			tftp_send(priv);
 			priv->err = 0;
 			priv->state = STATE_DONE;
+			break;
+		}
+
+		/* Only the last block of each window is acknowledged */
+		if (++priv->window_count >= priv->windowsize) {
+			priv->window_count = 0;
+			priv->block = block;
 		}
 
 		break;
@@ -361,10 +747,10 @@ static void tftp_handler(void *ctx, char *packet, unsigned len)
 		debug("\nTFTP error: '%s' (%d)\n",
 				pkt + 2, ntohs(*(uint16_t *)pkt));
 		switch (ntohs(*(uint16_t *)pkt)) {
-		case 1:
+		case TFTP_ENOTFOUND:
 			priv->err = -ENOENT;
 			break;
-		case 2:
+		case TFTP_EACCESS:
 			priv->err = -EACCES;
 			break;
 		default:
@@ -381,7 +767,7 @@ static struct file_priv *tftp_do_open(struct device_d *dev,
 {
 	struct file_priv *priv;
 	struct tftp_priv *tpriv = dev->priv;
-	int ret;
+	int fifo_size, ret;
 
 	priv = xzalloc(sizeof(*priv));
 
@@ -409,22 +795,33 @@ static struct file_priv *tftp_do_open(struct device_d *dev,
 		goto out;
 	}
 
+	priv->tpriv = tpriv;
 	priv->block = 1;
 	priv->err = -EINVAL;
 	priv->filename = filename;
 	priv->blocksize = TFTP_BLOCK_SIZE;
 	priv->block_requested = -1;
-
-	priv->fifo = kfifo_alloc(TFTP_FIFO_SIZE);
-	if (!priv->fifo) {
-		ret = -ENOMEM;
-		goto out;
-	}
+	priv->windowsize = clamp(tftp_windowsize, 1, TFTP_MAX_WINDOW_SIZE);
+	priv->read_id = 1;
+	INIT_LIST_HEAD(&priv->blocks);
 
 	priv->tftp_con = net_udp_new(tpriv->server, TFTP_PORT, tftp_handler,
 			priv);
 	if (IS_ERR(priv->tftp_con)) {
 		ret = PTR_ERR(priv->tftp_con);
+		goto out;
+	}
+
+	/* Use the largest block fitting into a frame of the interface */
+	priv->blksize_req = max(net_eth_udp_payload(priv->tftp_con->edev) -
+			NET_BLKSIZE_SLACK, TFTP_BLOCK_SIZE);
+
+	/* kfifo needs a power of two size */
+	fifo_size = max(TFTP_FIFO_SIZE, 2 * priv->blksize_req) *
+		priv->windowsize;
+	priv->fifo = kfifo_alloc(1 << fls(fifo_size - 1));
+	if (!priv->fifo) {
+		ret = -ENOMEM;
 		goto out1;
 	}
 
@@ -448,13 +845,14 @@ static struct file_priv *tftp_do_open(struct device_d *dev,
 		goto out2;
 	}
 
-	priv->buf = xmalloc(priv->blocksize);
+	priv->buf = xmalloc(priv->blocksize * priv->windowsize);
 
 	return priv;
 out2:
-	net_unregister(priv->tftp_con);
-out1:
+	tftp_mcast_free(priv);
 	kfifo_free(priv->fifo);
+out1:
+	net_unregister(priv->tftp_con);
 out:
 	free(priv);
 
@@ -480,18 +878,14 @@ static int tftp_do_close(struct file_priv *priv)
 	int ret;
 
 	if (priv->push && priv->state != STATE_DONE) {
-		int len;
-
-		len = kfifo_get(priv->fifo, priv->buf, priv->blocksize);
-		tftp_send_write(priv, priv->buf, len);
-		priv->state = STATE_LAST;
+		ret = tftp_write_block(priv, kfifo_len(priv->fifo));
 
 		tftp_timer_reset(priv);
 
-		while (priv->state != STATE_DONE) {
+		while (!ret && priv->state != STATE_DONE) {
 			ret = tftp_poll(priv);
 			if (ret == TFTP_ERR_RESEND)
-				tftp_send_write(priv, priv->buf, len);
+				tftp_send_window(priv);
 			if (ret < 0)
 				break;
 		}
@@ -505,6 +899,7 @@ static int tftp_do_close(struct file_priv *priv)
 		net_udp_send(priv->tftp_con, 6);
 	}
 
+	tftp_mcast_free(priv);
 	net_unregister(priv->tftp_con);
 	kfifo_free(priv->fifo);
 	free(priv->buf);
@@ -535,19 +930,9 @@ static int tftp_write(struct device_d *_dev, FILE *f, const void *inbuf,
 		now = kfifo_put(priv->fifo, inbuf, size);
 
 		while (kfifo_len(priv->fifo) >= priv->blocksize) {
-			kfifo_get(priv->fifo, priv->buf, priv->blocksize);
-
-			tftp_send_write(priv, priv->buf, priv->blocksize);
-			tftp_timer_reset(priv);
-
-			while (priv->state == STATE_WAITACK) {
-				ret = tftp_poll(priv);
-				if (ret == TFTP_ERR_RESEND)
-					tftp_send_write(priv, priv->buf,
-							priv->blocksize);
-				if (ret < 0)
-					return ret;
-			}
+			ret = tftp_write_block(priv, priv->blocksize);
+			if (ret)
+				return ret;
 		}
 		size -= now;
 		inbuf += now;
@@ -556,34 +941,95 @@ static int tftp_write(struct device_d *_dev, FILE *f, const void *inbuf,
 	return insize;
 }
 
-static int tftp_read(struct device_d *dev, FILE *f, void *buf, size_t insize)
+static int tftp_mcast_read(struct file_priv *priv, void *buf, size_t insize)
 {
-	struct file_priv *priv = f->inode;
+	struct tftp_block *b;
 	size_t outsize = 0, now;
 	int ret;
 
-	debug("%s %zu\n", __func__, insize);
-
 	while (insize) {
-		now = kfifo_get(priv->fifo, buf, insize);
-		if (priv->state == STATE_DONE)
-			return outsize + now;
-		if (now) {
+		b = list_first_entry_or_null(&priv->blocks, struct tftp_block,
+				list);
+		if (b && b->id == priv->read_id) {
+			now = min_t(size_t, insize, b->len - priv->read_offset);
+			memcpy(buf, b->data + priv->read_offset, now);
 			outsize += now;
 			buf += now;
 			insize -= now;
+			priv->read_offset += now;
+
+			if (priv->read_offset == b->len) {
+				list_del(&b->list);
+				free(b);
+				priv->read_id++;
+				priv->read_offset = 0;
+			}
+			continue;
 		}
 
-		if (TFTP_FIFO_SIZE - kfifo_len(priv->fifo) >= priv->blocksize)
+		if (priv->state == STATE_DONE)
+			break;
+
+		ret = tftp_poll(priv);
+		/* only the master client talks to the server */
+		if (ret == TFTP_ERR_RESEND && priv->master)
+			tftp_mcast_ack(priv);
+		if (ret < 0)
+			return ret;
+	}
+
+	return outsize;
+}
+
+static int tftp_read(struct device_d *dev, FILE *f, void *buf, size_t insize)
+{
+	struct file_priv *priv = f->inode;
+	size_t outsize = 0, now;
+	int ret;
+
+	debug("%s %zu\n", __func__, insize);
+
+	if (priv->multicast)
+		return tftp_mcast_read(priv, buf, insize);
+
+	/* leftovers from the last block go first */
+	now = kfifo_get(priv->fifo, buf, insize);
+	outsize += now;
+	buf += now;
+	insize -= now;
+
+	/*
+	 * The fifo is empty now if there is anything left to read, so the
+	 * handler can put the following blocks directly into our buffer.
+	 */
+	priv->read_buf = buf;
+	priv->read_len = insize;
+
+	while (priv->read_len) {
+		if (priv->state == STATE_DONE)
+			break;
+
+		/* only ask for the next window if we have room for it */
+		if (priv->read_len + priv->fifo->size - kfifo_len(priv->fifo) >=
+				priv->blocksize * priv->windowsize)
 			tftp_send(priv);
 
 		ret = tftp_poll(priv);
-		if (ret == TFTP_ERR_RESEND)
+		if (ret == TFTP_ERR_RESEND) {
+			/* restart the window after the last block we have */
+			priv->block = priv->last_block;
+			priv->window_count = 0;
 			tftp_send(priv);
-		if (ret < 0)
+		}
+		if (ret < 0) {
+			priv->read_len = 0;
 			return ret;
+		}
 	}
 
+	outsize += insize - priv->read_len;
+	priv->read_len = 0;
+
 	return outsize;
 }
 
@@ -627,6 +1073,13 @@ static int tftp_probe(struct device_d *dev)
 
 	priv->server = resolv(fsdev->backingstore);
 
+	dev_add_param_int(dev, "retransmits", NULL, NULL, &priv->retransmits,
+			"%u", NULL);
+	dev_add_param_int(dev, "window_restarts", NULL, NULL,
+			&priv->window_restarts, "%u", NULL);
+	dev_add_param_int(dev, "duplicates", NULL, NULL, &priv->duplicates,
+			"%u", NULL);
+
 	return 0;
 }
 
@@ -663,3 +1116,20 @@ static int tftp_init(void)
 	return register_fs_driver(&tftp_driver);
 }
 coredevice_initcall(tftp_init);
+
+static int tftp_global_init(void)
+{
+	globalvar_add_simple_bool("tftp.multicast", &tftp_multicast);
+	globalvar_add_simple_int("tftp.windowsize", &tftp_windowsize, "%d");
+	globalvar_add_simple_int("tftp.mcast_max_blocks", &tftp_mcast_max, "%d");
+
+	return 0;
+}
+late_initcall(tftp_global_init);
+
+BAREBOX_MAGICVAR_NAMED(global_tftp_multicast, global.tftp.multicast,
+		"Request RFC 2090 multicast transfers for TFTP reads");
+BAREBOX_MAGICVAR_NAMED(global_tftp_windowsize, global.tftp.windowsize,
+		"Number of TFTP blocks in flight (RFC 7440), 1 disables windowing");
+BAREBOX_MAGICVAR_NAMED(global_tftp_mcast_max_blocks, global.tftp.mcast_max_blocks,
+		"Blocks a TFTP multicast client buffers out of order (at most 32767)");
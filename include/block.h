@@ -3,6 +3,7 @@
 
 #include <driver.h>
 #include <linux/list.h>
+#include <linux/rbtree.h>
 
 struct block_device;
 
@@ -21,9 +22,24 @@ struct block_device {
 	int num_blocks;
 	int rdbufsize;
 	int blkmask;
+	int max_blocks;		/* largest request the driver handles, 0 for no limit */
 
-	struct list_head buffered_blocks;
+	struct list_head buffered_blocks;	/* cached chunks, most recently used first */
 	struct list_head idle_blocks;
+	struct rb_root chunk_tree;		/* cached chunks by block_start */
+
+	int cache_chunks;
+	int cache_chunksize;
+	int cache_readahead;	/* maximum number of chunks read at once */
+	int cache_hits;
+	int cache_misses;
+	int cache_evictions;
+	struct param_d *cache_params[6];
+
+	int ra_next;		/* first block of the chunk a sequential reader needs next */
+	int ra_window;		/* number of chunks read on the last miss */
+	void *bounce_buf;	/* for requests spanning several chunks */
+	int bounce_chunks;	/* capacity of bounce_buf */
 
 	struct cdev cdev;
 };
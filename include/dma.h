@@ -13,6 +13,14 @@
 
 #include <asm/dma.h>
 
+/*
+ * Buffers handed to DMA capable drivers should be aligned to this. The
+ * default dma_alloc() below gives no stronger guarantee than malloc().
+ */
+#ifndef DMA_ALIGNMENT
+#define DMA_ALIGNMENT	1
+#endif
+
 #ifndef dma_alloc
 static inline void *dma_alloc(size_t size)
 {
@@ -28,10 +28,43 @@
 #define PKT_NUM_RETRIES 4
 
 /* The number of receive packet buffers */
+#ifdef CONFIG_NET_RX_PACKETS
+#define PKTBUFSRX	CONFIG_NET_RX_PACKETS
+#else
 #define PKTBUFSRX	4
+#endif
+
+/* The largest MTU packet buffers are allocated for */
+#define ETH_DATA_LEN	1500
+#ifdef CONFIG_NET_MAX_MTU
+#define ETH_MAX_MTU	CONFIG_NET_MAX_MTU
+#else
+#define ETH_MAX_MTU	ETH_DATA_LEN
+#endif
 
 struct device_d;
 
+/* Reasons for discarding a received frame, see eth_rx_drop() */
+enum eth_drop_reason {
+	ETH_DROP_BAD,		/* malformed header or bad IP checksum */
+	ETH_DROP_CSUM,		/* bad UDP or TCP checksum */
+	ETH_DROP_PROTO,		/* unsupported ethertype or IP protocol */
+	ETH_DROP_ADDR,		/* addressed to another host */
+	ETH_DROP_MCAST,		/* multicast group we are not a member of */
+	ETH_DROP_NOPORT,	/* no connection for the UDP or TCP port */
+	ETH_DROP_OVERRUN,	/* receive ring or fifo overrun in the MAC */
+	ETH_DROP_NUM,
+};
+
+#define ARP_CACHE_SIZE		16
+
+/* neighbour cache entry, see net/net.c */
+struct arp_entry {
+	IPaddr_t ip;
+	u8 ethaddr[6];
+	uint64_t time;
+};
+
 struct eth_device {
 	int active;
 
@@ -40,6 +73,17 @@ struct eth_device {
 	int  (*open) (struct eth_device*);
 	int  (*send) (struct eth_device*, void *packet, int length);
 	int  (*recv) (struct eth_device*);
+	/*
+	 * Optional replacement for recv(): drain up to @budget ready receive
+	 * descriptors and return how many were processed.
+	 */
+	int  (*recv_batch) (struct eth_device*, int budget);
+	/*
+	 * Optional for drivers whose send() only queues the frame on a
+	 * transmit ring: reclaim the descriptors the hardware is done with
+	 * and return the number of frames still in flight.
+	 */
+	int  (*tx_reap) (struct eth_device*);
 	void (*halt) (struct eth_device*);
 	int  (*get_ethaddr) (struct eth_device*, u8 adr[6]);
 	int  (*set_ethaddr) (struct eth_device*, u8 adr[6]);
@@ -61,14 +105,43 @@ struct eth_device {
 	IPaddr_t netmask;
 	IPaddr_t gateway;
 	char ethaddr[6];
+
+	struct arp_entry arp_cache[ARP_CACHE_SIZE];
+
+	/* statistics, exported as device parameters */
+	int rx_packets;
+	int rx_bytes;
+	int rx_errors;		/* frames with CRC or other MAC errors */
+	int rx_dropped;		/* sum of rx_drop[] */
+	int rx_drop[ETH_DROP_NUM];
+	int rx_ring_max;	/* most descriptors drained in one poll */
+	int tx_packets;
+	int tx_bytes;
+	int tx_errors;
+	int tx_carrier_errors;	/* frames not sent because the link was down */
+	int tx_ring_max;	/* most frames queued for transmission */
+
+	int mtu;
+	int max_mtu;		/* set by drivers supporting jumbo frames */
 };
 
 #define dev_to_edev(d) container_of(d, struct eth_device, dev)
 
+static inline void eth_rx_drop(struct eth_device *edev,
+		enum eth_drop_reason reason)
+{
+	edev->rx_dropped++;
+	edev->rx_drop[reason]++;
+}
+
+extern const char *eth_drop_names[ETH_DROP_NUM];
+
 int eth_register(struct eth_device* dev);    /* Register network device		*/
 void eth_unregister(struct eth_device* dev); /* Unregister network device	*/
 
+int eth_open(struct eth_device *edev);	/* Open for receiving		*/
 int eth_send(struct eth_device *edev, void *packet, int length);	   /* Send a packet		*/
+int eth_tx_flush(struct eth_device *edev);	/* Wait for queued packets	*/
 int eth_rx(void);			/* Check for received packets	*/
 
 /* associate a MAC address to a ethernet device. Should be called by
@@ -83,9 +156,14 @@ static inline void of_eth_register_ethaddr(struct device_node *node,
 		const char *ethaddr)
 {
 }
+static inline int eth_busy(void)
+{
+	return 0;
+}
 #else
 void eth_register_ethaddr(int ethid, const char *ethaddr);
 void of_eth_register_ethaddr(struct device_node *node, const char *ethaddr);
+int eth_busy(void);
 #endif
 /*
  *	Ethernet header
@@ -105,6 +183,7 @@ struct ethernet {
 
 #define IPPROTO_ICMP	 1	/* Internet Control Message Protocol	*/
 #define IPPROTO_IGMP	 2	/* Internet Group Management Protocol   */
+#define IPPROTO_TCP	 6	/* Transmission Control Protocol	*/
 #define IPPROTO_UDP	17	/* User Datagram Protocol		*/
 
 /*
@@ -131,6 +210,24 @@ struct udphdr {
 	uint16_t	uh_sum;		/* udp checksum */
 } __attribute__ ((packed));
 
+struct tcphdr {
+	uint16_t	source;
+	uint16_t	dest;
+	uint32_t	seq;
+	uint32_t	ack_seq;
+	uint8_t		doff;		/* header length in words, upper nibble */
+	uint8_t		flags;
+	uint16_t	window;
+	uint16_t	check;
+	uint16_t	urg_ptr;
+} __attribute__ ((packed));
+
+#define TCP_FIN		0x01
+#define TCP_SYN		0x02
+#define TCP_RST		0x04
+#define TCP_PSH		0x08
+#define TCP_ACK		0x10
+
 /*
  *	Address Resolution Protocol (ARP) header.
  */
@@ -189,6 +286,9 @@ struct icmphdr {
 #define IGMP_ALL_HOST_ADDR		0xe0000001
 #define IGMP_HOST_MEMBERSHIP_QUERY	0x11		/* IGMPv1 */
 #define IGMP_HOST_MEMBERSHIP_REPORT	0x12		/* IGMPv1 */
+#define IGMP_V2_MEMBERSHIP_REPORT	0x16		/* IGMPv2 */
+#define IGMP_V2_LEAVE_GROUP		0x17		/* IGMPv2 */
+#define IGMP_V3_MEMBERSHIP_REPORT	0x22		/* IGMPv3 */
 
 struct igmpmsg {
 	uint8_t		type;
@@ -203,9 +303,24 @@ struct igmpmsg {
  * TFTP packets can be 524 bytes + IP header + ethernet header.
  * Lets be conservative, and go for 38 * 16.  (Must also be
  * a multiple of 32 bytes).
+ *
+ * Drivers program this into their receive hardware, so it stays at the
+ * standard frame size. Jumbo capable drivers size their receive buffers
+ * with eth_max_frame() instead.
  */
 #define PKTSIZE			1518
 
+/* Frame size for @mtu: ethernet header, VLAN tag and CRC on top */
+#define ETH_FRAME_SIZE(mtu)	((mtu) + 18)
+
+/* Largest frame a driver setting max_mtu has to receive */
+static inline int eth_max_frame(struct eth_device *edev)
+{
+	int mtu = edev->max_mtu ? edev->max_mtu : ETH_DATA_LEN;
+
+	return ETH_FRAME_SIZE(min_t(int, mtu, ETH_MAX_MTU));
+}
+
 /**********************************************************************/
 /*
  *	Globals.
@@ -228,6 +343,9 @@ IPaddr_t net_get_serverip(void);
 /* Do the work */
 void net_poll(void);
 
+void net_rx_timing(int enable);
+uint64_t net_rx_time(void);
+
 static inline struct arprequest *net_eth_to_arprequest(char *pkt)
 {
 	return (struct arprequest *)(pkt + ETHER_HDR_SIZE);
@@ -253,6 +371,11 @@ static inline char *net_eth_to_icmp_payload(char *pkt)
 	return (char *)(net_eth_to_icmphdr(pkt) + 1);
 }
 
+static inline struct tcphdr *net_eth_to_tcphdr(char *pkt)
+{
+	return (struct tcphdr *)(net_eth_to_iphdr(pkt) + 1);
+}
+
 static inline struct igmpmsg *net_eth_to_igmpmsg(char *pkt)
 {
 	return (struct igmpmsg *)(net_eth_to_iphdr(pkt) + 1);
@@ -263,6 +386,19 @@ static inline char *net_eth_to_udp_payload(char *pkt)
 	return (char *)(net_eth_to_udphdr(pkt) + 1);
 }
 
+/* Largest UDP payload fitting into a single frame on @edev */
+static inline int net_eth_udp_payload(struct eth_device *edev)
+{
+	return edev->mtu - sizeof(struct iphdr) - sizeof(struct udphdr);
+}
+
+/*
+ * Block size offered by the tftp and mcast filesystems relative to
+ * net_eth_udp_payload(): protocol header and some headroom for tunnels,
+ * 1432 on standard ethernet.
+ */
+#define NET_BLKSIZE_SLACK	40
+
 static inline int net_eth_to_udplen(char *pkt)
 {
 	struct udphdr *udp = net_eth_to_udphdr(pkt);
@@ -271,6 +407,27 @@ static inline int net_eth_to_udplen(char *pkt)
 
 int net_checksum_ok(unsigned char *, int);	/* Return true if cksum OK	*/
 uint16_t net_checksum(unsigned char *, int);	/* Calculate the checksum	*/
+uint32_t net_checksum_partial(const void *buf, int len, uint32_t sum);
+
+/* Fold a partial checksum to 16 bits */
+static inline uint16_t net_checksum_fold(uint32_t sum)
+{
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+/*
+ * Incrementally update a header checksum after a 16 bit field changed from
+ * @old to @new (RFC 1624), without summing the whole header again.
+ */
+static inline uint16_t net_checksum_update(uint16_t check, uint16_t old,
+		uint16_t new)
+{
+	uint32_t sum = (uint16_t)~check + (uint16_t)~old + new;
+
+	return ~net_checksum_fold(sum);
+}
 
 /* Print an IP address on the console */
 void print_IPaddr (IPaddr_t);
@@ -450,6 +607,9 @@ void eth_set_current(struct eth_device *eth);
 struct eth_device *eth_get_current(void);
 struct eth_device *eth_get_byname(const char *name);
 
+extern struct list_head netdev_list;
+#define for_each_netdev(edev) list_for_each_entry(edev, &netdev_list, list)
+
 /**
  * net_receive - Pass a received packet from an ethernet driver to the protocol stack
  * @pkt: Pointer to the packet
@@ -459,43 +619,75 @@ struct eth_device *eth_get_byname(const char *name);
  */
 int net_receive(struct eth_device *edev, unsigned char *pkt, int len);
 
+/* Checksums already verified by the hardware */
+#define NET_RX_CSUM_IP		(1 << 0)	/* IPv4 header */
+#define NET_RX_CSUM_L4		(1 << 1)	/* UDP or TCP payload */
+
+/**
+ * net_receive_csum - Pass a received packet along with receive checksum
+ * offload results to the protocol stack
+ * @csum: NET_RX_CSUM_* flags of the checksums the hardware found correct
+ */
+int net_receive_csum(struct eth_device *edev, unsigned char *pkt, int len,
+		unsigned int csum);
+
+#ifdef CONFIG_NET_IP_REASSEMBLY
+unsigned char *net_ip_reassemble(unsigned char *pkt, int *len);
+#else
+static inline unsigned char *net_ip_reassemble(unsigned char *pkt, int *len)
+{
+	return NULL;
+}
+#endif
+
+/* IGMP host side and multicast group membership, net/igmp.c */
+int net_mcast_join(struct eth_device *edev, IPaddr_t group, IPaddr_t source);
+void net_mcast_leave(IPaddr_t group, IPaddr_t source);
+int net_mcast_accept(IPaddr_t group, IPaddr_t source);
+int net_handle_igmp(unsigned char *pkt, int len);
+void igmp_poll(void);
+
 struct net_connection {
 	struct ethernet *et;
 	struct iphdr *ip;
 	struct udphdr *udp;
+	struct tcphdr *tcp;
 	struct eth_device *edev;
 	struct icmphdr *icmp;
 	struct igmpmsg *igmp;
 	unsigned char *packet;
 	struct list_head list;
+	struct hlist_node hash;		/* UDP only, hashed by local port */
 	rx_handler_f *handler;
 	int proto;
-	/*
-	 * Set to the timestamp when to send the membership report. If 0, we're
-	 * in idle state
-	 */
-	uint64_t igmp_report_timeout;
+	IPaddr_t source;		/* multicast source filter, 0 for any */
 	void *priv;
 };
 
+/* Transmit buffers are built by the stack and hold frames of any MTU */
 static inline char *net_alloc_packet(void)
 {
-	return xmemalign(32, PKTSIZE);
+	return xmemalign(32, ETH_FRAME_SIZE(ETH_MAX_MTU));
 }
 
 struct net_connection *net_udp_new(IPaddr_t dest, uint16_t dport,
 		rx_handler_f *handler, void *ctx);
 
+struct net_connection *net_udp_eth_new(struct eth_device *edev, IPaddr_t dest,
+		uint16_t dport, rx_handler_f *handler, void *ctx);
+
+struct net_connection *net_udp_new_ssm(IPaddr_t group, IPaddr_t source,
+		uint16_t dport, rx_handler_f *handler, void *ctx);
+
 struct net_connection *net_icmp_new(IPaddr_t dest, rx_handler_f *handler,
 		void *ctx);
 
+struct net_connection *net_tcp_new(IPaddr_t dest, uint16_t dport,
+		rx_handler_f *handler, void *ctx);
+
 void net_unregister(struct net_connection *con);
 
-static inline int net_udp_bind(struct net_connection *con, int sport)
-{
-	con->udp->uh_sport = htons(sport);
-	return 0;
-}
+int net_udp_bind(struct net_connection *con, int sport);
 
 static inline void *net_udp_get_payload(struct net_connection *con)
 {
@@ -505,6 +697,17 @@ static inline void *net_udp_get_payload(struct net_connection *con)
 
 int net_udp_send(struct net_connection *con, int len);
 int net_icmp_send(struct net_connection *con, int len);
+int net_tcp_send(struct net_connection *con, int len);
+
+/* TCP client sockets, net/tcp.c */
+struct tcp_socket;
+
+struct tcp_socket *tcp_connect(IPaddr_t dest, uint16_t port);
+int tcp_send(struct tcp_socket *sock, const void *buf, int len);
+int tcp_recv(struct tcp_socket *sock, void *buf, int len);
+void tcp_close(struct tcp_socket *sock);
+void tcp_abort(struct tcp_socket *sock);
+int tcp_retransmits(struct tcp_socket *sock);
 
 void led_trigger_network(enum led_trigger trigger);
 
@@ -0,0 +1,29 @@
+#ifndef __PREFETCH_H
+#define __PREFETCH_H
+
+#ifdef CONFIG_PREFETCH
+int prefetch_start(const char *src, const char *dst);
+int prefetch_wait(const char *dst);
+void prefetch_info(void);
+void prefetch_idle(void);
+#else
+static inline int prefetch_start(const char *src, const char *dst)
+{
+	return -ENOSYS;
+}
+
+static inline int prefetch_wait(const char *dst)
+{
+	return 0;
+}
+
+static inline void prefetch_info(void)
+{
+}
+
+static inline void prefetch_idle(void)
+{
+}
+#endif
+
+#endif /* __PREFETCH_H */
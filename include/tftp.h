@@ -0,0 +1,28 @@
+#ifndef __TFTP_H
+#define __TFTP_H
+
+#define TFTP_PORT	69	/* Well known TFTP port number */
+
+/*
+ *	TFTP operations.
+ */
+#define TFTP_RRQ	1
+#define TFTP_WRQ	2
+#define TFTP_DATA	3
+#define TFTP_ACK	4
+#define TFTP_ERROR	5
+#define TFTP_OACK	6
+
+/*
+ *	TFTP error codes.
+ */
+#define TFTP_EUNDEF	0
+#define TFTP_ENOTFOUND	1
+#define TFTP_EACCESS	2
+#define TFTP_EBADOP	4
+#define TFTP_EOPTNEG	8
+
+#define TFTP_BLOCK_SIZE		512	/* default TFTP block size */
+#define TFTP_MAX_WINDOW_SIZE	64
+
+#endif /* __TFTP_H */
@@ -21,6 +21,7 @@
 #include <getopt.h>
 #include <globalvar.h>
 #include <init.h>
+#include <fs.h>
 
 #define DHCP_DEFAULT_RETRY 20
 
@@ -75,12 +76,29 @@ typedef enum {
 
 #define DHCP_MIN_EXT_LEN 64	/* minimal length of extension list	*/
 
-static uint32_t Bootp_id;
-static dhcp_state_t dhcp_state;
+#define DHCP_RAPID_COMMIT	80	/* RFC 4039 */
+
+/* Wait this long for an answer to INIT-REBOOT before falling back to INIT */
+#define DHCP_REBOOT_TIMEOUT	SECOND
+#define DHCP_RESEND_TIMEOUT	(3 * SECOND)
+
+/* DHCP state of a single interface */
+struct dhcp_client {
+	struct eth_device *edev;
+	struct net_connection *con;
+	dhcp_state_t state;
+	uint32_t xid;
+	IPaddr_t server_id;	/* server we got our offer from */
+	IPaddr_t offered_ip;
+	IPaddr_t old_ip;	/* address to restore if we don't get a lease */
+	uint64_t start;
+};
+
+static struct dhcp_client *dhcp_bound;
 static uint32_t dhcp_leasetime;
 static IPaddr_t net_dhcp_server_ip;
-static uint64_t dhcp_start;
 static char dhcp_tftpname[256];
+static int dhcp_rapid_commit = 1;
 
 static const char* dhcp_get_barebox_global(const char * var)
 {
@@ -137,12 +155,20 @@ static void gateway_handle(struct dhcp_opt *opt, unsigned char *popt, int optlen
 	net_set_gateway(ip);
 }
 
-static void env_ip_handle(struct dhcp_opt *opt, unsigned char *popt, int optlen)
+/* Options carrying a list of addresses, like the nameservers */
+static void env_ip_list_handle(struct dhcp_opt *opt, unsigned char *popt,
+		int optlen)
 {
-	IPaddr_t ip;
+	char str[sizeof("xxx.xxx.xxx.xxx ") * 8] = "";
+	int i;
 
-	ip = net_read_ip(popt);
-	setenv_ip(opt->barebox_var_name, ip);
+	for (i = 0; i + 4 <= optlen && i < 8 * 4; i += 4) {
+		if (i)
+			strcat(str, " ");
+		strcat(str, ip_to_string(net_read_ip(popt + i)));
+	}
+
+	setenv(opt->barebox_var_name, str);
 }
 
 static void env_str_handle(struct dhcp_opt *opt, unsigned char *popt, int optlen)
@@ -210,7 +236,7 @@ struct dhcp_opt dhcp_options[] = {
 		.handle = gateway_handle,
 	}, {
 		.option = 6,
-		.handle = env_ip_handle,
+		.handle = env_ip_list_handle,
 		.barebox_var_name = "net.nameserver",
 	}, {
 		.option = 12,
@@ -347,7 +373,8 @@ static int dhcp_set_ip_options(int option, u8 *e, IPaddr_t ip)
 	return 6;
 }
 
-static int bootp_check_packet(unsigned char *pkt, unsigned src, unsigned len)
+static int bootp_check_packet(struct dhcp_client *client, unsigned char *pkt,
+		unsigned src, unsigned len)
 {
 	struct bootp *bp = (struct bootp *) pkt;
 	int retval = 0;
@@ -367,7 +394,7 @@ static int bootp_check_packet(unsigned char *pkt, unsigned src, unsigned len)
 		retval = -4;
 	else if (bp->bp_hlen != HWL_ETHER)
 		retval = -5;
-	else if (net_read_uint32(&bp->bp_id) != Bootp_id) {
+	else if (net_read_uint32(&bp->bp_id) != client->xid) {
 		retval = -6;
 	}
 
@@ -402,7 +429,7 @@ static void bootp_copy_net_params(struct bootp *bp)
  * Initialize BOOTP extension fields in the request.
  */
 static int dhcp_extended (u8 *e, int message_type, IPaddr_t ServerID,
-			  IPaddr_t RequestedIP)
+			  IPaddr_t RequestedIP, int rapid_commit)
 {
 	int i;
 	u8 *start = e;
@@ -426,6 +453,11 @@ static int dhcp_extended (u8 *e, int message_type, IPaddr_t ServerID,
 	e += dhcp_set_ip_options(50, e, RequestedIP);
 	e += dhcp_set_ip_options(54, e, ServerID);
 
+	if (rapid_commit) {
+		*e++ = DHCP_RAPID_COMMIT;
+		*e++ = 0;
+	}
+
 	for (i = 0; i < ARRAY_SIZE(dhcp_params); i++)
 		e += dhcp_params[i].handle(&dhcp_params[i], e);
 
@@ -448,21 +480,8 @@ static int dhcp_extended (u8 *e, int message_type, IPaddr_t ServerID,
 	return e - start;
 }
 
-static struct net_connection *dhcp_con;
-
-static int bootp_request(void)
+static void bootp_fill_request(struct dhcp_client *client, struct bootp *bp)
 {
-	struct bootp *bp;
-	int ext_len;
-	int ret;
-	unsigned char *payload = net_udp_get_payload(dhcp_con);
-	const char *bfile;
-
-	dhcp_state = INIT;
-
-	debug("BOOTP broadcast\n");
-
-	bp = (struct bootp *)payload;
 	bp->bp_op = OP_BOOTREQUEST;
 	bp->bp_htype = HWT_ETHER;
 	bp->bp_hlen = HWL_ETHER;
@@ -471,24 +490,50 @@ static int bootp_request(void)
 	net_write_ip(&bp->bp_ciaddr, 0);
 	net_write_ip(&bp->bp_yiaddr, 0);
 	net_write_ip(&bp->bp_siaddr, 0);
+	/*
+	 * RFC3046 requires Relay Agents to discard packets with
+	 * nonzero and offered giaddr
+	 */
 	net_write_ip(&bp->bp_giaddr, 0);
-	memcpy(bp->bp_chaddr, dhcp_con->et->et_src, 6);
+	memcpy(bp->bp_chaddr, client->con->et->et_src, 6);
+	net_copy_uint32(&bp->bp_id, &client->xid);
+}
+
+/* Mix in the MAC address, so interfaces started at once differ */
+static void dhcp_new_xid(struct dhcp_client *client)
+{
+	unsigned char *mac = client->edev->ethaddr;
+
+	client->xid = (uint32_t)get_time_ns() ^
+		(mac[2] << 24 | mac[3] << 16 | mac[4] << 8 | mac[5]);
+}
+
+static int bootp_request(struct dhcp_client *client)
+{
+	struct bootp *bp;
+	int ext_len;
+	unsigned char *payload = net_udp_get_payload(client->con);
+	const char *bfile;
+
+	debug("BOOTP broadcast\n");
+
+	dhcp_new_xid(client);
+	client->state = SELECTING;
+	client->start = get_time_ns();
+
+	bp = (struct bootp *)payload;
+	memset(bp, 0, sizeof(*bp));
+	bootp_fill_request(client, bp);
 
 	bfile = getenv("bootfile");
 	if (bfile)
 		safe_strncpy (bp->bp_file, bfile, sizeof(bp->bp_file));
 
 	/* Request additional information from the BOOTP/DHCP server */
-	ext_len = dhcp_extended((u8 *)bp->bp_vend, DHCP_DISCOVER, 0, 0);
+	ext_len = dhcp_extended((u8 *)bp->bp_vend, DHCP_DISCOVER, 0, 0,
+			dhcp_rapid_commit);
 
-	Bootp_id = (uint32_t)get_time_ns();
-	net_copy_uint32(&bp->bp_id, &Bootp_id);
-
-	dhcp_state = SELECTING;
-
-	ret = net_udp_send(dhcp_con, sizeof(*bp) + ext_len);
-
-	return ret;
+	return net_udp_send(client->con, sizeof(*bp) + ext_len);
 }
 
 static int dhcp_options_handle(unsigned char option, unsigned char *popt,
@@ -529,62 +574,121 @@ static void dhcp_options_process(unsigned char *popt, struct bootp *bp)
 	}
 }
 
-static int dhcp_message_type(unsigned char *popt)
+/*
+ * Find a DHCP option in the options following the magic cookie. Returns a
+ * pointer to the option length byte or NULL if the option is not present.
+ */
+static unsigned char *dhcp_find_option(struct bootp *bp, int len, int option)
 {
-	if (net_read_uint32((uint32_t *)popt) != htonl(BOOTP_VENDOR_MAGIC))
-		return -1;
+	unsigned char *popt = (unsigned char *)bp->bp_vend;
+	unsigned char *end = (unsigned char *)bp + len;
+
+	if (len < sizeof(*bp) + 4 ||
+			net_read_uint32((uint32_t *)popt) != htonl(BOOTP_VENDOR_MAGIC))
+		return NULL;
 
 	popt += 4;
-	while ( *popt != 0xff ) {
-		if ( *popt == 53 )	/* DHCP Message Type */
-			return *(popt + 2);
+	while (popt + 1 < end && *popt != 0xff) {
+		if (*popt == 0) {
+			popt++;
+			continue;
+		}
+		if (*popt == option)
+			return popt + 1;
 		popt += *(popt + 1) + 2;	/* Scan through all options */
 	}
-	return -1;
+
+	return NULL;
 }
 
-static void dhcp_send_request_packet(struct bootp *bp_offer)
+static int dhcp_message_type(struct bootp *bp, int len)
+{
+	unsigned char *popt = dhcp_find_option(bp, len, 53);
+
+	return popt ? *(popt + 1) : -1;
+}
+
+/*
+ * Send a DHCPREQUEST. In REQUESTING state this selects the offer we got,
+ * in REBOOTING state (RFC 2131, 4.3.2) it asks to keep our previous lease.
+ */
+static int dhcp_send_request_packet(struct dhcp_client *client,
+		IPaddr_t requested_ip)
 {
 	struct bootp *bp;
 	int extlen;
-	IPaddr_t OfferedIP;
-	unsigned char *payload = net_udp_get_payload(dhcp_con);
+	unsigned char *payload = net_udp_get_payload(client->con);
 
 	debug("%s: Sending DHCPREQUEST\n", __func__);
 
 	bp = (struct bootp *)payload;
-	bp->bp_op = OP_BOOTREQUEST;
-	bp->bp_htype = HWT_ETHER;
-	bp->bp_hlen = HWL_ETHER;
-	bp->bp_hops = 0;
-	/* FIXME what is this? */
-//	bp->bp_secs = htons(get_timer(0) / CFG_HZ);
-	net_copy_ip(&bp->bp_ciaddr, &bp_offer->bp_ciaddr); /* both in network byte order */
-	net_copy_ip(&bp->bp_yiaddr, &bp_offer->bp_yiaddr);
-	net_copy_ip(&bp->bp_siaddr, &bp_offer->bp_siaddr);
-	/*
-	 * RFC3046 requires Relay Agents to discard packets with
-	 * nonzero and offered giaddr
-	 */
-	net_write_ip(&bp->bp_giaddr, 0);
+	memset(bp, 0, sizeof(*bp));
+	bootp_fill_request(client, bp);
 
-	memcpy(bp->bp_chaddr, dhcp_con->et->et_src, 6);
+	extlen = dhcp_extended((u8 *)bp->bp_vend, DHCP_REQUEST,
+			client->state == REQUESTING ? client->server_id : 0,
+			requested_ip, 0);
 
-	/*
-	 * ID is the id of the OFFER packet
-	 */
+	debug("Transmitting DHCPREQUEST packet\n");
+	return net_udp_send(client->con, sizeof(*bp) + extlen);
+}
 
-	net_copy_uint32(&bp->bp_id, &bp_offer->bp_id);
+static IPaddr_t dhcp_get_lease(void)
+{
+	const char *lease = dhcp_get_barebox_global("lease");
+	const char *lease_file = dhcp_get_barebox_global("lease_file");
+	IPaddr_t ip = 0;
+	char *buf;
+
+	if ((!lease || !*lease) && lease_file && *lease_file) {
+		buf = read_file(lease_file, NULL);
+		if (buf) {
+			string_to_ip(strim(buf), &ip);
+			free(buf);
+		}
+		return ip;
+	}
 
-	/*
-	 * Copy options from OFFER packet if present
-	 */
-	net_copy_ip(&OfferedIP, &bp->bp_yiaddr);
-	extlen = dhcp_extended((u8 *)bp->bp_vend, DHCP_REQUEST, net_dhcp_server_ip,
-				OfferedIP);
+	if (lease)
+		string_to_ip(lease, &ip);
 
-	debug("Transmitting DHCPREQUEST packet\n");
-	net_udp_send(dhcp_con, sizeof(*bp) + extlen);
+	return ip;
+}
+
+static void dhcp_save_lease(IPaddr_t ip)
+{
+	const char *lease_file = dhcp_get_barebox_global("lease_file");
+	char *str = ip_to_string(ip);
+	const char *old = dhcp_get_barebox_global("lease");
+
+	if (old && !strcmp(old, str))
+		return;
+
+	dhcp_set_barebox_global("lease", str);
+
+	if (lease_file && *lease_file)
+		write_file(lease_file, str, strlen(str));
+}
+
+/*
+ * The first interface getting an ACK wins. Only its parameters are taken
+ * over, it becomes the current interface.
+ */
+static void dhcp_bind(struct dhcp_client *client, struct bootp *bp)
+{
+	eth_set_current(client->edev);
+
+	if (net_read_uint32((uint32_t *)&bp->bp_vend[0]) == htonl(BOOTP_VENDOR_MAGIC))
+		dhcp_options_process((u8 *)&bp->bp_vend[4], bp);
+	bootp_copy_net_params(bp); /* Store net params from reply */
+
+	client->state = BOUND;
+	dhcp_bound = client;
+
+	dhcp_save_lease(net_get_ip());
+
+	printf("DHCP client bound to address %s on %s\n",
+			ip_to_string(net_get_ip()), dev_name(&client->edev->dev));
 }
 
 /*
@@ -592,20 +696,39 @@ static void dhcp_send_request_packet(struct bootp *bp_offer)
  */
 static void dhcp_handler(void *ctx, char *packet, unsigned int len)
 {
+	struct dhcp_client *client = ctx;
 	char *pkt = net_eth_to_udp_payload(packet);
 	struct udphdr *udp = net_eth_to_udphdr(packet);
 	struct bootp *bp = (struct bootp *)pkt;
+	unsigned char *popt;
+	int type;
 
 	len = net_eth_to_udplen(packet);
 
 	debug("DHCPHandler: got packet: (len=%d) state: %d\n",
-		len, dhcp_state);
+		len, client->state);
+
+	if (bootp_check_packet(client, pkt, ntohs(udp->uh_sport), len)) /* Filter out pkts we don't want */
+		return;
 
-	if (bootp_check_packet(pkt, ntohs(udp->uh_sport), len)) /* Filter out pkts we don't want */
+	if (dhcp_bound)
 		return;
 
-	switch (dhcp_state) {
+	type = dhcp_message_type(bp, len);
+
+	switch (client->state) {
 	case SELECTING:
+		/*
+		 * With rapid commit the server may answer our DISCOVER with
+		 * an ACK right away.
+		 */
+		if (type == DHCP_ACK &&
+				dhcp_find_option(bp, len, DHCP_RAPID_COMMIT)) {
+			debug("%s: rapid commit\n", __func__);
+			dhcp_bind(client, bp);
+			break;
+		}
+
 		/*
 		 * Wait an appropriate time for any potential DHCPOFFER packets
 		 * to arrive.  Then select one, and generate DHCPREQUEST response.
@@ -613,29 +736,26 @@ static void dhcp_handler(void *ctx, char *packet, unsigned int len)
 		 * OFFER from a server we want.
 		 */
 		debug ("%s: state SELECTING, bp_file: \"%s\"\n", __func__, bp->bp_file);
-		dhcp_state = REQUESTING;
 
-		if (net_read_uint32((uint32_t *)&bp->bp_vend[0]) == htonl(BOOTP_VENDOR_MAGIC))
-			dhcp_options_process((u8 *)&bp->bp_vend[4], bp);
+		popt = dhcp_find_option(bp, len, 54);
+		client->server_id = popt ? net_read_ip(popt + 1) : 0;
+		client->offered_ip = net_read_ip(&bp->bp_yiaddr);
+		client->state = REQUESTING;
+		client->start = get_time_ns();
 
-		bootp_copy_net_params(bp); /* Store net params from reply */
-
-		dhcp_start = get_time_ns();
-		dhcp_send_request_packet(bp);
+		dhcp_send_request_packet(client, client->offered_ip);
 
 		break;
 	case REQUESTING:
-		debug ("%s: State REQUESTING\n", __func__);
-
-		if (dhcp_message_type((u8 *)bp->bp_vend) == DHCP_ACK ) {
-			if (net_read_uint32((uint32_t *)&bp->bp_vend[0]) == htonl(BOOTP_VENDOR_MAGIC))
-				dhcp_options_process((u8 *)&bp->bp_vend[4], bp);
-			bootp_copy_net_params(bp); /* Store net params from reply */
-			dhcp_state = BOUND;
-			puts ("DHCP client bound to address ");
-			print_IPaddr(net_get_ip());
-			putchar('\n');
-			return;
+	case REBOOTING:
+		debug ("%s: State %s\n", __func__,
+				client->state == REQUESTING ? "REQUESTING" : "REBOOTING");
+
+		if (type == DHCP_ACK) {
+			dhcp_bind(client, bp);
+		} else if (type == DHCP_NAK) {
+			debug("%s: NAK, restarting\n", __func__);
+			bootp_request(client);
 		}
 		break;
 	default:
@@ -677,6 +797,10 @@ static int dhcp_global_init(void)
 	struct dhcp_param *param;
 	int i;
 
+	dhcp_global_add("lease");
+	dhcp_global_add("lease_file");
+	globalvar_add_simple_bool("dhcp.rapid_commit", &dhcp_rapid_commit);
+
 	for (i = 0; i < ARRAY_SIZE(dhcp_options); i++) {
 		opt = &dhcp_options[i];
 
@@ -699,16 +823,55 @@ static int dhcp_global_init(void)
 }
 late_initcall(dhcp_global_init);
 
+static int dhcp_client_start(struct dhcp_client *client, IPaddr_t lease)
+{
+	struct eth_device *edev = client->edev;
+	int ret;
+
+	client->old_ip = edev->ipaddr;
+
+	client->con = net_udp_eth_new(edev, 0xffffffff, PORT_BOOTPS,
+			dhcp_handler, client);
+	if (IS_ERR(client->con)) {
+		ret = PTR_ERR(client->con);
+		client->con = NULL;
+		return ret;
+	}
+
+	ret = net_udp_bind(client->con, PORT_BOOTPC);
+	if (ret) {
+		net_unregister(client->con);
+		client->con = NULL;
+		return ret;
+	}
+
+	edev->ipaddr = 0;
+
+	if (!lease)
+		return bootp_request(client);
+
+	/* Try to get our previous address back with a single round trip */
+	dhcp_new_xid(client);
+	client->state = REBOOTING;
+	client->start = get_time_ns();
+
+	return dhcp_send_request_packet(client, lease);
+}
+
 static int do_dhcp(int argc, char *argv[])
 {
-	int ret, opt;
+	int ret, opt, i;
 	int retries = DHCP_DEFAULT_RETRY;
+	int all = 0, nclients = 0, resend;
+	struct dhcp_client *clients, *client;
+	struct eth_device *edev;
+	IPaddr_t lease;
 
 	dhcp_reset_env();
 
 	getenv_uint("global.dhcp.retries", &retries);
 
-	while((opt = getopt(argc, argv, "H:v:c:u:U:r:")) > 0) {
+	while((opt = getopt(argc, argv, "H:v:c:u:U:r:a")) > 0) {
 		switch(opt) {
 		case 'H':
 			dhcp_set_param_data(DHCP_HOSTNAME, optarg);
@@ -728,6 +891,9 @@ static int do_dhcp(int argc, char *argv[])
 		case 'r':
 			retries = simple_strtoul(optarg, NULL, 10);
 			break;
+		case 'a':
+			all = 1;
+			break;
 		}
 	}
 
@@ -736,24 +902,37 @@ static int do_dhcp(int argc, char *argv[])
 		retries = DHCP_DEFAULT_RETRY;
 	}
 
-	dhcp_con = net_udp_new(0xffffffff, PORT_BOOTPS, dhcp_handler, NULL);
-	if (IS_ERR(dhcp_con)) {
-		ret = PTR_ERR(dhcp_con);
+	if (!eth_get_current()) {
+		ret = -ENETDOWN;
 		goto out;
 	}
 
-	ret = net_udp_bind(dhcp_con, PORT_BOOTPC);
-	if (ret)
-		goto out1;
+	if (all)
+		for_each_netdev(edev)
+			nclients++;
+	else
+		nclients = 1;
 
-	net_set_ip(0);
+	clients = xzalloc(nclients * sizeof(*clients));
 
-	dhcp_start = get_time_ns();
-	ret = bootp_request(); /* Basically same as BOOTP */
-	if (ret)
-		goto out1;
+	if (all) {
+		i = 0;
+		for_each_netdev(edev)
+			clients[i++].edev = edev;
+	} else {
+		clients[0].edev = eth_get_current();
+	}
+
+	dhcp_bound = NULL;
+	lease = dhcp_get_lease();
+
+	for (i = 0; i < nclients; i++) {
+		ret = dhcp_client_start(&clients[i], lease);
+		if (ret && !all)
+			goto out1;
+	}
 
-	while (dhcp_state != BOUND) {
+	while (!dhcp_bound) {
 		if (ctrlc()) {
 			ret = -EINTR;
 			goto out1;
@@ -763,17 +942,35 @@ static int do_dhcp(int argc, char *argv[])
 			goto out1;
 		}
 		net_poll();
-		if (is_timeout(dhcp_start, 3 * SECOND)) {
-			dhcp_start = get_time_ns();
+
+		resend = 0;
+
+		for (i = 0; i < nclients && !dhcp_bound; i++) {
+			client = &clients[i];
+			if (!client->con)
+				continue;
+
+			if (client->state == REBOOTING) {
+				if (is_timeout(client->start, DHCP_REBOOT_TIMEOUT))
+					bootp_request(client);
+				continue;
+			}
+
+			if (is_timeout(client->start, DHCP_RESEND_TIMEOUT)) {
+				bootp_request(client);
+				resend = 1;
+			}
+		}
+
+		if (resend) {
 			printf("T ");
-			ret = bootp_request();
 			/* no need to check if retries > 0 as we check if != 0 */
 			retries--;
-			if (ret)
-				goto out1;
 		}
 	}
 
+	ret = 0;
+
 	if (dhcp_tftpname[0] != 0) {
 		IPaddr_t tftpserver = resolv(dhcp_tftpname);
 		if (tftpserver)
@@ -781,7 +978,19 @@ static int do_dhcp(int argc, char *argv[])
 	}
 
 out1:
-	net_unregister(dhcp_con);
+	for (i = 0; i < nclients; i++) {
+		client = &clients[i];
+		if (!client->con)
+			continue;
+
+		net_unregister(client->con);
+
+		/* give the losers their previous (maybe static) address back */
+		if (client != dhcp_bound)
+			client->edev->ipaddr = client->old_ip;
+	}
+	free(clients);
+	dhcp_bound = NULL;
 out:
 	if (ret)
 		printf("dhcp failed: %s\n", strerror(-ret));
@@ -796,13 +1005,14 @@ BAREBOX_CMD_HELP_OPT ("-v ID\t", "DHCP Vendor ID (code 60) submitted in DHCP req
 BAREBOX_CMD_HELP_OPT ("-c ID\t", "DHCP Client ID (code 61) submitted in DHCP requests")
 BAREBOX_CMD_HELP_OPT ("-u UUID\t", "DHCP Client UUID (code 97) submitted in DHCP requests")
 BAREBOX_CMD_HELP_OPT ("-U CLASS", "DHCP User class (code 77) submitted in DHCP requests")
-BAREBOX_CMD_HELP_OPT ("-r RETRY", "retry limit (default 20)");
+BAREBOX_CMD_HELP_OPT ("-r RETRY", "retry limit (default 20)")
+BAREBOX_CMD_HELP_OPT ("-a\t", "run on all interfaces at once, the first lease wins")
 BAREBOX_CMD_HELP_END
 
 BAREBOX_CMD_START(dhcp)
 	.cmd		= do_dhcp,
 	BAREBOX_CMD_DESC("DHCP client to obtain IP or boot params")
-	BAREBOX_CMD_OPTS("[-HvcuUr]")
+	BAREBOX_CMD_OPTS("[-HvcuUra]")
 	BAREBOX_CMD_GROUP(CMD_GRP_NET)
 	BAREBOX_CMD_HELP(cmd_dhcp_help)
 	BAREBOX_CMD_COMPLETE(empty_complete)
@@ -817,3 +1027,6 @@ BAREBOX_MAGICVAR_NAMED(global_dhcp_user_class, global.dhcp.user_class, "user cla
 BAREBOX_MAGICVAR_NAMED(global_dhcp_tftp_server_name, global.dhcp.tftp_server_name, "TFTP server Name returned from DHCP request");
 BAREBOX_MAGICVAR_NAMED(global_dhcp_oftree_file, global.dhcp.oftree_file, "OF tree returned from DHCP request (option 224)");
 BAREBOX_MAGICVAR_NAMED(global_dhcp_retries, global.dhcp.retries, "retry limit");
+BAREBOX_MAGICVAR_NAMED(global_dhcp_rapid_commit, global.dhcp.rapid_commit, "ask for rapid commit (RFC 4039) to skip the DHCPREQUEST");
+BAREBOX_MAGICVAR_NAMED(global_dhcp_lease, global.dhcp.lease, "address of the last lease, requested again with INIT-REBOOT");
+BAREBOX_MAGICVAR_NAMED(global_dhcp_lease_file, global.dhcp.lease_file, "file to load and save global.dhcp.lease, e.g. /env/network/dhcp-lease");
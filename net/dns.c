@@ -28,9 +28,19 @@
 #include <clock.h>
 #include <environment.h>
 #include <linux/err.h>
+#include <errno.h>
+#include <malloc.h>
 
 #define DNS_PORT 53
 
+/* Nameservers queried at once, the first answer wins */
+#define DNS_MAX_SERVERS		3
+#define DNS_CACHE_SIZE		16
+#define DNS_MAX_NAME		256
+#define DNS_RESEND_TIMEOUT	SECOND
+#define DNS_RETRIES		3
+#define DNS_NEGATIVE_TTL	10	/* seconds */
+
 /* http://en.wikipedia.org/wiki/List_of_DNS_record_types */
 enum dns_query_type {
 	DNS_A_RECORD = 0x01,
@@ -38,6 +48,10 @@ enum dns_query_type {
 	DNS_MX_RECORD = 0x0f,
 };
 
+#define DNS_FLAG_RESPONSE	0x8000
+#define DNS_RCODE_MASK		0x000f
+#define DNS_RCODE_NXDOMAIN	3
+
 /*
  * DNS network packet
  */
@@ -54,35 +68,93 @@ struct header {
 #define STATE_INIT	0
 #define STATE_DONE	1
 
-static struct net_connection *dns_con;
+struct dns_cache_entry {
+	char *name;
+	IPaddr_t ip;
+	uint64_t stamp;
+	uint64_t ttl;
+};
+
+static struct dns_cache_entry dns_cache[DNS_CACHE_SIZE];
+
+static struct net_connection *dns_con[DNS_MAX_SERVERS];
+static int dns_failed[DNS_MAX_SERVERS];	/* server answered with an error */
+static int dns_num_servers;
 static uint64_t dns_timer_start;
 static int dns_state;
+static uint16_t dns_tid;
 static IPaddr_t dns_ip;
+static uint32_t dns_ttl;
+static int dns_final;		/* the answer may be cached, even if negative */
+
+static struct dns_cache_entry *dns_cache_lookup(const char *name)
+{
+	struct dns_cache_entry *e;
+	int i;
+
+	for (i = 0; i < DNS_CACHE_SIZE; i++) {
+		e = &dns_cache[i];
+
+		if (!e->name || strcmp(e->name, name))
+			continue;
+
+		if (is_timeout(e->stamp, e->ttl)) {
+			free(e->name);
+			e->name = NULL;
+			return NULL;
+		}
+
+		return e;
+	}
+
+	return NULL;
+}
+
+static void dns_cache_add(const char *name, IPaddr_t ip, uint32_t ttl)
+{
+	struct dns_cache_entry *e, *oldest = NULL;
+	int i;
+
+	if (!ttl)
+		return;
+
+	for (i = 0; i < DNS_CACHE_SIZE; i++) {
+		e = &dns_cache[i];
+
+		if (!e->name || !strcmp(e->name, name)) {
+			oldest = e;
+			break;
+		}
+
+		if (!oldest || e->stamp < oldest->stamp)
+			oldest = e;
+	}
 
-static int dns_send(char *name)
+	free(oldest->name);
+	oldest->name = xstrdup(name);
+	oldest->ip = ip;
+	oldest->stamp = get_time_ns();
+	oldest->ttl = (uint64_t)ttl * SECOND;
+}
+
+static int dns_send(const char *name)
 {
-	int ret;
+	int ret = -ENETDOWN, i, len;
 	struct header *header;
 	enum dns_query_type qtype = DNS_A_RECORD;
-	unsigned char *packet = net_udp_get_payload(dns_con);
+	unsigned char packet[sizeof(struct header) + DNS_MAX_NAME + 8];
 	unsigned char *p, *s, *fullname, *dotptr;
-	const unsigned char *domain;
 
 	/* Prepare DNS packet header */
 	header           = (struct header *)packet;
-	header->tid      = 1;
+	header->tid      = dns_tid;
 	header->flags    = htons(0x100);	/* standard query */
 	header->nqueries = htons(1);		/* Just one query */
 	header->nanswers = 0;
 	header->nauth    = 0;
 	header->nother   = 0;
 
-	domain = getenv("net.domainname");
-
-	if (!strchr(name, '.') && domain && *domain)
-		fullname = asprintf(".%s.%s.", name, domain);
-	else
-		fullname = asprintf(".%s.", name);
+	fullname = asprintf(".%s.", name);
 
 	/* replace dots in fullname with chunk len */
 	dotptr = fullname;
@@ -109,136 +181,292 @@ static int dns_send(char *name)
 	*p++ = 0;
 	*p++ = 1;				/* Class: inet, 0x0001 */
 
-	ret = net_udp_send(dns_con, p - packet);
+	len = p - packet;
+
+	for (i = 0; i < dns_num_servers; i++) {
+		if (dns_failed[i])
+			continue;
+		memcpy(net_udp_get_payload(dns_con[i]), packet, len);
+		if (!net_udp_send(dns_con[i], len))
+			ret = 0;
+	}
 
 	free(fullname);
 
 	return ret;
 }
 
+/*
+ * Skip a possibly compressed domain name. Returns a pointer to the data
+ * following the name or NULL if the name exceeds the packet.
+ */
+static unsigned char *dns_skip_name(unsigned char *p, unsigned char *e)
+{
+	while (p < e) {
+		if (!*p)
+			return p + 1;
+		if ((*p & 0xc0) == 0xc0)
+			return p + 2 <= e ? p + 2 : NULL;
+		p += *p + 1;
+	}
+
+	return NULL;
+}
+
+static int dns_all_failed(void)
+{
+	int i;
+
+	for (i = 0; i < dns_num_servers; i++)
+		if (!dns_failed[i])
+			return 0;
+
+	return 1;
+}
+
 static void dns_handler(void *ctx, char *packet, unsigned len)
 {
+	int *failed = ctx;
 	struct header *header;
-	unsigned char *p, *e, *s;
-	u16 type;
-	int found, stop, dlen;
-	short tmp;
+	unsigned char *p, *e;
+	uint16_t type, flags, rcode;
+	int i, dlen;
 
 	debug("%s\n", __func__);
 
-	/* We sent 1 query. We want to see more that 1 answer. */
 	header = (struct header *)net_eth_to_udp_payload(packet);
-	if (ntohs(header->nqueries) != 1)
+	e = (unsigned char *)header + net_eth_to_udplen(packet);
+
+	if (dns_state == STATE_DONE || header->tid != dns_tid)
 		return;
 
-	/* Received 0 answers */
-	if (header->nanswers == 0) {
-		dns_state = STATE_DONE;
-		debug("DNS server returned no answers\n");
+	flags = ntohs(header->flags);
+	if (!(flags & DNS_FLAG_RESPONSE) || ntohs(header->nqueries) != 1)
 		return;
-	}
 
-	/* Skip host name */
-	s = &header->data[0];
-	e = packet + len;
-	for (p = s; p < e && *p != '\0'; p++)
-		continue;
+	/*
+	 * A server failing (SERVFAIL, REFUSED, ...) says nothing about the
+	 * name, keep waiting for the others.
+	 */
+	rcode = flags & DNS_RCODE_MASK;
+	if (rcode && rcode != DNS_RCODE_NXDOMAIN) {
+		debug("DNS server failed with rcode %d\n", rcode);
+		*failed = 1;
+		if (dns_all_failed())
+			dns_state = STATE_DONE;
+		return;
+	}
 
-	/* We sent query class 1, query type 1 */
-	tmp = p[1] | (p[2] << 8);
-	if (&p[5] > e || ntohs(tmp) != DNS_A_RECORD) {
-		debug("DNS response was not A record\n");
+	/* The name does not exist or has no address */
+	if (rcode || header->nanswers == 0) {
+		debug("DNS server returned no answers (rcode %d)\n", rcode);
+		dns_final = 1;
+		dns_state = STATE_DONE;
 		return;
 	}
 
-	/* Go to the first answer section */
-	p += 5;
+	/* Skip the question */
+	p = dns_skip_name(header->data, e);
+	if (!p || p + 4 > e)
+		return;
+	p += 4;
 
 	/* Loop through the answers, we want A type answer */
-	for (found = stop = 0; !stop && &p[12] < e; ) {
-
-		/* Skip possible name in CNAME answer */
-		if (*p != 0xc0) {
-			while (*p && &p[12] < e)
-				p++;
-			p--;
-		}
-		debug("Name (Offset in header): %d\n", p[1]);
-
-		tmp = p[2] | (p[3] << 8);
-		type = ntohs(tmp);
-		debug("type = %d\n", type);
-		if (type == DNS_CNAME_RECORD) {
-			/* CNAME answer. shift to the next section */
-			debug("Found canonical name\n");
-			tmp = p[10] | (p[11] << 8);
-			dlen = ntohs(tmp);
-			debug("dlen = %d\n", dlen);
-			p += 12 + dlen;
-		} else if (type == DNS_A_RECORD) {
+	for (i = 0; i < ntohs(header->nanswers); i++) {
+		p = dns_skip_name(p, e);
+		if (!p || p + 10 > e)
+			return;
+
+		type = p[0] << 8 | p[1];
+		dlen = p[8] << 8 | p[9];
+		debug("type = %d, dlen = %d\n", type, dlen);
+
+		if (p + 10 + dlen > e)
+			return;
+
+		/*
+		 * CNAME answers are followed by the records of the
+		 * canonical name, just skip them.
+		 */
+		if (type == DNS_A_RECORD && dlen == 4) {
 			debug("Found A-record\n");
-			found = stop = 1;
-		} else {
-			debug("Unknown type\n");
-			stop = 1;
+			dns_ttl = p[4] << 24 | p[5] << 16 | p[6] << 8 | p[7];
+			dns_ip = net_read_ip(p + 10);
+			dns_final = 1;
+			dns_state = STATE_DONE;
+			return;
 		}
+
+		p += 10 + dlen;
 	}
 
-	if (found && &p[12] < e) {
+	/* no A record among the answers */
+	dns_final = 1;
+	dns_state = STATE_DONE;
+}
 
-		tmp = p[10] | (p[11] << 8);
-		dlen = ntohs(tmp);
-		p += 12;
-		dns_ip = net_read_ip(p);
-		dns_state = STATE_DONE;
+static int dns_open_servers(void);
+
+/*
+ * Look up a single fully qualified name, asking all nameservers at once.
+ * Returns 0 if the name does not exist or we got no answer.
+ */
+static IPaddr_t dns_query(const char *name)
+{
+	struct dns_cache_entry *e;
+	int retries = DNS_RETRIES;
+
+	if (strlen(name) >= DNS_MAX_NAME - 2)
+		return 0;
+
+	e = dns_cache_lookup(name);
+	if (e) {
+		debug("%s: %s is cached\n", __func__, name);
+		return e->ip;
 	}
+
+	if (dns_open_servers())
+		return 0;
+
+	debug("%s: %s\n", __func__, name);
+
+	dns_ip = 0;
+	dns_ttl = 0;
+	dns_final = 0;
+	dns_state = STATE_INIT;
+	dns_tid = random32();
+	memset(dns_failed, 0, sizeof(dns_failed));
+
+	if (dns_send(name))
+		return 0;
+
+	dns_timer_start = get_time_ns();
+
+	while (dns_state != STATE_DONE) {
+		if (ctrlc())
+			return 0;
+
+		net_poll();
+
+		if (is_timeout(dns_timer_start, DNS_RESEND_TIMEOUT)) {
+			if (!--retries)
+				return 0;
+			dns_timer_start = get_time_ns();
+			printf("T ");
+			dns_send(name);
+		}
+	}
+
+	/*
+	 * Remember names that do not exist, so search domains stay cheap.
+	 * Failures of all servers are not cached.
+	 */
+	if (dns_final)
+		dns_cache_add(name, dns_ip, dns_ip ? dns_ttl : DNS_NEGATIVE_TTL);
+
+	return dns_ip;
 }
 
-IPaddr_t resolv(char *host)
+/*
+ * Try the name with the search domains from $net.search and
+ * $net.domainname. Names containing a dot are tried as they are first.
+ */
+static IPaddr_t dns_resolv(char *host)
 {
+	const char *search = getenv("net.search");
+	const char *domain = getenv("net.domainname");
+	char *list, *cur, *tok, *name;
+	int dotted = strchr(host, '.') != NULL;
 	IPaddr_t ip;
-	const char *ns;
 
-	if (!string_to_ip(host, &ip))
-		return ip;
+	if (dotted) {
+		ip = dns_query(host);
+		if (ip)
+			return ip;
+	}
 
-	dns_ip = 0;
+	list = asprintf("%s %s", search ? search : "", domain ? domain : "");
+	cur = list;
 
-	dns_state = STATE_INIT;
+	while ((tok = strsep(&cur, " ,"))) {
+		if (!*tok)
+			continue;
+
+		name = asprintf("%s.%s", host, tok);
+		ip = dns_query(name);
+		free(name);
+
+		if (ip) {
+			free(list);
+			return ip;
+		}
+	}
+
+	free(list);
+
+	if (!dotted)
+		return dns_query(host);
+
+	return 0;
+}
+
+/*
+ * Open a connection to each nameserver in $net.nameserver. Done only when
+ * we actually have to ask, cached names need no network at all.
+ */
+static int dns_open_servers(void)
+{
+	const char *ns;
+	char *list, *cur, *tok;
+	IPaddr_t ip;
+
+	if (dns_num_servers)
+		return 0;
 
 	ns = getenv("net.nameserver");
 	if (!ns || !*ns) {
 		printk("%s: no nameserver specified in $net.nameserver\n",
 				__func__);
-		return 0;
+		return -EINVAL;
 	}
 
-	if (string_to_ip(ns, &ip))
-		return 0;
+	list = xstrdup(ns);
+	cur = list;
 
-	debug("resolving host %s via nameserver %s\n", host, ip_to_string(ip));
+	while ((tok = strsep(&cur, " ,")) && dns_num_servers < DNS_MAX_SERVERS) {
+		if (!*tok || string_to_ip(tok, &ip))
+			continue;
 
-	dns_con = net_udp_new(ip, DNS_PORT, dns_handler, NULL);
-	if (IS_ERR(dns_con))
-		return PTR_ERR(dns_con);
-	dns_timer_start = get_time_ns();
-	dns_send(host);
+		debug("using nameserver %s\n", ip_to_string(ip));
 
-	while (dns_state != STATE_DONE) {
-		if (ctrlc()) {
-			break;
-		}
-		net_poll();
-		if (is_timeout(dns_timer_start, SECOND)) {
-			dns_timer_start = get_time_ns();
-			printf("T ");
-			dns_send(host);
-		}
+		dns_con[dns_num_servers] = net_udp_new(ip, DNS_PORT,
+				dns_handler, &dns_failed[dns_num_servers]);
+		if (IS_ERR(dns_con[dns_num_servers]))
+			continue;
+
+		dns_num_servers++;
 	}
 
-	net_unregister(dns_con);
+	free(list);
 
-	return dns_ip;
+	return dns_num_servers ? 0 : -ENETUNREACH;
+}
+
+IPaddr_t resolv(char *host)
+{
+	IPaddr_t ip;
+	int i;
+
+	if (!string_to_ip(host, &ip))
+		return ip;
+
+	ip = dns_resolv(host);
+
+	for (i = 0; i < dns_num_servers; i++)
+		net_unregister(dns_con[i]);
+	dns_num_servers = 0;
+
+	return ip;
 }
 
 #ifdef CONFIG_CMD_HOST
@@ -28,10 +28,13 @@
 #include <errno.h>
 #include <malloc.h>
 
+/* Maximum number of frames a driver passes up in a single poll */
+#define ETH_RX_BUDGET	64
+
 static struct eth_device *eth_current;
 static uint64_t last_link_check;
 
-static LIST_HEAD(netdev_list);
+LIST_HEAD(netdev_list);
 
 struct eth_ethaddr {
 	struct list_head list;
@@ -208,7 +211,7 @@ static int eth_check_open(struct eth_device *edev)
 	if (edev->active)
 		return 0;
 
-	ret = edev->open(eth_current);
+	ret = edev->open(edev);
 	if (ret)
 		return ret;
 
@@ -217,21 +220,96 @@ static int eth_check_open(struct eth_device *edev)
 	return eth_carrier_check(edev, 1);
 }
 
+/*
+ * Open a device for receiving. Devices are otherwise opened when the first
+ * packet is sent.
+ */
+int eth_open(struct eth_device *edev)
+{
+	return eth_check_open(edev);
+}
+
+static int eth_depth;
+
+const char *eth_drop_names[ETH_DROP_NUM] = {
+	[ETH_DROP_BAD] = "bad",
+	[ETH_DROP_CSUM] = "csum",
+	[ETH_DROP_PROTO] = "proto",
+	[ETH_DROP_ADDR] = "addr",
+	[ETH_DROP_MCAST] = "mcast",
+	[ETH_DROP_NOPORT] = "noport",
+	[ETH_DROP_OVERRUN] = "overrun",
+};
+
 int eth_send(struct eth_device *edev, void *packet, int length)
 {
 	int ret;
 
 	ret = eth_check_open(edev);
 	if (ret)
-		return ret;
+		goto err;
 
 	ret = eth_carrier_check(edev, 0);
-	if (ret)
-		return ret;
+	if (ret) {
+		edev->tx_carrier_errors++;
+		goto err;
+	}
+
+	if (length > ETHER_HDR_SIZE + edev->mtu) {
+		ret = -EMSGSIZE;
+		goto err;
+	}
 
 	led_trigger_network(LED_TRIGGER_NET_TX);
 
-	return edev->send(eth_current, packet, length);
+	eth_depth++;
+
+	ret = edev->send(edev, packet, length);
+	if (!ret && edev->tx_reap) {
+		int pending = edev->tx_reap(edev);
+
+		if (pending > edev->tx_ring_max)
+			edev->tx_ring_max = pending;
+	}
+
+	eth_depth--;
+
+	if (ret)
+		goto err;
+
+	edev->tx_packets++;
+	edev->tx_bytes += length;
+
+	return 0;
+err:
+	edev->tx_errors++;
+
+	return ret;
+}
+
+/**
+ * eth_tx_flush - wait until the hardware sent all queued packets
+ * @edev: the ethernet device
+ *
+ * Only needed for drivers with an asynchronous transmit ring, e.g. before
+ * halting the device. Return 0 on success, -ETIMEDOUT otherwise.
+ */
+int eth_tx_flush(struct eth_device *edev)
+{
+	uint64_t start;
+
+	if (!edev->tx_reap || !edev->active)
+		return 0;
+
+	start = get_time_ns();
+	while (edev->tx_reap(edev)) {
+		if (is_timeout(start, SECOND)) {
+			dev_err(&edev->dev, "transmit queue stuck\n");
+			return -ETIMEDOUT;
+		}
+	}
+
+	return 0;
 }
 
 static int __eth_rx(struct eth_device *edev)
@@ -246,21 +324,46 @@ static int __eth_rx(struct eth_device *edev)
 	if (ret)
 		return ret;
 
-	return edev->recv(eth_current);
+	/* Reclaim the transmit descriptors of packets sent meanwhile */
+	if (edev->tx_reap)
+		edev->tx_reap(edev);
+
+	if (!edev->recv_batch)
+		return edev->recv(edev);
+
+	ret = edev->recv_batch(edev, ETH_RX_BUDGET);
+	if (ret > edev->rx_ring_max)
+		edev->rx_ring_max = ret;
+
+	return ret;
 }
 
 int eth_rx(void)
 {
 	struct eth_device *edev;
 
+	eth_depth++;
+
 	list_for_each_entry(edev, &netdev_list, list) {
 		if (edev->active)
 			__eth_rx(edev);
 	}
 
+	eth_depth--;
+
 	return 0;
 }
 
+/*
+ * Returns true while a driver is sending or receiving. Pollers that use the
+ * network stack must not run then, they may have been called from a busy
+ * loop inside the driver.
+ */
+int eth_busy(void)
+{
+	return eth_depth != 0;
+}
+
 static int eth_set_ethaddr(struct param_d *param, void *priv)
 {
 	struct eth_device *edev = priv;
@@ -270,6 +373,20 @@ static int eth_set_ethaddr(struct param_d *param, void *priv)
 	return 0;
 }
 
+static int eth_set_mtu(struct param_d *param, void *priv)
+{
+	struct eth_device *edev = priv;
+
+	/*
+	 * 68 is the smallest MTU an IPv4 host has to support. Drivers set up
+	 * the hardware for max_mtu, so nothing has to be reconfigured here.
+	 */
+	if (edev->mtu < 68 || edev->mtu > edev->max_mtu)
+		return -EINVAL;
+
+	return 0;
+}
+
 #ifdef CONFIG_OFTREE
 static int eth_of_fixup(struct device_node *root, void *unused)
 {
@@ -322,7 +439,7 @@ int eth_register(struct eth_device *edev)
 {
 	struct device_d *dev = &edev->dev;
 	unsigned char ethaddr[6];
-	int ret, found = 0;
+	int ret, i, found = 0;
 
 	if (!edev->get_ethaddr) {
 		dev_err(dev, "no get_mac_address found for current eth device\n");
@@ -331,6 +448,12 @@ int eth_register(struct eth_device *edev)
 
 	strcpy(edev->dev.name, "eth");
 
+	if (!edev->max_mtu)
+		edev->max_mtu = ETH_DATA_LEN;
+	edev->max_mtu = min(edev->max_mtu, ETH_MAX_MTU);
+	edev->mtu = ETH_DATA_LEN;
+	memset(edev->arp_cache, 0, sizeof(edev->arp_cache));
+
 	if (edev->parent)
 		edev->dev.parent = edev->parent;
 
@@ -351,6 +474,34 @@ int eth_register(struct eth_device *edev)
 	dev_add_param_ip(dev, "gateway", NULL, NULL, &edev->gateway, edev);
 	dev_add_param_ip(dev, "netmask", NULL, NULL, &edev->netmask, edev);
 	dev_add_param_mac(dev, "ethaddr", eth_set_ethaddr, NULL, edev->ethaddr, edev);
+	dev_add_param_int(dev, "rx_packets", NULL, NULL, &edev->rx_packets,
+			"%u", edev);
+	dev_add_param_int(dev, "rx_bytes", NULL, NULL, &edev->rx_bytes,
+			"%u", edev);
+	dev_add_param_int(dev, "rx_errors", NULL, NULL, &edev->rx_errors,
+			"%u", edev);
+	dev_add_param_int(dev, "rx_dropped", NULL, NULL, &edev->rx_dropped,
+			"%u", edev);
+	for (i = 0; i < ETH_DROP_NUM; i++) {
+		char *name = asprintf("rx_drop_%s", eth_drop_names[i]);
+
+		dev_add_param_int(dev, name, NULL, NULL, &edev->rx_drop[i],
+				"%u", edev);
+		free(name);
+	}
+	dev_add_param_int(dev, "rx_ring_max", NULL, NULL, &edev->rx_ring_max,
+			"%u", edev);
+	dev_add_param_int(dev, "tx_packets", NULL, NULL, &edev->tx_packets,
+			"%u", edev);
+	dev_add_param_int(dev, "tx_bytes", NULL, NULL, &edev->tx_bytes,
+			"%u", edev);
+	dev_add_param_int(dev, "tx_errors", NULL, NULL, &edev->tx_errors,
+			"%u", edev);
+	dev_add_param_int(dev, "tx_carrier_errors", NULL, NULL,
+			&edev->tx_carrier_errors, "%u", edev);
+	dev_add_param_int(dev, "tx_ring_max", NULL, NULL, &edev->tx_ring_max,
+			"%u", edev);
+	dev_add_param_int(dev, "mtu", eth_set_mtu, NULL, &edev->mtu, "%d", edev);
 
 	if (edev->init)
 		edev->init(edev);
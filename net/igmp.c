@@ -0,0 +1,479 @@
+/*
+ * igmp.c - IGMP host side and multicast group table
+ *
+ * Implements host membership reporting for IGMPv1 (RFC 1112), IGMPv2
+ * (RFC 2236) and IGMPv3 (RFC 3376) including INCLUDE mode source filters
+ * for source-specific multicast.
+ *
+ * See file CREDITS for list of people who contributed to this
+ * project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+#include <common.h>
+#include <clock.h>
+#include <net.h>
+#include <errno.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <asm-generic/div64.h>
+
+#define IGMP_ALL_ROUTERS_ADDR		0xe0000002
+#define IGMPV3_ALL_ROUTERS_ADDR		0xe0000016
+
+/* IGMPv3 group record types */
+#define IGMPV3_MODE_IS_INCLUDE		1
+#define IGMPV3_MODE_IS_EXCLUDE		2
+#define IGMPV3_CHANGE_TO_INCLUDE	3
+#define IGMPV3_CHANGE_TO_EXCLUDE	4
+
+#define IGMP_MAX_SOURCES		8
+#define IGMP_ROBUSTNESS			2
+#define IGMP_UNSOLICITED_INTERVAL	(1 * SECOND)
+#define IGMP_V1_MAX_RESPONSE		(10 * SECOND)
+#define IGMP_OLDER_QUERIER_TIMEOUT	(260 * SECOND)
+
+#define NET_MCAST_HASH_SIZE		16
+
+struct net_mcast_group {
+	struct hlist_node hash;
+	struct eth_device *edev;
+	IPaddr_t addr;
+	int asm_users;		/* connections accepting any source */
+	int nsources;		/* INCLUDE mode source filter */
+	IPaddr_t sources[IGMP_MAX_SOURCES];
+	int source_users[IGMP_MAX_SOURCES];
+	uint64_t report_time;	/* when to send the next report, 0 if none */
+	int change_reports;	/* state change reports left to send */
+};
+
+struct igmpv3_report {
+	uint8_t		type;
+	uint8_t		reserved1;
+	uint16_t	checksum;
+	uint16_t	reserved2;
+	uint16_t	ngrec;
+	/* group record */
+	uint8_t		grec_type;
+	uint8_t		grec_auxwords;
+	uint16_t	grec_nsrcs;
+	uint32_t	grec_mca;
+	uint32_t	grec_src[IGMP_MAX_SOURCES];
+} __attribute__ ((packed));
+
+static struct hlist_head net_mcast_hash[NET_MCAST_HASH_SIZE];
+
+/* Compatibility mode, lowered when an older querier is present */
+static int igmp_version = 3;
+static uint64_t igmp_older_querier;
+static uint16_t igmp_ip_id;
+
+static struct hlist_head *net_mcast_bucket(IPaddr_t addr)
+{
+	return &net_mcast_hash[ntohl(addr) & (NET_MCAST_HASH_SIZE - 1)];
+}
+
+static struct net_mcast_group *net_mcast_find(IPaddr_t addr)
+{
+	struct net_mcast_group *group;
+	struct hlist_node *n;
+
+	hlist_for_each_entry(group, n, net_mcast_bucket(addr), hash) {
+		if (group->addr == addr)
+			return group;
+	}
+
+	return NULL;
+}
+
+static int igmp_get_version(void)
+{
+	if (igmp_version < 3 &&
+			is_timeout(igmp_older_querier, IGMP_OLDER_QUERIER_TIMEOUT))
+		igmp_version = 3;
+
+	return igmp_version;
+}
+
+/*
+ * Send an IGMP message to @dst. IGMPv2 and v3 messages carry the router
+ * alert option (RFC 2113).
+ */
+static int igmp_xmit(struct eth_device *edev, IPaddr_t dst, void *msg,
+		int msglen, int router_alert)
+{
+	static unsigned char *igmp_packet;
+	struct ethernet *et;
+	struct iphdr *ip;
+	int hlen = sizeof(struct iphdr) + (router_alert ? 4 : 0);
+	unsigned char *opt;
+
+	if (!igmp_packet) {
+		igmp_packet = net_alloc_packet();
+		if (!igmp_packet)
+			return -ENOMEM;
+	}
+
+	et = (struct ethernet *)igmp_packet;
+	multicast_ether_addr(et->et_dest, dst);
+	memcpy(et->et_src, edev->ethaddr, 6);
+	et->et_protlen = htons(PROT_IP);
+
+	ip = net_eth_to_iphdr(igmp_packet);
+	ip->hl_v = 0x40 | (hlen >> 2);
+	ip->tos = 0xc0;
+	ip->tot_len = htons(hlen + msglen);
+	ip->id = htons(igmp_ip_id++);
+	ip->frag_off = 0;
+	ip->ttl = 1;
+	ip->protocol = IPPROTO_IGMP;
+	net_copy_ip(&ip->saddr, &edev->ipaddr);
+	net_copy_ip(&ip->daddr, &dst);
+
+	if (router_alert) {
+		opt = (unsigned char *)(ip + 1);
+		opt[0] = 0x94;
+		opt[1] = 4;
+		opt[2] = 0;
+		opt[3] = 0;
+	}
+
+	ip->check = 0;
+	ip->check = ~net_checksum((unsigned char *)ip, hlen);
+
+	memcpy((unsigned char *)ip + hlen, msg, msglen);
+
+	return eth_send(edev, igmp_packet, ETHER_HDR_SIZE + hlen + msglen);
+}
+
+/*
+ * Report the membership of @group, or that we left it if @leave is set.
+ * @change selects a state change record instead of a current state
+ * record in IGMPv3 mode.
+ */
+static int igmp_report(struct net_mcast_group *group, int change, int leave)
+{
+	struct igmpmsg msg;
+	struct igmpv3_report v3;
+	IPaddr_t dst = group->addr;
+	int i, nsrcs = 0, v3len;
+
+	switch (igmp_get_version()) {
+	case 1:
+		if (leave)
+			return 0;
+		msg.type = IGMP_HOST_MEMBERSHIP_REPORT;
+		break;
+	case 2:
+		if (leave) {
+			msg.type = IGMP_V2_LEAVE_GROUP;
+			dst = htonl(IGMP_ALL_ROUTERS_ADDR);
+		} else {
+			msg.type = IGMP_V2_MEMBERSHIP_REPORT;
+		}
+		break;
+	default:
+		memset(&v3, 0, sizeof(v3));
+		v3.type = IGMP_V3_MEMBERSHIP_REPORT;
+		v3.ngrec = htons(1);
+		net_copy_ip(&v3.grec_mca, &group->addr);
+
+		if (leave) {
+			v3.grec_type = IGMPV3_CHANGE_TO_INCLUDE;
+		} else if (group->asm_users) {
+			v3.grec_type = change ? IGMPV3_CHANGE_TO_EXCLUDE :
+				IGMPV3_MODE_IS_EXCLUDE;
+		} else {
+			v3.grec_type = change ? IGMPV3_CHANGE_TO_INCLUDE :
+				IGMPV3_MODE_IS_INCLUDE;
+			nsrcs = group->nsources;
+			for (i = 0; i < nsrcs; i++)
+				net_copy_ip(&v3.grec_src[i],
+						&group->sources[i]);
+		}
+
+		v3len = offsetof(struct igmpv3_report, grec_src) + nsrcs * 4;
+		v3.grec_nsrcs = htons(nsrcs);
+		v3.checksum = ~net_checksum((unsigned char *)&v3, v3len);
+
+		return igmp_xmit(group->edev, htonl(IGMPV3_ALL_ROUTERS_ADDR),
+				&v3, v3len, 1);
+	}
+
+	msg.unused = 0;
+	net_copy_ip(&msg.group_addr, &group->addr);
+	msg.checksum = 0;
+	msg.checksum = ~net_checksum((unsigned char *)&msg, sizeof(msg));
+
+	return igmp_xmit(group->edev, dst, &msg, sizeof(msg),
+			igmp_version > 1);
+}
+
+/*
+ * Schedule a report within @max_delay unless one is due earlier anyway.
+ */
+static void igmp_schedule(struct net_mcast_group *group, uint64_t max_delay)
+{
+	uint64_t when = get_time_ns();
+
+	if (max_delay) {
+		do_div(max_delay, 1000);
+		when += (uint64_t)(rand() % 1000) * max_delay;
+	}
+
+	if (!group->report_time || when < group->report_time)
+		group->report_time = when;
+}
+
+/*
+ * The filter state of @group changed, announce it right away and repeat
+ * the announcement to make up for lost reports.
+ */
+static void igmp_state_change(struct net_mcast_group *group)
+{
+	igmp_report(group, 1, 0);
+
+	group->change_reports = IGMP_ROBUSTNESS - 1;
+	group->report_time = 0;
+	igmp_schedule(group, IGMP_UNSOLICITED_INTERVAL);
+}
+
+void igmp_poll(void)
+{
+	struct net_mcast_group *group;
+	struct hlist_node *n;
+	int i;
+
+	for (i = 0; i < NET_MCAST_HASH_SIZE; i++) {
+		hlist_for_each_entry(group, n, &net_mcast_hash[i], hash) {
+			if (!group->report_time ||
+					!is_timeout(group->report_time, 0))
+				continue;
+
+			group->report_time = 0;
+
+			if (group->change_reports) {
+				igmp_report(group, 1, 0);
+				if (--group->change_reports)
+					igmp_schedule(group,
+						IGMP_UNSOLICITED_INTERVAL);
+			} else {
+				igmp_report(group, 0, 0);
+			}
+		}
+	}
+}
+
+/**
+ * net_mcast_join - add a user to a multicast group
+ * @edev: the interface to report the membership on
+ * @addr: the group address
+ * @source: accept traffic from this source only, 0 for any source
+ */
+int net_mcast_join(struct eth_device *edev, IPaddr_t addr, IPaddr_t source)
+{
+	struct net_mcast_group *group = net_mcast_find(addr);
+	int i, changed = 0;
+
+	if (!group) {
+		group = xzalloc(sizeof(*group));
+		group->addr = addr;
+		group->edev = edev;
+		hlist_add_head(&group->hash, net_mcast_bucket(addr));
+		changed = 1;
+	}
+
+	if (!source) {
+		if (!group->asm_users++)
+			changed = 1;
+		goto out;
+	}
+
+	for (i = 0; i < group->nsources; i++) {
+		if (group->sources[i] == source) {
+			group->source_users[i]++;
+			goto out;
+		}
+	}
+
+	if (group->nsources == IGMP_MAX_SOURCES) {
+		if (changed) {
+			hlist_del(&group->hash);
+			free(group);
+		}
+		return -ENOSPC;
+	}
+
+	group->sources[group->nsources] = source;
+	group->source_users[group->nsources] = 1;
+	group->nsources++;
+
+	if (!group->asm_users)
+		changed = 1;
+out:
+	if (changed)
+		igmp_state_change(group);
+
+	return 0;
+}
+
+/**
+ * net_mcast_leave - drop a user from a multicast group
+ * @addr: the group address
+ * @source: the source passed to net_mcast_join()
+ */
+void net_mcast_leave(IPaddr_t addr, IPaddr_t source)
+{
+	struct net_mcast_group *group = net_mcast_find(addr);
+	int i, changed = 0;
+
+	if (!group)
+		return;
+
+	if (!source) {
+		if (!--group->asm_users)
+			changed = 1;
+	} else {
+		for (i = 0; i < group->nsources; i++) {
+			if (group->sources[i] != source)
+				continue;
+
+			if (!--group->source_users[i]) {
+				group->nsources--;
+				group->sources[i] =
+					group->sources[group->nsources];
+				group->source_users[i] =
+					group->source_users[group->nsources];
+				if (!group->asm_users)
+					changed = 1;
+			}
+			break;
+		}
+	}
+
+	if (!group->asm_users && !group->nsources) {
+		igmp_report(group, 1, 1);
+		hlist_del(&group->hash);
+		free(group);
+		return;
+	}
+
+	if (changed)
+		igmp_state_change(group);
+}
+
+/**
+ * net_mcast_accept - check whether we are interested in multicast traffic
+ * @addr: the group address
+ * @source: the sender's address
+ */
+int net_mcast_accept(IPaddr_t addr, IPaddr_t source)
+{
+	struct net_mcast_group *group = net_mcast_find(addr);
+	int i;
+
+	if (!group)
+		return 0;
+
+	if (group->asm_users)
+		return 1;
+
+	for (i = 0; i < group->nsources; i++)
+		if (group->sources[i] == source)
+			return 1;
+
+	return 0;
+}
+
+static void igmp_handle_query(IPaddr_t group_addr, uint64_t max_delay)
+{
+	struct net_mcast_group *group;
+	struct hlist_node *n;
+	int i;
+
+	if (group_addr) {
+		group = net_mcast_find(group_addr);
+		if (group)
+			igmp_schedule(group, max_delay);
+		return;
+	}
+
+	/*
+	 * we have to send a report for every group we want to keep alive
+	 */
+	for (i = 0; i < NET_MCAST_HASH_SIZE; i++)
+		hlist_for_each_entry(group, n, &net_mcast_hash[i], hash)
+			igmp_schedule(group, max_delay);
+}
+
+int net_handle_igmp(unsigned char *pkt, int len)
+{
+	struct iphdr *ip = net_eth_to_iphdr(pkt);
+	int hlen = (ip->hl_v & 0x0f) * 4;
+	int igmp_len = ntohs(ip->tot_len) - hlen;
+	struct igmpmsg *igmp = (struct igmpmsg *)((unsigned char *)ip + hlen);
+	struct net_mcast_group *group;
+	IPaddr_t group_addr;
+	uint64_t max_delay;
+	int code;
+
+	if (hlen < sizeof(struct iphdr) || igmp_len < sizeof(struct igmpmsg) ||
+			len < ETHER_HDR_SIZE + hlen + igmp_len)
+		return -EINVAL;
+
+	if (!net_checksum_ok((unsigned char *)igmp, igmp_len))
+		return -EINVAL;
+
+	group_addr = net_read_ip(&igmp->group_addr);
+
+	pr_debug("handling igmp type 0x%x\n", igmp->type);
+
+	switch (igmp->type) {
+	case IGMP_HOST_MEMBERSHIP_QUERY:
+		code = igmp->unused;
+
+		if (igmp_len >= 12) {
+			/* IGMPv3, max response code may be a float */
+			if (code >= 128)
+				code = ((code & 0xf) | 0x10) <<
+					(((code >> 4) & 0x7) + 3);
+		} else {
+			igmp_version = min(igmp_version, code ? 2 : 1);
+			igmp_older_querier = get_time_ns();
+		}
+
+		/* IGMPv1 queries have no max response time */
+		if (!code && igmp_len < 12)
+			max_delay = IGMP_V1_MAX_RESPONSE;
+		else
+			max_delay = code * 100 * MSECOND;
+
+		igmp_handle_query(group_addr, max_delay);
+		break;
+	case IGMP_HOST_MEMBERSHIP_REPORT:
+	case IGMP_V2_MEMBERSHIP_REPORT:
+		/*
+		 * Somebody else is in the same group - no need to send
+		 * a report ourselves. IGMPv3 has no report suppression.
+		 */
+		if (igmp_get_version() == 3)
+			break;
+
+		group = net_mcast_find(group_addr);
+		if (group && !group->change_reports)
+			group->report_time = 0;
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
@@ -0,0 +1,218 @@
+/*
+ * ipfrag.c - IPv4 fragment reassembly
+ *
+ * See file CREDITS for list of people who contributed to this
+ * project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+#include <common.h>
+#include <clock.h>
+#include <net.h>
+#include <malloc.h>
+#include <sizes.h>
+
+#define IPFRAG_TIMEOUT		(3 * SECOND)
+#define IPFRAG_MAX_DATAGRAMS	4
+#define IPFRAG_MEM_LIMIT	(CONFIG_NET_IP_REASSEMBLY_MEM * SZ_1K)
+
+/* Maximum payload of a reassembled datagram */
+#define IPFRAG_MAX_LEN		(0xffff - sizeof(struct iphdr))
+#define IPFRAG_HDR_LEN		(ETHER_HDR_SIZE + sizeof(struct iphdr))
+
+#define IP_MF			0x2000
+#define IP_OFFSET		0x1fff
+
+/*
+ * A datagram under reassembly. The payload is tracked in units of 8 bytes,
+ * the granularity of the fragment offset field.
+ */
+struct ipfrag {
+	unsigned char *buf;	/* ethernet and IP header followed by payload */
+	size_t size;		/* payload bytes allocated in buf */
+	uint32_t saddr;
+	uint16_t id;
+	uint8_t protocol;
+	int total;		/* payload length, -1 until the last fragment */
+	int units;		/* number of units received */
+	uint64_t start;
+	uint8_t map[DIV_ROUND_UP(IPFRAG_MAX_LEN, 8 * 8)];
+};
+
+static struct ipfrag ipfrags[IPFRAG_MAX_DATAGRAMS];
+static size_t ipfrag_mem;
+
+static void ipfrag_free(struct ipfrag *f)
+{
+	free(f->buf);
+	ipfrag_mem -= f->size;
+	f->buf = NULL;
+	f->size = 0;
+}
+
+static struct ipfrag *ipfrag_find(struct iphdr *ip)
+{
+	struct ipfrag *f, *free_slot = NULL, *oldest = NULL;
+	int i;
+
+	for (i = 0; i < IPFRAG_MAX_DATAGRAMS; i++) {
+		f = &ipfrags[i];
+
+		if (f->buf && is_timeout(f->start, IPFRAG_TIMEOUT)) {
+			debug("%s: dropping incomplete datagram %d\n",
+					__func__, ntohs(f->id));
+			ipfrag_free(f);
+		}
+
+		if (!f->buf) {
+			if (!free_slot)
+				free_slot = f;
+			continue;
+		}
+
+		if (f->saddr == ip->saddr && f->id == ip->id &&
+				f->protocol == ip->protocol)
+			return f;
+
+		if (!oldest || f->start < oldest->start)
+			oldest = f;
+	}
+
+	f = free_slot;
+	if (!f) {
+		f = oldest;
+		ipfrag_free(f);
+	}
+
+	f->buf = malloc(IPFRAG_HDR_LEN);
+	if (!f->buf)
+		return NULL;
+
+	f->saddr = ip->saddr;
+	f->id = ip->id;
+	f->protocol = ip->protocol;
+	f->total = -1;
+	f->units = 0;
+	f->start = get_time_ns();
+	memset(f->map, 0, sizeof(f->map));
+
+	return f;
+}
+
+static int ipfrag_grow(struct ipfrag *f, size_t end)
+{
+	unsigned char *buf;
+	size_t size;
+
+	if (end <= f->size)
+		return 0;
+
+	if (f->total >= 0)
+		size = f->total;
+	else
+		size = min_t(size_t, ALIGN(end, SZ_8K), IPFRAG_MAX_LEN);
+
+	if (ipfrag_mem - f->size + size > IPFRAG_MEM_LIMIT)
+		return -ENOMEM;
+
+	buf = realloc(f->buf, IPFRAG_HDR_LEN + size);
+	if (!buf)
+		return -ENOMEM;
+
+	ipfrag_mem += size - f->size;
+	f->buf = buf;
+	f->size = size;
+
+	return 0;
+}
+
+/**
+ * net_ip_reassemble - add a fragment to the reassembly cache
+ * @pkt: ethernet frame containing an IP fragment
+ * @len: frame length, updated to the length of the reassembled datagram
+ *
+ * Return a newly allocated frame containing the complete datagram once the
+ * last missing fragment arrived, NULL otherwise. The caller has to free the
+ * frame after processing it.
+ */
+unsigned char *net_ip_reassemble(unsigned char *pkt, int *len)
+{
+	struct iphdr *ip = net_eth_to_iphdr(pkt);
+	struct ipfrag *f;
+	unsigned char *buf;
+	int hlen = (ip->hl_v & 0x0f) * 4;
+	int frag_off = ntohs(ip->frag_off);
+	int offset = (frag_off & IP_OFFSET) * 8;
+	int flen = ntohs(ip->tot_len) - hlen;
+	int i;
+
+	if (hlen < sizeof(struct iphdr) || flen <= 0 ||
+			offset + flen > IPFRAG_MAX_LEN)
+		return NULL;
+
+	/* All fragments but the last one carry a multiple of 8 bytes */
+	if ((frag_off & IP_MF) && (flen & 7))
+		return NULL;
+
+	f = ipfrag_find(ip);
+	if (!f || !f->buf)
+		return NULL;
+
+	if (!(frag_off & IP_MF)) {
+		if (f->total >= 0 && f->total != offset + flen)
+			goto drop;
+		f->total = offset + flen;
+	}
+
+	if (f->total >= 0 && offset + flen > f->total)
+		goto drop;
+
+	if (ipfrag_grow(f, offset + flen))
+		goto drop;
+
+	if (!offset || !f->units)
+		memcpy(f->buf, pkt, IPFRAG_HDR_LEN);
+
+	memcpy(f->buf + IPFRAG_HDR_LEN + offset, (unsigned char *)ip + hlen,
+			flen);
+
+	for (i = offset / 8; i < DIV_ROUND_UP(offset + flen, 8); i++) {
+		if (f->map[i / 8] & (1 << (i % 8)))
+			continue;
+		f->map[i / 8] |= 1 << (i % 8);
+		f->units++;
+	}
+
+	if (f->total < 0 || f->units != DIV_ROUND_UP(f->total, 8))
+		return NULL;
+
+	buf = f->buf;
+	*len = IPFRAG_HDR_LEN + f->total;
+
+	ip = net_eth_to_iphdr(buf);
+	ip->hl_v = 0x45;
+	ip->tot_len = htons(sizeof(struct iphdr) + f->total);
+	ip->frag_off = 0;
+	ip->check = 0;
+	ip->check = ~net_checksum((unsigned char *)ip, sizeof(struct iphdr));
+
+	ipfrag_mem -= f->size;
+	f->buf = NULL;
+	f->size = 0;
+
+	return buf;
+
+drop:
+	debug("%s: dropping datagram %d\n", __func__, ntohs(ip->id));
+	ipfrag_free(f);
+
+	return NULL;
+}
@@ -39,27 +39,118 @@
 unsigned char *NetRxPackets[PKTBUFSRX]; /* Receive packets		*/
 static unsigned int net_ip_id;
 
+static int net_udp_checksum = 1;
+
+/* time spent in net_receive(), accumulated while enabled for benchmarks */
+static int net_rx_timing_enabled;
+static uint64_t net_rx_time_ns;
+
 int net_checksum_ok(unsigned char *ptr, int len)
 {
 	return net_checksum(ptr, len) == 0xffff;
 }
 
-uint16_t net_checksum(unsigned char *ptr, int len)
+/* Sum a buffer starting at an even address, 32 bits at a time */
+static uint64_t net_checksum_aligned(const unsigned char *p, int len,
+		uint64_t sum)
 {
-	uint32_t xsum = 0;
-	uint16_t *p = (uint16_t *)ptr;
+	if (((unsigned long)p & 2) && len >= 2) {
+		sum += *(const uint16_t *)p;
+		p += 2;
+		len -= 2;
+	}
+
+	while (len >= 16) {
+		const uint32_t *w = (const uint32_t *)p;
+
+		sum += w[0];
+		sum += w[1];
+		sum += w[2];
+		sum += w[3];
+		p += 16;
+		len -= 16;
+	}
+
+	while (len >= 4) {
+		sum += *(const uint32_t *)p;
+		p += 4;
+		len -= 4;
+	}
 
-	if (len & 1)
-		ptr[len] = 0;
+	if (len >= 2) {
+		sum += *(const uint16_t *)p;
+		p += 2;
+		len -= 2;
+	}
+
+	if (len) {
+		uint8_t last[2] = { *p, 0 };
+
+		sum += *(uint16_t *)last;
+	}
+
+	return sum;
+}
+
+static uint32_t net_checksum_fold64(uint64_t sum)
+{
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	return sum;
+}
+
+/**
+ * net_checksum_partial - add a buffer to a running internet checksum
+ * @buf: data to sum, no alignment required
+ * @len: length of the data in bytes
+ * @sum: sum of the preceding data, 0 to start a new checksum
+ *
+ * The result is not folded and has to be passed through net_checksum_fold()
+ * before use. Partial sums of buffers with an even length can be chained.
+ */
+uint32_t net_checksum_partial(const void *buf, int len, uint32_t sum)
+{
+	const unsigned char *p = buf;
+	uint64_t acc = sum;
+
+	if (len <= 0)
+		return sum;
+
+	if ((unsigned long)p & 1) {
+		/*
+		 * Sum the remainder as if it was aligned and swap the result
+		 * back, ones' complement addition is byte order independent.
+		 */
+		uint8_t first[2] = { *p, 0 };
+		uint16_t rest;
+
+		rest = net_checksum_fold(net_checksum_fold64(
+				net_checksum_aligned(p + 1, len - 1, 0)));
+		acc += swab16(rest);
+		acc += *(uint16_t *)first;
+	} else {
+		acc = net_checksum_aligned(p, len, acc);
+	}
+
+	return net_checksum_fold64(acc);
+}
+
+uint16_t net_checksum(unsigned char *ptr, int len)
+{
+	return net_checksum_fold(net_checksum_partial(ptr, len, 0));
+}
 
-	len = (len + 1) >> 1;
+/* Sum of the pseudo header used by UDP and TCP checksums */
+static uint32_t net_pseudo_checksum(IPaddr_t saddr, IPaddr_t daddr,
+		uint8_t proto, int len)
+{
+	uint32_t sum;
 
-	while (len-- > 0)
-		xsum += *p++;
+	sum = net_checksum_partial(&saddr, 4, 0);
+	sum = net_checksum_partial(&daddr, 4, sum);
 
-	xsum = (xsum & 0xffff) + (xsum >> 16);
-	xsum = (xsum & 0xffff) + (xsum >> 16);
-	return xsum & 0xffff;
+	/* fold first, the unfolded sum may not have room for the carry */
+	return net_checksum_fold(sum) + htons(proto) + htons(len);
 }
 
 char *ip_to_string (IPaddr_t x)
@@ -167,17 +258,77 @@ void ethaddr_to_string(const u8 enetaddr[6], char *str)
 
 static unsigned char *arp_ether;
 static IPaddr_t arp_wait_ip;
+static struct eth_device *arp_wait_edev;
 
-static void arp_handler(struct arprequest *arp)
+/*
+ * Each interface has a neighbour cache shared by all its connections, so
+ * that opening a connection to a known host doesn't need an ARP round trip.
+ */
+#define ARP_CACHE_TIMEOUT	(60 * SECOND)
+
+static int arp_cache_lookup(struct eth_device *edev, IPaddr_t ip,
+		unsigned char *ether)
 {
-	IPaddr_t tmp;
+	struct arp_entry *e;
+	int i;
+
+	for (i = 0; i < ARP_CACHE_SIZE; i++) {
+		e = &edev->arp_cache[i];
+
+		if (!e->ip || e->ip != ip)
+			continue;
 
-	/* are we waiting for a reply */
-	if (!arp_wait_ip)
+		if (is_timeout(e->time, ARP_CACHE_TIMEOUT)) {
+			e->ip = 0;
+			return -ENOENT;
+		}
+
+		memcpy(ether, e->ethaddr, 6);
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+static void arp_cache_update(struct eth_device *edev, IPaddr_t ip,
+		const unsigned char *ether)
+{
+	struct arp_entry *e, *victim = &edev->arp_cache[0];
+	int i;
+
+	if (!ip || !is_valid_ether_addr(ether))
 		return;
 
+	for (i = 0; i < ARP_CACHE_SIZE; i++) {
+		e = &edev->arp_cache[i];
+
+		if (e->ip == ip) {
+			victim = e;
+			break;
+		}
+
+		/* reuse a free or else the least recently refreshed entry */
+		if (victim->ip && (!e->ip || e->time < victim->time))
+			victim = e;
+	}
+
+	victim->ip = ip;
+	memcpy(victim->ethaddr, ether, 6);
+	victim->time = get_time_ns();
+}
+
+static void arp_handler(struct eth_device *edev, struct arprequest *arp)
+{
+	IPaddr_t tmp;
+
 	tmp = net_read_ip(&arp->ar_data[6]);
 
+	arp_cache_update(edev, tmp, &arp->ar_data[0]);
+
+	/* are we waiting for a reply on this interface */
+	if (!arp_wait_ip || edev != arp_wait_edev)
+		return;
+
 	/* matched waiting packet's address */
 	if (tmp == arp_wait_ip) {
 		/* save address for later use */
@@ -188,15 +339,16 @@ static void arp_handler(struct arprequest *arp)
 	}
 }
 
-static int arp_request(IPaddr_t dest, unsigned char *ether)
+static int arp_request(struct eth_device *edev, IPaddr_t dest,
+		unsigned char *ether)
 {
-	struct eth_device *edev = eth_get_current();
 	char *pkt;
 	struct arprequest *arp;
 	uint64_t arp_start;
 	static char *arp_packet;
 	struct ethernet *et;
 	unsigned retries = 0;
+	IPaddr_t nexthop;
 	int ret;
 
 	if (!arp_packet) {
@@ -205,11 +357,18 @@ static int arp_request(IPaddr_t dest, unsigned char *ether)
 			return -ENOMEM;
 	}
 
+	if ((dest & edev->netmask) != (edev->ipaddr & edev->netmask) &&
+			edev->gateway)
+		nexthop = edev->gateway;
+	else
+		nexthop = dest;
+
+	if (!arp_cache_lookup(edev, nexthop, ether))
+		return 0;
+
 	pkt = arp_packet;
 	et = (struct ethernet *)arp_packet;
 
-	arp_wait_ip = dest;
-
 	pr_debug("ARP broadcast\n");
 
 	memset(et->et_dest, 0xff, 6);
@@ -228,14 +387,8 @@ static int arp_request(IPaddr_t dest, unsigned char *ether)
 	net_write_ip(arp->ar_data + 6, edev->ipaddr);	/* source IP addr	*/
 	memset(arp->ar_data + 10, 0, 6);	/* dest ET addr = 0     */
 
-	if ((dest & edev->netmask) != (edev->ipaddr & edev->netmask)) {
-		if (!edev->gateway)
-			arp_wait_ip = dest;
-		else
-			arp_wait_ip = edev->gateway;
-	} else {
-		arp_wait_ip = dest;
-	}
+	arp_wait_ip = nexthop;
+	arp_wait_edev = edev;
 
 	net_write_ip(arp->ar_data + 16, arp_wait_ip);
 
@@ -272,60 +425,23 @@ static int arp_request(IPaddr_t dest, unsigned char *ether)
 	return 0;
 }
 
-static int igmp_report(struct net_connection *con)
-{
-	static char *igmp_packet;
-
-	struct iphdr *ip;
-	struct igmpmsg *igmp;
-
-	if (!igmp_packet) {
-		igmp_packet = net_alloc_packet();
-		if (!igmp_packet)
-			return -ENOMEM;
-	}
-
-	memcpy(igmp_packet, con->packet, ETHER_HDR_SIZE + sizeof(struct iphdr));
-
-	ip = net_eth_to_iphdr(igmp_packet);
-	igmp = net_eth_to_igmpmsg(igmp_packet);
-
-	igmp->type = IGMP_HOST_MEMBERSHIP_REPORT;
-	igmp->unused = 0;
-	net_copy_ip(&igmp->group_addr, &con->ip->daddr);
-	igmp->checksum = 0;
-	igmp->checksum = ~net_checksum((unsigned char *)igmp, sizeof(struct igmpmsg));
-
-	ip->protocol = IPPROTO_IGMP;
-	/*
-	 * Limit the TTL to 1, as IGMPv2 mandates "All IGMP messages described
-	 * in this document are sent with IP TTL 1", although we're only
-	 * IGMPv1 capable (no router alert IP option and we ignore the max
-	 * response time)
-	 */
-	ip->ttl = 1;
-	net_copy_ip(&con->ip->saddr, &con->edev->ipaddr);
-	ip->tot_len = htons(sizeof(struct iphdr) + sizeof(struct igmpmsg));
-	ip->id = htons(net_ip_id++);
-	ip->check = 0;
-	ip->check = ~net_checksum((unsigned char *)ip, sizeof(struct iphdr));
+static LIST_HEAD(connection_list);
 
-	return eth_send(con->edev, igmp_packet, ETHER_HDR_SIZE + sizeof(struct iphdr) + sizeof(struct igmpmsg));
-}
+/*
+ * UDP connections are additionally hashed by their local port, so that
+ * received packets can be demultiplexed without walking connection_list.
+ */
+#define NET_UDP_HASH_BITS	4
+#define NET_UDP_HASH_SIZE	(1 << NET_UDP_HASH_BITS)
 
-static LIST_HEAD(connection_list);
+static struct hlist_head net_udp_hash[NET_UDP_HASH_SIZE];
 
-static void igmp_poll(void)
+static struct hlist_head *net_udp_bucket(uint16_t port)
 {
-	struct net_connection *con;
+	port = ntohs(port);
 
-	list_for_each_entry(con, &connection_list, list) {
-		if (con->igmp_report_timeout > 0 && is_timeout(con->igmp_report_timeout, 0)) {
-			con->igmp_report_timeout = 0;
-			/* Refresh IGMP membership */
-			igmp_report(con);
-		}
-	}
+	return &net_udp_hash[(port ^ (port >> NET_UDP_HASH_BITS)) &
+			(NET_UDP_HASH_SIZE - 1)];
 }
 
 void net_poll(void)
@@ -388,10 +504,9 @@ void net_set_gateway(IPaddr_t gw)
 	edev->gateway = gw;
 }
 
-static struct net_connection *net_new(IPaddr_t dest, rx_handler_f *handler,
-		void *ctx)
+static struct net_connection *net_new(struct eth_device *edev, IPaddr_t dest,
+		IPaddr_t source, rx_handler_f *handler, void *ctx)
 {
-	struct eth_device *edev = eth_get_current();
 	struct net_connection *con;
 	int ret;
 
@@ -414,11 +529,12 @@ static struct net_connection *net_new(IPaddr_t dest, rx_handler_f *handler,
 	con->packet = net_alloc_packet();
 	con->priv = ctx;
 	con->edev = edev;
-	memset(con->packet, 0, PKTSIZE);
+	memset(con->packet, 0, ETH_FRAME_SIZE(ETH_MAX_MTU));
 
 	con->et = (struct ethernet *)con->packet;
 	con->ip = net_eth_to_iphdr(con->packet);
 	con->udp = net_eth_to_udphdr(con->packet);
+	con->tcp = net_eth_to_tcphdr(con->packet);
 	con->icmp = net_eth_to_icmphdr(con->packet);
 	con->igmp = net_eth_to_igmpmsg(con->packet);
 	con->handler = handler;
@@ -427,11 +543,12 @@ static struct net_connection *net_new(IPaddr_t dest, rx_handler_f *handler,
 		memset(con->et->et_dest, 0xff, 6);
 	} else if (is_multicast_ip_addr(dest)) {
 		multicast_ether_addr(con->et->et_dest, dest);
-
-		/* Send the first report immediately */
-		con->igmp_report_timeout = get_time_ns();
+		ret = net_mcast_join(edev, dest, source);
+		if (ret)
+			goto out;
+		con->source = source;
 	} else {
-		ret = arp_request(dest, con->et->et_dest);
+		ret = arp_request(edev, dest, con->et->et_dest);
 		if (ret)
 			goto out;
 	}
@@ -455,10 +572,11 @@ out:
 	return ERR_PTR(ret);
 }
 
-struct net_connection *net_udp_new(IPaddr_t dest, uint16_t dport,
+static struct net_connection *__net_udp_new(struct eth_device *edev,
+		IPaddr_t dest, IPaddr_t source, uint16_t dport,
 		rx_handler_f *handler, void *ctx)
 {
-	struct net_connection *con = net_new(dest, handler, ctx);
+	struct net_connection *con = net_new(edev, dest, source, handler, ctx);
 
 	if (IS_ERR(con))
 		return con;
@@ -468,13 +586,58 @@ struct net_connection *net_udp_new(IPaddr_t dest, uint16_t dport,
 	con->udp->uh_sport = htons(net_udp_new_localport());
 	con->ip->protocol = IPPROTO_UDP;
 
+	hlist_add_head(&con->hash, net_udp_bucket(con->udp->uh_sport));
+
 	return con;
 }
 
+/**
+ * net_udp_new_ssm - create a UDP connection to a source-specific group
+ * @group: the multicast group
+ * @source: only accept traffic sent by this host, 0 for any source
+ * @dport: the destination port
+ * @handler: receive handler
+ * @ctx: context passed to @handler
+ */
+struct net_connection *net_udp_new_ssm(IPaddr_t group, IPaddr_t source,
+		uint16_t dport, rx_handler_f *handler, void *ctx)
+{
+	return __net_udp_new(eth_get_current(), group, source, dport,
+			handler, ctx);
+}
+
+/**
+ * net_udp_eth_new - create a UDP connection on a given interface
+ *
+ * Like net_udp_new(), but uses @edev instead of the current interface.
+ * The connection only receives packets arriving on @edev.
+ */
+struct net_connection *net_udp_eth_new(struct eth_device *edev, IPaddr_t dest,
+		uint16_t dport, rx_handler_f *handler, void *ctx)
+{
+	return __net_udp_new(edev, dest, 0, dport, handler, ctx);
+}
+
+struct net_connection *net_udp_new(IPaddr_t dest, uint16_t dport,
+		rx_handler_f *handler, void *ctx)
+{
+	return __net_udp_new(eth_get_current(), dest, 0, dport, handler, ctx);
+}
+
+int net_udp_bind(struct net_connection *con, int sport)
+{
+	hlist_del_init(&con->hash);
+	con->udp->uh_sport = htons(sport);
+	hlist_add_head(&con->hash, net_udp_bucket(con->udp->uh_sport));
+
+	return 0;
+}
+
 struct net_connection *net_icmp_new(IPaddr_t dest, rx_handler_f *handler,
 		void *ctx)
 {
-	struct net_connection *con = net_new(dest, handler, ctx);
+	struct net_connection *con = net_new(eth_get_current(), dest, 0,
+			handler, ctx);
 
 	if (IS_ERR(con))
 		return con;
@@ -485,8 +648,56 @@ struct net_connection *net_icmp_new(IPaddr_t dest, rx_handler_f *handler,
 	return con;
 }
 
+/*
+ * Local TCP ports start at a random place in the dynamic range, so that a
+ * reset board does not reuse the ports of connections the server may still
+ * know about.
+ */
+static uint16_t net_tcp_new_localport(void)
+{
+	static uint16_t localport;
+
+	if (!localport)
+		localport = (uint32_t)get_time_ns() % 16384;
+
+	localport = (localport + 1) % 16384;
+
+	return 49152 + localport;
+}
+
+/**
+ * net_tcp_new - create a TCP connection
+ *
+ * Only provides the addressing and the receive handler for TCP segments
+ * of this connection, the protocol itself is up to the user, usually
+ * net/tcp.c.
+ */
+struct net_connection *net_tcp_new(IPaddr_t dest, uint16_t dport,
+		rx_handler_f *handler, void *ctx)
+{
+	struct net_connection *con = net_new(eth_get_current(), dest, 0,
+			handler, ctx);
+
+	if (IS_ERR(con))
+		return con;
+
+	con->proto = IPPROTO_TCP;
+	con->ip->protocol = IPPROTO_TCP;
+	con->tcp->source = htons(net_tcp_new_localport());
+	con->tcp->dest = htons(dport);
+
+	return con;
+}
+
 void net_unregister(struct net_connection *con)
 {
+	IPaddr_t dest = net_read_ip(&con->ip->daddr);
+
+	if (con->proto == IPPROTO_UDP)
+		hlist_del(&con->hash);
+	if (is_multicast_ip_addr(dest))
+		net_mcast_leave(dest, con->source);
+
 	list_del(&con->list);
 	free(con->packet);
 	free(con);
@@ -494,17 +705,28 @@ void net_unregister(struct net_connection *con)
 
 static int net_ip_send(struct net_connection *con, int len)
 {
+	struct iphdr *ip = con->ip;
+	uint16_t tot_len = htons(sizeof(struct iphdr) + len);
+	uint16_t id = htons(net_ip_id++);
+
 	/*
 	 * Always update the source address, as it may change while a
 	 * connection is active. This will probably only happen on broadcast and
 	 * multicast destinations.
 	 */
-	net_copy_ip(&con->ip->saddr, &con->edev->ipaddr);
-
-	con->ip->tot_len = htons(sizeof(struct iphdr) + len);
-	con->ip->id = htons(net_ip_id++);
-	con->ip->check = 0;
-	con->ip->check = ~net_checksum((unsigned char *)con->ip, sizeof(struct iphdr));
+	if (!ip->check || net_read_ip(&ip->saddr) != con->edev->ipaddr) {
+		net_copy_ip(&ip->saddr, &con->edev->ipaddr);
+		ip->tot_len = tot_len;
+		ip->id = id;
+		ip->check = 0;
+		ip->check = ~net_checksum((unsigned char *)ip, sizeof(struct iphdr));
+	} else {
+		/* only the length and id differ from the previous packet */
+		ip->check = net_checksum_update(ip->check, ip->tot_len, tot_len);
+		ip->check = net_checksum_update(ip->check, ip->id, id);
+		ip->tot_len = tot_len;
+		ip->id = id;
+	}
 
 	return eth_send(con->edev, con->packet, ETHER_HDR_SIZE + sizeof(struct iphdr) + len);
 }
@@ -514,6 +736,20 @@ int net_udp_send(struct net_connection *con, int len)
 	con->udp->uh_ulen = htons(len + 8);
 	con->udp->uh_sum = 0;
 
+	if (net_udp_checksum) {
+		uint32_t sum;
+		uint16_t check;
+
+		sum = net_pseudo_checksum(con->edev->ipaddr,
+				net_read_ip(&con->ip->daddr), IPPROTO_UDP,
+				len + 8);
+		sum = net_checksum_partial(con->udp, len + 8, sum);
+		check = ~net_checksum_fold(sum);
+
+		/* A zero checksum means none was computed */
+		con->udp->uh_sum = check ? check : 0xffff;
+	}
+
 	return net_ip_send(con, sizeof(struct udphdr) + len);
 }
 
@@ -525,11 +761,24 @@ int net_icmp_send(struct net_connection *con, int len)
 	return net_ip_send(con, sizeof(struct icmphdr) + len);
 }
 
-static int net_answer_arp(unsigned char *pkt, int len)
+/* @len includes the TCP header and its options */
+int net_tcp_send(struct net_connection *con, int len)
+{
+	uint32_t sum;
+
+	con->tcp->check = 0;
+	sum = net_pseudo_checksum(con->edev->ipaddr,
+			net_read_ip(&con->ip->daddr), IPPROTO_TCP, len);
+	sum = net_checksum_partial(con->tcp, len, sum);
+	con->tcp->check = ~net_checksum_fold(sum);
+
+	return net_ip_send(con, len);
+}
+
+static int net_answer_arp(struct eth_device *edev, unsigned char *pkt, int len)
 {
 	struct arprequest *arp = net_eth_to_arprequest(pkt);
 	struct ethernet *et = (struct ethernet *)pkt;
-	struct eth_device *edev = eth_get_current();
 	unsigned char *packet;
 	int ret;
 
@@ -555,8 +804,9 @@ static int net_answer_arp(unsigned char *pkt, int len)
 	return ret;
 }
 
-static void net_bad_packet(unsigned char *pkt, int len)
+static void net_bad_packet(struct eth_device *edev, unsigned char *pkt, int len)
 {
+	eth_rx_drop(edev, ETH_DROP_BAD);
 #ifdef DEBUG
 	/*
 	 * We received a bad packet. for now just dump it.
@@ -592,45 +842,81 @@ static int net_handle_arp(struct eth_device *edev, unsigned char *pkt, int len)
 		goto bad;
 	if (arp->ar_pln != 4)
 		goto bad;
-	if (edev->ipaddr == 0)
-		return 0;
-	if (net_read_ip(&arp->ar_data[16]) != edev->ipaddr)
+	if (edev->ipaddr == 0 ||
+			net_read_ip(&arp->ar_data[16]) != edev->ipaddr) {
+		eth_rx_drop(edev, ETH_DROP_ADDR);
 		return 0;
+	}
 
 	switch (ntohs(arp->ar_op)) {
 	case ARPOP_REQUEST:
-		return net_answer_arp(pkt, len);
+		/* the requester will talk to us, so remember its address */
+		arp_cache_update(edev, net_read_ip(&arp->ar_data[6]),
+				&arp->ar_data[0]);
+		return net_answer_arp(edev, pkt, len);
 	case ARPOP_REPLY:
-		arp_handler(arp);
+		arp_handler(edev, arp);
 		return 1;
 	default:
 		pr_debug("Unexpected ARP opcode 0x%x\n", ntohs(arp->ar_op));
-		return -EINVAL;
+		goto bad;
 	}
 
 	return 0;
 
 bad:
-	net_bad_packet(pkt, len);
+	net_bad_packet(edev, pkt, len);
 	return -EINVAL;
 }
 
-static int net_handle_udp(unsigned char *pkt, int len)
+static int net_udp_checksum_ok(unsigned char *pkt, int len)
+{
+	struct iphdr *ip = net_eth_to_iphdr(pkt);
+	struct udphdr *udp = net_eth_to_udphdr(pkt);
+	int ulen = ntohs(udp->uh_ulen);
+	uint32_t sum;
+
+	if (ulen < sizeof(struct udphdr) ||
+			ulen > ntohs(ip->tot_len) - sizeof(struct iphdr))
+		return 0;
+
+	if (!udp->uh_sum)
+		return 1;
+
+	sum = net_pseudo_checksum(net_read_ip(&ip->saddr),
+			net_read_ip(&ip->daddr), IPPROTO_UDP, ulen);
+	sum = net_checksum_partial(udp, ulen, sum);
+
+	return net_checksum_fold(sum) == 0xffff;
+}
+
+static int net_handle_udp(struct eth_device *edev, unsigned char *pkt, int len,
+		unsigned int csum)
 {
 	struct iphdr *ip = net_eth_to_iphdr(pkt);
 	struct udphdr *udp = net_eth_to_udphdr(pkt);
 	struct net_connection *con;
+	struct hlist_node *n;
 	IPaddr_t daddr;
 	int multicast;
 
+	if (len < ETHER_HDR_SIZE + sizeof(struct iphdr) + sizeof(struct udphdr)) {
+		net_bad_packet(edev, pkt, len);
+		return -EINVAL;
+	}
+
+	if (net_udp_checksum && !(csum & NET_RX_CSUM_L4) &&
+			!net_udp_checksum_ok(pkt, len)) {
+		debug("%s: bad checksum\n", __func__);
+		eth_rx_drop(edev, ETH_DROP_CSUM);
+		return -EINVAL;
+	}
+
 	daddr = net_read_ip(&ip->daddr);
 	multicast = is_multicast_ip_addr(daddr);
 
-	list_for_each_entry(con, &connection_list, list) {
-		if (con->proto != IPPROTO_UDP)
-			continue;
-
-		if (udp->uh_dport != con->udp->uh_sport)
+	hlist_for_each_entry(con, n, net_udp_bucket(udp->uh_dport), hash) {
+		if (udp->uh_dport != con->udp->uh_sport || con->edev != edev)
 			continue;
 
 		/*
@@ -642,13 +928,62 @@ static int net_handle_udp(unsigned char *pkt, int len)
 		if (multicast && daddr != net_read_ip(&con->ip->daddr))
 			continue;
 
+		/* Source-specific connections only accept their source */
+		if (con->source && con->source != net_read_ip(&ip->saddr))
+			continue;
+
 		con->handler(con->priv, pkt, len);
 		return 0;
 	}
+
+	eth_rx_drop(edev, ETH_DROP_NOPORT);
+
 	return -EINVAL;
 }
 
-static int net_handle_icmp(unsigned char *pkt, int len)
+static int net_handle_tcp(struct eth_device *edev, unsigned char *pkt, int len,
+		unsigned int csum)
+{
+	struct iphdr *ip = net_eth_to_iphdr(pkt);
+	struct tcphdr *tcp = net_eth_to_tcphdr(pkt);
+	IPaddr_t saddr = net_read_ip(&ip->saddr);
+	struct net_connection *con;
+	int tlen = ntohs(ip->tot_len) - sizeof(struct iphdr);
+	uint32_t sum;
+
+	if (tlen < (int)sizeof(struct tcphdr) || (tcp->doff >> 4) * 4 > tlen) {
+		net_bad_packet(edev, pkt, len);
+		return -EINVAL;
+	}
+
+	if (!(csum & NET_RX_CSUM_L4)) {
+		sum = net_pseudo_checksum(saddr, net_read_ip(&ip->daddr),
+				IPPROTO_TCP, tlen);
+		sum = net_checksum_partial(tcp, tlen, sum);
+		if (net_checksum_fold(sum) != 0xffff) {
+			eth_rx_drop(edev, ETH_DROP_CSUM);
+			return -EINVAL;
+		}
+	}
+
+	list_for_each_entry(con, &connection_list, list) {
+		if (con->proto != IPPROTO_TCP || con->edev != edev)
+			continue;
+		if (tcp->dest != con->tcp->source ||
+				tcp->source != con->tcp->dest ||
+				saddr != net_read_ip(&con->ip->daddr))
+			continue;
+
+		con->handler(con->priv, (char *)pkt, len);
+		return 0;
+	}
+
+	eth_rx_drop(edev, ETH_DROP_NOPORT);
+
+	return -EINVAL;
+}
+
+static int net_handle_icmp(struct eth_device *edev, unsigned char *pkt, int len)
 {
 	struct net_connection *con;
 
@@ -660,77 +995,37 @@ static int net_handle_icmp(unsigned char *pkt, int len)
 			return 0;
 		}
 	}
+
+	eth_rx_drop(edev, ETH_DROP_NOPORT);
+
 	return 0;
 }
 
-static int net_handle_igmp(unsigned char *pkt, int len)
+static int net_handle_ip_proto(struct eth_device *edev, unsigned char *pkt,
+		int len, unsigned int csum)
 {
 	struct iphdr *ip = net_eth_to_iphdr(pkt);
-	struct igmpmsg *igmp = net_eth_to_igmpmsg(pkt);
-	IPaddr_t daddr, group_addr;
-	struct net_connection *con;
-
-	if (len < ETHER_HDR_SIZE + sizeof(struct iphdr) + sizeof(struct igmpmsg))
-		goto bad;
-
-	if (!net_checksum_ok((unsigned char *)igmp, sizeof(struct igmpmsg)))
-		goto bad;
-
-	if ((igmp->type & 0xf0) != 0x10)
-		goto skip;
-
-	daddr = net_read_ip(&ip->daddr);
-	group_addr = net_read_ip(&igmp->group_addr);
-
-	printf("handling igmp type %x\n", igmp->type);
 
-	switch (igmp->type) {
-	case IGMP_HOST_MEMBERSHIP_QUERY:
-		if (daddr != htonl(IGMP_ALL_HOST_ADDR))
-			goto bad;
-		/*
-		 * we have to send a report for every multicast IP we want to
-		 * keep alive
-		 */
-		list_for_each_entry(con, &connection_list, list) {
-			IPaddr_t daddr = net_read_ip(&con->ip->daddr);
-
-			if (is_multicast_ip_addr(daddr)) {
-				/* Start the report timer - we have to defend the membership */
-				if (con->igmp_report_timeout == 0)
-					con->igmp_report_timeout = get_time_ns() + (rand() % 10000) * MSECOND;
-			}
-		}
-		break;
-	case IGMP_HOST_MEMBERSHIP_REPORT:
-		if (daddr != group_addr)
-			goto bad;
-		if (ip->ttl != 1)
-			goto skip;
-
-		list_for_each_entry(con, &connection_list, list) {
-			/*
-			 * Somebody else is in the same group - no need to send
-			 * a report ourselves
-			 */
-			if (net_read_ip(&con->ip->daddr) == group_addr)
-				con->igmp_report_timeout = 0;
-		}
+	switch (ip->protocol) {
+	case IPPROTO_ICMP:
+		return net_handle_icmp(edev, pkt, len);
+	case IPPROTO_IGMP:
+		return net_handle_igmp(pkt, len);
+	case IPPROTO_UDP:
+		return net_handle_udp(edev, pkt, len, csum);
+	case IPPROTO_TCP:
+		if (IS_ENABLED(CONFIG_NET_TCP))
+			return net_handle_tcp(edev, pkt, len, csum);
 		break;
-	default:
-		pr_debug("Unexpected IGMP request %d\n", igmp->type);
-		goto bad;
 	}
 
-skip:
-	return 0;
+	eth_rx_drop(edev, ETH_DROP_PROTO);
 
-bad:
-	net_bad_packet(pkt, len);
-	return -EINVAL;
+	return 0;
 }
 
-static int net_handle_ip(struct eth_device *edev, unsigned char *pkt, int len)
+static int net_handle_ip(struct eth_device *edev, unsigned char *pkt, int len,
+		unsigned int csum)
 {
 	struct iphdr *ip = net_eth_to_iphdr(pkt);
 	IPaddr_t tmp;
@@ -743,12 +1038,11 @@ static int net_handle_ip(struct eth_device *edev, unsigned char *pkt, int len)
 		goto bad;
 	}
 
-	if ((ip->hl_v & 0xf0) != 0x40)
+	if ((ip->hl_v & 0xf0) != 0x40 || (ip->hl_v & 0x0f) < 5)
 		goto bad;
 
-	if (ip->frag_off & htons(0x1fff)) /* Can't deal w/ fragments */
-		goto bad;
-	if (!net_checksum_ok((unsigned char *)ip, sizeof(struct iphdr)))
+	if (!(csum & NET_RX_CSUM_IP) &&
+			!net_checksum_ok((unsigned char *)ip, (ip->hl_v & 0x0f) * 4))
 		goto bad;
 
 	tmp = net_read_ip(&ip->daddr);
@@ -757,43 +1051,58 @@ static int net_handle_ip(struct eth_device *edev, unsigned char *pkt, int len)
 	 * destination iff our source address is 0.0.0.0 and matching multicast
 	 * traffic.
 	 */
-	if (edev->ipaddr && tmp != edev->ipaddr && !is_broadcast_ip_addr(tmp) && !is_multicast_ip_addr(tmp))
+	if (edev->ipaddr && tmp != edev->ipaddr && !is_broadcast_ip_addr(tmp) && !is_multicast_ip_addr(tmp)) {
+		eth_rx_drop(edev, ETH_DROP_ADDR);
 		return 0;
+	}
 
 	/*
 	 * We have to filter out multicast traffic that we aren't interested in.
+	 * IGMP is always passed on, group specific queries are sent to the
+	 * group itself.
 	 */
-	if (is_multicast_ip_addr(tmp)) {
-		struct net_connection *con;
-		int match = tmp == htonl(IGMP_ALL_HOST_ADDR);
-
-		list_for_each_entry(con, &connection_list, list) {
-			if (tmp == net_read_ip(&con->ip->daddr)) {
-				match = 1;
-				break;
-			}
-		}
+	if (is_multicast_ip_addr(tmp) && ip->protocol != IPPROTO_IGMP &&
+			!net_mcast_accept(tmp, net_read_ip(&ip->saddr))) {
+		eth_rx_drop(edev, ETH_DROP_MCAST);
+		return 0;
+	}
+
+	if (ip->frag_off & htons(0x3fff)) {
+		unsigned char *frame;
+		int ret;
+
+		if (!IS_ENABLED(CONFIG_NET_IP_REASSEMBLY))
+			goto bad;
 
-		if (!match)
+		frame = net_ip_reassemble(pkt, &len);
+		if (!frame)
 			return 0;
+
+		/* Offloaded payload checks only covered a single fragment */
+		ret = net_handle_ip_proto(edev, frame, len, 0);
+		free(frame);
+
+		return ret;
 	}
 
-	switch (ip->protocol) {
-	case IPPROTO_ICMP:
-		return net_handle_icmp(pkt, len);
-	case IPPROTO_IGMP:
-		return net_handle_igmp(pkt, len);
-	case IPPROTO_UDP:
-		return net_handle_udp(pkt, len);
+	/*
+	 * Only IGMP comes with options (router alert), the other protocol
+	 * handlers expect the payload right after a 20 byte header.
+	 * Reassembled packets have their options stripped already.
+	 */
+	if ((ip->hl_v & 0x0f) > 5 && ip->protocol != IPPROTO_IGMP) {
+		eth_rx_drop(edev, ETH_DROP_PROTO);
+		return 0;
 	}
 
-	return 0;
+	return net_handle_ip_proto(edev, pkt, len, csum);
 bad:
-	net_bad_packet(pkt, len);
+	net_bad_packet(edev, pkt, len);
 	return 0;
 }
 
-int net_receive(struct eth_device *edev, unsigned char *pkt, int len)
+static int __net_receive(struct eth_device *edev, unsigned char *pkt, int len,
+		unsigned int csum)
 {
 	struct ethernet *et = (struct ethernet *)pkt;
 	int et_protlen = ntohs(et->et_protlen);
@@ -801,7 +1110,11 @@ int net_receive(struct eth_device *edev, unsigned char *pkt, int len)
 
 	led_trigger_network(LED_TRIGGER_NET_RX);
 
+	edev->rx_packets++;
+	edev->rx_bytes += len;
+
 	if (len < ETHER_HDR_SIZE) {
+		net_bad_packet(edev, pkt, len);
 		ret = 0;
 		goto out;
 	}
@@ -811,10 +1124,11 @@ int net_receive(struct eth_device *edev, unsigned char *pkt, int len)
 		ret = net_handle_arp(edev, pkt, len);
 		break;
 	case PROT_IP:
-		ret = net_handle_ip(edev, pkt, len);
+		ret = net_handle_ip(edev, pkt, len, csum);
 		break;
 	default:
 		debug("%s: got unknown protocol type: %d\n", __func__, et_protlen);
+		eth_rx_drop(edev, ETH_DROP_PROTO);
 		ret = 1;
 		break;
 	}
@@ -822,6 +1136,43 @@ out:
 	return ret;
 }
 
+int net_receive_csum(struct eth_device *edev, unsigned char *pkt, int len,
+		unsigned int csum)
+{
+	uint64_t start;
+	int ret;
+
+	if (!net_rx_timing_enabled)
+		return __net_receive(edev, pkt, len, csum);
+
+	start = get_time_ns();
+	ret = __net_receive(edev, pkt, len, csum);
+	net_rx_time_ns += get_time_ns() - start;
+
+	return ret;
+}
+
+int net_receive(struct eth_device *edev, unsigned char *pkt, int len)
+{
+	return net_receive_csum(edev, pkt, len, 0);
+}
+
+/*
+ * Start or stop accumulating the time spent in the network stack. Used to
+ * tell it apart from the time spent in the drivers.
+ */
+void net_rx_timing(int enable)
+{
+	net_rx_timing_enabled = enable;
+	if (enable)
+		net_rx_time_ns = 0;
+}
+
+uint64_t net_rx_time(void)
+{
+	return net_rx_time_ns;
+}
+
 static struct device_d net_device = {
 	.name = "net",
 	.id = DEVICE_ID_SINGLE,
@@ -832,11 +1183,14 @@ static int net_init(void)
 	int i;
 
 	for (i = 0; i < PKTBUFSRX; i++)
-		NetRxPackets[i] = net_alloc_packet();
+		NetRxPackets[i] = xmemalign(32, PKTSIZE);
 
 	register_device(&net_device);
 	dev_add_param(&net_device, "nameserver", NULL, NULL, 0);
 	dev_add_param(&net_device, "domainname", NULL, NULL, 0);
+	dev_add_param(&net_device, "search", NULL, NULL, 0);
+	dev_add_param_bool(&net_device, "udp_checksum", NULL, NULL,
+			&net_udp_checksum, NULL);
 
 	return 0;
 }
@@ -30,13 +30,23 @@
 #include <net.h>
 #include <kfifo.h>
 #include <init.h>
+#include <clock.h>
+#include <poller.h>
 #include <linux/err.h>
 
+/* Send buffered output without a newline after this time */
+#define NC_TX_TIMEOUT	(20 * MSECOND)
+
 struct nc_priv {
 	struct console_device cdev;
 	struct kfifo *fifo;
 	int busy;
 	struct net_connection *con;
+	struct poller_struct poller;
+
+	/* output is collected in the packet of con */
+	int tx_len;
+	uint64_t tx_start;
 
 	unsigned int port;
 	IPaddr_t ip;
@@ -52,12 +62,56 @@ static void nc_handler(void *ctx, char *pkt, unsigned len)
 	kfifo_put(priv->fifo, packet, net_eth_to_udplen(pkt));
 }
 
+static void nc_flush(struct nc_priv *priv)
+{
+	if (!priv->con || !priv->tx_len || priv->busy)
+		return;
+
+	priv->busy = 1;
+	net_udp_send(priv->con, priv->tx_len);
+	priv->busy = 0;
+
+	priv->tx_len = 0;
+}
+
+static void nc_cdev_flush(struct console_device *cdev)
+{
+	struct nc_priv *priv = container_of(cdev,
+					struct nc_priv, cdev);
+
+	nc_flush(priv);
+}
+
+/* Send a partial line once it waited long enough for more output */
+static void nc_flush_timeout(struct nc_priv *priv)
+{
+	if (priv->tx_len &&
+			is_timeout_non_interruptible(priv->tx_start, NC_TX_TIMEOUT))
+		nc_flush(priv);
+}
+
+static void nc_poller(struct poller_struct *poller)
+{
+	struct nc_priv *priv = container_of(poller,
+					struct nc_priv, poller);
+
+	/* don't send from a poller run inside the network driver */
+	if (eth_busy())
+		return;
+
+	nc_flush_timeout(priv);
+}
+
 static int nc_init(void)
 {
 	struct nc_priv *priv = g_priv;
 
-	if (priv->con)
+	if (priv->con) {
+		nc_flush(priv);
 		net_unregister(priv->con);
+	}
+
+	priv->tx_len = 0;
 
 	priv->con = net_udp_new(priv->ip, priv->port, nc_handler, NULL);
 	if (IS_ERR(priv->con)) {
@@ -79,6 +133,9 @@ static int nc_getc(struct console_device *cdev)
 	if (!priv->con)
 		return 0;
 
+	/* make sure the prompt is out before waiting for input */
+	nc_flush(priv);
+
 	while (!kfifo_len(priv->fifo))
 		net_poll();
 
@@ -98,11 +155,16 @@ static int nc_tstc(struct console_device *cdev)
 	if (priv->busy)
 		return kfifo_len(priv->fifo) ? 1 : 0;
 
+	nc_flush_timeout(priv);
 	net_poll();
 
 	return kfifo_len(priv->fifo) ? 1 : 0;
 }
 
+/*
+ * Output is collected and sent line by line, or when the packet is full.
+ * Partial lines are sent by the poller after NC_TX_TIMEOUT.
+ */
 static void nc_putc(struct console_device *cdev, char c)
 {
 	struct nc_priv *priv = container_of(cdev,
@@ -116,11 +178,15 @@ static void nc_putc(struct console_device *cdev, char c)
 		return;
 
 	packet = net_udp_get_payload(priv->con);
-	*packet = c;
 
-	priv->busy = 1;
-	net_udp_send(priv->con, 1);
-	priv->busy = 0;
+	if (!priv->tx_len)
+		priv->tx_start = get_time_ns();
+
+	packet[priv->tx_len++] = c;
+
+	/* the payload of a single frame on the interface is full */
+	if (c == '\n' || priv->tx_len >= net_eth_udp_payload(priv->con->edev))
+		nc_flush(priv);
 }
 
 static int nc_port_set(struct param_d *p, void *_priv)
@@ -141,6 +207,7 @@ static int netconsole_init(void)
 	cdev->tstc = nc_tstc;
 	cdev->putc = nc_putc;
 	cdev->getc = nc_getc;
+	cdev->flush = nc_cdev_flush;
 
 	g_priv = priv;
 
@@ -155,6 +222,9 @@ static int netconsole_init(void)
 
 	priv->port = 6666;
 
+	priv->poller.func = nc_poller;
+	poller_register(&priv->poller);
+
 	dev_add_param_ip(&cdev->class_dev, "ip", NULL, NULL, &priv->ip, NULL);
 	dev_add_param_int(&cdev->class_dev, "port", nc_port_set, NULL, &priv->port, "%u", NULL);
 
@@ -0,0 +1,779 @@
+/*
+ * tcp.c - a minimal TCP client
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+/*
+ * Just enough TCP to fetch files over links with a large bandwidth-delay
+ * product: active open only, a receive window beyond 64KiB using window
+ * scaling (RFC 7323), delayed ACKs and fast retransmit after three duplicate
+ * ACKs. There is no SACK. Segments arriving out of order are kept and
+ * answered with a duplicate ACK, which makes the sender retransmit the
+ * missing one right away. Besides the window offered by the peer there is
+ * no congestion control.
+ *
+ * Like everything else in the network stack, a connection only makes
+ * progress while one of the tcp_* functions waits for the network.
+ */
+#include <common.h>
+#include <clock.h>
+#include <errno.h>
+#include <malloc.h>
+#include <net.h>
+#include <sizes.h>
+#include <linux/err.h>
+
+#define TCP_RX_BUF		(CONFIG_NET_TCP_WINDOW * SZ_1K)
+#define TCP_TX_BUF		SZ_16K
+#define TCP_DEFAULT_MSS		536
+#define TCP_DELACK		(40 * MSECOND)
+#define TCP_RTO_INIT		(1 * SECOND)
+#define TCP_RTO_MIN		(200 * MSECOND)
+#define TCP_RTO_MAX		(10 * SECOND)
+#define TCP_MAX_RETRIES		6
+#define TCP_TIMEOUT		(20 * SECOND)	/* without progress */
+#define TCP_CLOSE_TIMEOUT	(2 * SECOND)
+#define TCP_OOO_MAX		16	/* holes tracked in the receive window */
+
+#define TCPOPT_EOL		0
+#define TCPOPT_NOP		1
+#define TCPOPT_MSS		2
+#define TCPOPT_WSCALE		3
+
+/* Sequence number comparisons, correct across wrap-around */
+#define SEQ_LT(a, b)		((int32_t)((a) - (b)) < 0)
+
+enum tcp_state {
+	TCP_CLOSED,
+	TCP_SYN_SENT,
+	TCP_ESTABLISHED,
+	TCP_FIN_WAIT1,
+	TCP_FIN_WAIT2,
+	TCP_CLOSE_WAIT,
+	TCP_LAST_ACK,
+};
+
+struct tcp_socket {
+	struct net_connection *con;
+	enum tcp_state state;
+	int err;
+
+	/* send side */
+	uint32_t snd_una;	/* oldest unacknowledged sequence number */
+	uint32_t snd_nxt;	/* next sequence number to send */
+	uint32_t snd_max;	/* highest sequence number sent */
+	uint32_t snd_wnd;	/* window offered by the peer, in bytes */
+	int snd_wscale;
+	int mss;		/* largest segment the peer accepts */
+	char *tx_buf;		/* queued data, starting at snd_una */
+	int tx_len;
+	int fin_queued;		/* send a FIN after the queued data */
+	int dupacks;
+	uint64_t rto;
+	uint64_t rto_time;	/* retransmission deadline, 0 if none */
+	int retries;
+	uint32_t rtt_seq;	/* segment timed for the RTT estimate */
+	uint64_t rtt_start;	/* when it was sent, 0 if none is timed */
+	uint64_t srtt;
+	uint64_t rttvar;
+	int retransmits;
+
+	/* receive side */
+	uint32_t rcv_nxt;	/* next sequence number expected */
+	uint32_t rcv_adv;	/* right edge of the window last advertised */
+	int rcv_wscale;
+	int rcv_mss;
+	char *rx_buf;		/* ring buffer of received data */
+	int rx_start;
+	int rx_len;
+	struct {
+		uint32_t start, end;
+	} ooo[TCP_OOO_MAX];	/* ranges received beyond rcv_nxt, sorted */
+	int ooo_num;
+	int ack_pending;	/* segments not acknowledged yet */
+	uint64_t ack_time;	/* delayed ACK deadline, 0 if none */
+	int fin_received;
+};
+
+/* Smallest shift making the receive buffer fit into the 16 bit window */
+static int tcp_rx_wscale(void)
+{
+	int shift = 0;
+
+	while ((TCP_RX_BUF >> shift) > 0xffff)
+		shift++;
+
+	return shift;
+}
+
+/* The receive window in bytes, as it can be advertised */
+static uint32_t tcp_rcv_wnd(struct tcp_socket *sock)
+{
+	uint32_t wnd = (TCP_RX_BUF - sock->rx_len) >> sock->rcv_wscale;
+
+	return min_t(uint32_t, wnd, 0xffff) << sock->rcv_wscale;
+}
+
+static int tcp_output(struct tcp_socket *sock, uint32_t seq, int flags,
+		int offset, int len)
+{
+	struct tcphdr *tcp = sock->con->tcp;
+	uint8_t *opt = (uint8_t *)(tcp + 1);
+	int hlen = sizeof(*tcp);
+	uint32_t wnd = tcp_rcv_wnd(sock);
+
+	if (flags & TCP_SYN) {
+		opt[0] = TCPOPT_MSS;
+		opt[1] = 4;
+		opt[2] = sock->rcv_mss >> 8;
+		opt[3] = sock->rcv_mss;
+		opt[4] = TCPOPT_NOP;
+		opt[5] = TCPOPT_WSCALE;
+		opt[6] = 3;
+		opt[7] = tcp_rx_wscale();
+		hlen += 8;
+		/* the window of a SYN is never scaled */
+		wnd = min_t(uint32_t, TCP_RX_BUF, 0xffff);
+	}
+
+	if (len)
+		memcpy((char *)tcp + hlen, sock->tx_buf + offset, len);
+
+	tcp->seq = htonl(seq);
+	tcp->ack_seq = htonl(sock->rcv_nxt);
+	tcp->doff = (hlen / 4) << 4;
+	tcp->flags = flags;
+	tcp->window = htons(wnd >> sock->rcv_wscale);
+	tcp->urg_ptr = 0;
+
+	if (flags & TCP_ACK) {
+		sock->rcv_adv = sock->rcv_nxt + wnd;
+		sock->ack_pending = 0;
+		sock->ack_time = 0;
+	}
+
+	return net_tcp_send(sock->con, hlen + len);
+}
+
+static void tcp_send_ack(struct tcp_socket *sock)
+{
+	tcp_output(sock, sock->snd_nxt, TCP_ACK, 0, 0);
+}
+
+/*
+ * Send queued data as far as the peer's window allows, but at most
+ * @segments segments if that is not 0. With @probe a zero window is
+ * probed with a single byte.
+ */
+static void tcp_xmit(struct tcp_socket *sock, int segments, int probe)
+{
+	uint32_t end = sock->snd_una + sock->tx_len;
+	uint32_t wnd_end = sock->snd_una + max_t(uint32_t, sock->snd_wnd, probe);
+	uint64_t now = get_time_ns();
+	int len, flags;
+
+	while (SEQ_LT(sock->snd_nxt, end) && SEQ_LT(sock->snd_nxt, wnd_end)) {
+		len = min_t(uint32_t, end - sock->snd_nxt, sock->mss);
+		len = min_t(uint32_t, len, wnd_end - sock->snd_nxt);
+
+		flags = TCP_ACK;
+		if (sock->snd_nxt + len == end)
+			flags |= TCP_PSH;
+
+		if (tcp_output(sock, sock->snd_nxt, flags,
+				sock->snd_nxt - sock->snd_una, len))
+			break;
+
+		/* Karn: only time segments which were not sent before */
+		if (!sock->rtt_start && !SEQ_LT(sock->snd_nxt, sock->snd_max)) {
+			sock->rtt_seq = sock->snd_nxt;
+			sock->rtt_start = now;
+		}
+
+		sock->snd_nxt += len;
+		if (SEQ_LT(sock->snd_max, sock->snd_nxt))
+			sock->snd_max = sock->snd_nxt;
+		if (!sock->rto_time)
+			sock->rto_time = now + sock->rto;
+
+		if (segments && !--segments)
+			return;
+	}
+
+	/* the FIN follows the data */
+	if (sock->fin_queued && sock->snd_nxt == end &&
+			(sock->state == TCP_FIN_WAIT1 ||
+			 sock->state == TCP_LAST_ACK)) {
+		tcp_output(sock, end, TCP_FIN | TCP_ACK, 0, 0);
+		sock->snd_max = ++sock->snd_nxt;
+		if (!sock->rto_time)
+			sock->rto_time = now + sock->rto;
+	}
+
+	/* keep probing a zero window */
+	if (!sock->rto_time && SEQ_LT(sock->snd_nxt, end))
+		sock->rto_time = now + sock->rto;
+}
+
+static void tcp_send_syn(struct tcp_socket *sock)
+{
+	tcp_output(sock, sock->snd_una, TCP_SYN, 0, 0);
+}
+
+static void tcp_rtt_sample(struct tcp_socket *sock, uint64_t rtt)
+{
+	uint64_t delta;
+
+	if (!sock->srtt) {
+		sock->srtt = rtt;
+		sock->rttvar = rtt >> 1;
+	} else {
+		delta = rtt > sock->srtt ? rtt - sock->srtt : sock->srtt - rtt;
+		sock->rttvar = (3 * sock->rttvar + delta) >> 2;
+		sock->srtt = (7 * sock->srtt + rtt) >> 3;
+	}
+
+	sock->rto = clamp_t(uint64_t, sock->srtt + 4 * sock->rttvar,
+			TCP_RTO_MIN, TCP_RTO_MAX);
+}
+
+static void tcp_timeout(struct tcp_socket *sock)
+{
+	if (++sock->retries > TCP_MAX_RETRIES) {
+		sock->err = -ETIMEDOUT;
+		sock->state = TCP_CLOSED;
+		return;
+	}
+
+	sock->retransmits++;
+	sock->rto = min_t(uint64_t, sock->rto * 2, TCP_RTO_MAX);
+	sock->rtt_start = 0;
+	sock->rto_time = get_time_ns() + sock->rto;
+
+	if (sock->state == TCP_SYN_SENT) {
+		tcp_send_syn(sock);
+		return;
+	}
+
+	/* start over with a single segment from the first unacknowledged */
+	sock->snd_nxt = sock->snd_una;
+	tcp_xmit(sock, 1, 1);
+}
+
+static void tcp_parse_options(struct tcp_socket *sock, struct tcphdr *tcp)
+{
+	uint8_t *opt = (uint8_t *)(tcp + 1);
+	int len = (tcp->doff >> 4) * 4 - sizeof(*tcp);
+	int i = 0, wscale = -1;
+
+	while (i < len) {
+		if (opt[i] == TCPOPT_EOL)
+			break;
+		if (opt[i] == TCPOPT_NOP) {
+			i++;
+			continue;
+		}
+		if (i + 1 >= len || opt[i + 1] < 2 || i + opt[i + 1] > len)
+			break;
+
+		if (opt[i] == TCPOPT_MSS && opt[i + 1] == 4)
+			sock->mss = opt[i + 2] << 8 | opt[i + 3];
+		else if (opt[i] == TCPOPT_WSCALE && opt[i + 1] == 3)
+			wscale = min_t(int, opt[i + 2], 14);
+
+		i += opt[i + 1];
+	}
+
+	/* scaling is only used when both sides asked for it */
+	if (wscale >= 0) {
+		sock->snd_wscale = wscale;
+		sock->rcv_wscale = tcp_rx_wscale();
+	}
+
+	sock->mss = min(sock->mss, sock->rcv_mss);
+}
+
+static void tcp_syn_sent(struct tcp_socket *sock, struct tcphdr *tcp)
+{
+	uint32_t ack = ntohl(tcp->ack_seq);
+
+	if (!(tcp->flags & TCP_ACK) || ack != sock->snd_nxt)
+		return;
+
+	if (tcp->flags & TCP_RST) {
+		sock->err = -ECONNREFUSED;
+		sock->state = TCP_CLOSED;
+		return;
+	}
+
+	if (!(tcp->flags & TCP_SYN))
+		return;
+
+	tcp_parse_options(sock, tcp);
+
+	sock->rcv_nxt = ntohl(tcp->seq) + 1;
+	sock->snd_una = ack;
+	sock->snd_wnd = ntohs(tcp->window);
+	sock->state = TCP_ESTABLISHED;
+	sock->rto_time = 0;
+	sock->retries = 0;
+	if (sock->rtt_start)
+		tcp_rtt_sample(sock, get_time_ns() - sock->rtt_start);
+	sock->rtt_start = 0;
+
+	tcp_send_ack(sock);
+}
+
+static void tcp_ack(struct tcp_socket *sock, struct tcphdr *tcp, int dlen)
+{
+	uint32_t ack = ntohl(tcp->ack_seq);
+	uint32_t wnd = ntohs(tcp->window) << sock->snd_wscale;
+	uint32_t fin_seq = sock->snd_una + sock->tx_len;
+	uint32_t acked;
+
+	if (SEQ_LT(sock->snd_max, ack))
+		return;
+
+	if (SEQ_LT(sock->snd_una, ack)) {
+		acked = min_t(uint32_t, ack - sock->snd_una, sock->tx_len);
+		memmove(sock->tx_buf, sock->tx_buf + acked,
+				sock->tx_len - acked);
+		sock->tx_len -= acked;
+		sock->snd_una = ack;
+		/* after a timeout, the peer may have had more than we resent */
+		if (SEQ_LT(sock->snd_nxt, ack))
+			sock->snd_nxt = ack;
+		sock->dupacks = 0;
+		sock->retries = 0;
+
+		if (sock->rtt_start && SEQ_LT(sock->rtt_seq, ack)) {
+			tcp_rtt_sample(sock, get_time_ns() - sock->rtt_start);
+			sock->rtt_start = 0;
+		}
+
+		if (sock->snd_una == sock->snd_max)
+			sock->rto_time = 0;
+		else
+			sock->rto_time = get_time_ns() + sock->rto;
+
+		if (sock->fin_queued && ack == fin_seq + 1) {
+			if (sock->state == TCP_LAST_ACK || sock->fin_received)
+				sock->state = TCP_CLOSED;
+			else
+				sock->state = TCP_FIN_WAIT2;
+		}
+	} else if (!dlen && wnd == sock->snd_wnd &&
+			sock->snd_una != sock->snd_max) {
+		/* the third duplicate ACK means a segment got lost */
+		if (++sock->dupacks == 3 && sock->tx_len) {
+			sock->retransmits++;
+			sock->rtt_start = 0;
+			tcp_output(sock, sock->snd_una, TCP_ACK, 0,
+					min(sock->tx_len, sock->mss));
+		}
+	}
+
+	sock->snd_wnd = wnd;
+
+	tcp_xmit(sock, 0, 0);
+}
+
+/* Copy received data to @offset bytes after the end of the unread data */
+static void tcp_rx_put(struct tcp_socket *sock, int offset, char *data,
+		int len)
+{
+	int pos, n;
+
+	pos = sock->rx_start + sock->rx_len + offset;
+	if (pos >= TCP_RX_BUF)
+		pos -= TCP_RX_BUF;
+	n = min(len, TCP_RX_BUF - pos);
+	memcpy(sock->rx_buf + pos, data, n);
+	memcpy(sock->rx_buf, data + n, len - n);
+}
+
+/* Remember data received beyond a lost segment */
+static void tcp_ooo_add(struct tcp_socket *sock, uint32_t start, uint32_t end)
+{
+	int i, j;
+
+	for (i = 0; i < sock->ooo_num; i++) {
+		if (SEQ_LT(end, sock->ooo[i].start))
+			break;
+		if (SEQ_LT(sock->ooo[i].end, start))
+			continue;
+
+		/* overlapping or adjacent, merge with all following ones */
+		if (SEQ_LT(sock->ooo[i].start, start))
+			start = sock->ooo[i].start;
+		for (j = i; j < sock->ooo_num &&
+				!SEQ_LT(end, sock->ooo[j].start); j++)
+			if (SEQ_LT(end, sock->ooo[j].end))
+				end = sock->ooo[j].end;
+		memmove(&sock->ooo[i + 1], &sock->ooo[j],
+				(sock->ooo_num - j) * sizeof(sock->ooo[0]));
+		sock->ooo_num -= j - i - 1;
+		sock->ooo[i].start = start;
+		sock->ooo[i].end = end;
+		return;
+	}
+
+	if (sock->ooo_num == TCP_OOO_MAX)
+		return;
+
+	memmove(&sock->ooo[i + 1], &sock->ooo[i],
+			(sock->ooo_num - i) * sizeof(sock->ooo[0]));
+	sock->ooo[i].start = start;
+	sock->ooo[i].end = end;
+	sock->ooo_num++;
+}
+
+static void tcp_data(struct tcp_socket *sock, uint32_t seq, char *data,
+		int dlen, int fin)
+{
+	int32_t ahead = seq - sock->rcv_nxt;
+	int space = TCP_RX_BUF - sock->rx_len;
+	uint32_t end;
+
+	if (sock->fin_received || ahead + dlen < 0 ||
+			(ahead + dlen == 0 && !fin)) {
+		/* a duplicate, tell the peer what we expect */
+		tcp_send_ack(sock);
+		return;
+	}
+
+	if (ahead > 0) {
+		/*
+		 * Keep data beyond a lost segment in place, the peer will
+		 * resend the missing one after our duplicate ACKs.
+		 */
+		if (ahead + dlen <= space) {
+			tcp_rx_put(sock, ahead, data, dlen);
+			tcp_ooo_add(sock, seq, seq + dlen);
+		}
+		tcp_send_ack(sock);
+		return;
+	}
+
+	data -= ahead;
+	dlen += ahead;
+
+	if (dlen > space) {
+		/* beyond the window we offered */
+		dlen = space;
+		fin = 0;
+	}
+
+	tcp_rx_put(sock, 0, data, dlen);
+	sock->rx_len += dlen;
+	sock->rcv_nxt += dlen;
+
+	if (sock->ooo_num) {
+		/* take what the segment made contiguous */
+		while (sock->ooo_num && !SEQ_LT(sock->rcv_nxt,
+				sock->ooo[0].start)) {
+			end = sock->ooo[0].end;
+			if (SEQ_LT(sock->rcv_nxt, end)) {
+				sock->rx_len += end - sock->rcv_nxt;
+				sock->rcv_nxt = end;
+			}
+			sock->ooo_num--;
+			memmove(&sock->ooo[0], &sock->ooo[1],
+					sock->ooo_num * sizeof(sock->ooo[0]));
+		}
+
+		/* a filled hole is acknowledged right away */
+		tcp_send_ack(sock);
+		return;
+	}
+
+	if (fin) {
+		sock->rcv_nxt++;
+		sock->fin_received = 1;
+
+		if (sock->state == TCP_ESTABLISHED)
+			sock->state = TCP_CLOSE_WAIT;
+		else if (sock->state == TCP_FIN_WAIT2)
+			sock->state = TCP_CLOSED;
+
+		tcp_send_ack(sock);
+		return;
+	}
+
+	/* acknowledge every second segment, delay the ACK for the others */
+	if (++sock->ack_pending >= 2)
+		tcp_send_ack(sock);
+	else if (!sock->ack_time)
+		sock->ack_time = get_time_ns() + TCP_DELACK;
+}
+
+static void tcp_handler(void *ctx, char *packet, unsigned len)
+{
+	struct tcp_socket *sock = ctx;
+	struct iphdr *ip = net_eth_to_iphdr(packet);
+	struct tcphdr *tcp = net_eth_to_tcphdr(packet);
+	int hlen = (tcp->doff >> 4) * 4;
+	int dlen = ntohs(ip->tot_len) - sizeof(struct iphdr) - hlen;
+	uint32_t seq = ntohl(tcp->seq);
+
+	switch (sock->state) {
+	case TCP_CLOSED:
+		return;
+	case TCP_SYN_SENT:
+		tcp_syn_sent(sock, tcp);
+		return;
+	default:
+		break;
+	}
+
+	if (tcp->flags & TCP_RST) {
+		/* only believe resets within the window */
+		if (seq == sock->rcv_nxt || (SEQ_LT(sock->rcv_nxt, seq) &&
+				SEQ_LT(seq, sock->rcv_adv))) {
+			sock->err = -ECONNRESET;
+			sock->state = TCP_CLOSED;
+		}
+		return;
+	}
+
+	if (tcp->flags & TCP_SYN) {
+		/* a retransmitted SYN-ACK, our ACK got lost */
+		tcp_send_ack(sock);
+		return;
+	}
+
+	if (tcp->flags & TCP_ACK)
+		tcp_ack(sock, tcp, dlen);
+
+	if (dlen || (tcp->flags & TCP_FIN))
+		tcp_data(sock, seq, (char *)tcp + hlen, dlen,
+				tcp->flags & TCP_FIN);
+}
+
+static void tcp_poll(struct tcp_socket *sock)
+{
+	uint64_t now;
+
+	net_poll();
+
+	now = get_time_ns();
+
+	if (sock->ack_time && now >= sock->ack_time)
+		tcp_send_ack(sock);
+
+	if (sock->rto_time && now >= sock->rto_time)
+		tcp_timeout(sock);
+}
+
+static void tcp_free(struct tcp_socket *sock)
+{
+	net_unregister(sock->con);
+	free(sock->rx_buf);
+	free(sock->tx_buf);
+	free(sock);
+}
+
+/**
+ * tcp_connect - open a TCP connection
+ * @dest: IP address of the server
+ * @port: TCP port of the server
+ *
+ * Return the connected socket or an error pointer.
+ */
+struct tcp_socket *tcp_connect(IPaddr_t dest, uint16_t port)
+{
+	struct tcp_socket *sock;
+	int ret;
+
+	sock = xzalloc(sizeof(*sock));
+
+	sock->con = net_tcp_new(dest, port, tcp_handler, sock);
+	if (IS_ERR(sock->con)) {
+		ret = PTR_ERR(sock->con);
+		free(sock);
+		return ERR_PTR(ret);
+	}
+
+	sock->rx_buf = xmalloc(TCP_RX_BUF);
+	sock->tx_buf = xmalloc(TCP_TX_BUF);
+	sock->rcv_mss = sock->con->edev->mtu - sizeof(struct iphdr) -
+		sizeof(struct tcphdr);
+	sock->mss = TCP_DEFAULT_MSS;
+	sock->rto = TCP_RTO_INIT;
+
+	/* the initial sequence number follows a 4us clock, see RFC 793 */
+	sock->snd_una = get_time_ns() >> 12;
+	sock->snd_nxt = sock->snd_max = sock->snd_una + 1;
+	sock->state = TCP_SYN_SENT;
+	sock->rtt_start = get_time_ns();
+	sock->rto_time = sock->rtt_start + sock->rto;
+
+	tcp_send_syn(sock);
+
+	while (sock->state == TCP_SYN_SENT) {
+		if (ctrlc()) {
+			sock->err = -EINTR;
+			break;
+		}
+		tcp_poll(sock);
+	}
+
+	if (sock->state != TCP_ESTABLISHED) {
+		ret = sock->err ? sock->err : -ECONNRESET;
+		tcp_free(sock);
+		return ERR_PTR(ret);
+	}
+
+	return sock;
+}
+
+/**
+ * tcp_send - send data
+ *
+ * Return @len once all data is queued for sending, or a negative error
+ * code.
+ */
+int tcp_send(struct tcp_socket *sock, const void *buf, int len)
+{
+	uint64_t start = get_time_ns();
+	int done = 0, now;
+
+	while (done < len) {
+		if (sock->err)
+			return sock->err;
+		if (sock->state != TCP_ESTABLISHED &&
+				sock->state != TCP_CLOSE_WAIT)
+			return -EPIPE;
+
+		now = min(len - done, TCP_TX_BUF - sock->tx_len);
+		if (now) {
+			memcpy(sock->tx_buf + sock->tx_len, buf + done, now);
+			sock->tx_len += now;
+			done += now;
+			tcp_xmit(sock, 0, 0);
+			start = get_time_ns();
+			continue;
+		}
+
+		if (ctrlc())
+			return -EINTR;
+		if (is_timeout(start, TCP_TIMEOUT))
+			return -ETIMEDOUT;
+
+		tcp_poll(sock);
+	}
+
+	return len;
+}
+
+/**
+ * tcp_recv - receive data
+ *
+ * Wait until data is available and return up to @len bytes of it. Return 0
+ * once the peer closed the connection, or a negative error code.
+ */
+int tcp_recv(struct tcp_socket *sock, void *buf, int len)
+{
+	uint64_t start = get_time_ns();
+	int now, n;
+
+	while (!sock->rx_len) {
+		if (sock->fin_received)
+			return 0;
+		if (sock->err)
+			return sock->err;
+		if (sock->state == TCP_CLOSED)
+			return -ENOTCONN;
+		if (ctrlc())
+			return -EINTR;
+		if (is_timeout(start, TCP_TIMEOUT))
+			return -ETIMEDOUT;
+
+		tcp_poll(sock);
+	}
+
+	now = min(len, sock->rx_len);
+	n = min(now, TCP_RX_BUF - sock->rx_start);
+	memcpy(buf, sock->rx_buf + sock->rx_start, n);
+	memcpy(buf + n, sock->rx_buf, now - n);
+
+	sock->rx_start += now;
+	if (sock->rx_start >= TCP_RX_BUF)
+		sock->rx_start -= TCP_RX_BUF;
+	sock->rx_len -= now;
+
+	/* tell the peer once the window opened by two segments */
+	if (!sock->fin_received && (int32_t)(sock->rcv_nxt + tcp_rcv_wnd(sock) -
+			sock->rcv_adv) >= 2 * sock->rcv_mss)
+		tcp_send_ack(sock);
+
+	return now;
+}
+
+/**
+ * tcp_close - close a connection and free the socket
+ *
+ * The connection is closed gracefully, unless received data was left
+ * unread, which resets it (RFC 2525, section 2.17).
+ */
+void tcp_close(struct tcp_socket *sock)
+{
+	uint64_t start = get_time_ns();
+
+	if (sock->rx_len) {
+		tcp_abort(sock);
+		return;
+	}
+
+	if (sock->state == TCP_ESTABLISHED)
+		sock->state = TCP_FIN_WAIT1;
+	else if (sock->state == TCP_CLOSE_WAIT)
+		sock->state = TCP_LAST_ACK;
+	else
+		goto out;
+
+	sock->fin_queued = 1;
+	tcp_xmit(sock, 0, 0);
+
+	while (sock->state != TCP_CLOSED) {
+		if (ctrlc() || is_timeout(start, TCP_CLOSE_TIMEOUT)) {
+			tcp_output(sock, sock->snd_nxt, TCP_RST | TCP_ACK, 0, 0);
+			break;
+		}
+
+		tcp_poll(sock);
+
+		/* nobody reads anymore */
+		sock->rx_start = sock->rx_len = 0;
+	}
+out:
+	tcp_free(sock);
+}
+
+/**
+ * tcp_abort - reset a connection and free the socket
+ *
+ * Used to abandon a connection the peer is still sending on.
+ */
+void tcp_abort(struct tcp_socket *sock)
+{
+	if (sock->state != TCP_CLOSED)
+		tcp_output(sock, sock->snd_nxt, TCP_RST | TCP_ACK, 0, 0);
+
+	tcp_free(sock);
+}
+
+/* Number of segments sent again after a timeout or duplicate ACKs */
+int tcp_retransmits(struct tcp_socket *sock)
+{
+	return sock->retransmits;
+}
@@ -0,0 +1,480 @@
+/*
+ * tftpd.c - serve files via TFTP
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+/*
+ * A read-only TFTP server supporting the blksize (RFC 2348), tsize and
+ * timeout (RFC 2349) and windowsize (RFC 7440) options. A board which
+ * downloaded an image can serve it to its neighbours this way. Files are
+ * sent directly from memory where memmap() supports it.
+ */
+#include <common.h>
+#include <command.h>
+#include <clock.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fs.h>
+#include <getopt.h>
+#include <libbb.h>
+#include <malloc.h>
+#include <net.h>
+#include <tftp.h>
+#include <asm-generic/div64.h>
+#include <linux/err.h>
+#include <linux/stat.h>
+
+#define TFTPD_TIMEOUT		1	/* seconds until a window is resent */
+#define TFTPD_MAX_RESEND	5
+#define TFTPD_MAX_BLKSIZE	65464
+
+struct tftpd_xfer {
+	struct list_head list;
+	IPaddr_t client;
+	uint16_t port;
+	char *request;		/* RRQ payload, until the transfer is set up */
+	int request_len;
+
+	struct net_connection *con;
+	char *path;
+	int fd;
+	const void *map;	/* file contents if memmap() works, else NULL */
+	loff_t size;
+	int blksize;
+	int windowsize;
+	int timeout;
+	int tsize;		/* client asked for the file size */
+	uint32_t base;		/* first unacknowledged block, 0 during OACK */
+	uint32_t last;		/* number of the final (short) block */
+	uint64_t sent;		/* time the current window was sent */
+	uint64_t start;
+	int retries;
+	int pending;		/* window to be sent from the main loop */
+	int done;
+};
+
+static LIST_HEAD(tftpd_xfers);
+static const char *tftpd_root;
+
+static int tftpd_send_error(struct net_connection *con, int code,
+		const char *msg)
+{
+	uint16_t *s = net_udp_get_payload(con);
+	int len;
+
+	*s++ = htons(TFTP_ERROR);
+	*s++ = htons(code);
+	len = strlen(msg) + 1;
+	memcpy(s, msg, len);
+
+	return net_udp_send(con, 4 + len);
+}
+
+static int tftpd_send_oack(struct tftpd_xfer *x)
+{
+	char *start = net_udp_get_payload(x->con);
+	char *p = start;
+
+	*(uint16_t *)p = htons(TFTP_OACK);
+	p += 2;
+
+	p += sprintf(p, "blksize%c%d%c", 0, x->blksize, 0);
+	if (x->windowsize > 1)
+		p += sprintf(p, "windowsize%c%d%c", 0, x->windowsize, 0);
+	if (x->tsize)
+		p += sprintf(p, "tsize%c%lld%c", 0, x->size, 0);
+	if (x->timeout != TFTPD_TIMEOUT)
+		p += sprintf(p, "timeout%c%d%c", 0, x->timeout, 0);
+
+	return net_udp_send(x->con, p - start);
+}
+
+static int tftpd_send_block(struct tftpd_xfer *x, uint32_t block)
+{
+	uint16_t *s = net_udp_get_payload(x->con);
+	loff_t offset = (loff_t)(block - 1) * x->blksize;
+	int len = min_t(loff_t, x->blksize, x->size - offset);
+	int ret;
+
+	*s++ = htons(TFTP_DATA);
+	*s++ = htons(block);
+
+	if (x->map) {
+		memcpy(s, x->map + offset, len);
+	} else {
+		if (lseek(x->fd, offset, SEEK_SET) != offset)
+			return -EIO;
+		ret = read_full(x->fd, s, len);
+		if (ret < 0)
+			return ret;
+		len = ret;
+	}
+
+	return net_udp_send(x->con, 4 + len);
+}
+
+/* Send the OACK or the blocks of the current window */
+static void tftpd_send_window(struct tftpd_xfer *x)
+{
+	uint32_t block;
+	int ret = 0;
+
+	x->sent = get_time_ns();
+
+	if (!x->base) {
+		tftpd_send_oack(x);
+		return;
+	}
+
+	for (block = x->base; block < x->base + x->windowsize; block++) {
+		if (block > x->last)
+			break;
+		ret = tftpd_send_block(x, block);
+		if (ret)
+			break;
+	}
+
+	if (ret && ret != -EAGAIN) {
+		tftpd_send_error(x->con, TFTP_EUNDEF, strerror(-ret));
+		x->done = ret;
+	}
+}
+
+/*
+ * Only the window state is updated here, the blocks are sent from the main
+ * loop: reading them may poll the network when the file is on a network
+ * filesystem, which must not happen within a receive handler.
+ */
+static void tftpd_handler(void *ctx, char *packet, unsigned len)
+{
+	struct tftpd_xfer *x = ctx;
+	uint16_t *s = (uint16_t *)net_eth_to_udp_payload(packet);
+	uint16_t acked;
+
+	len = net_eth_to_udplen(packet);
+	if (len < 4 || x->done)
+		return;
+
+	switch (ntohs(s[0])) {
+	case TFTP_ACK:
+		if (!x->base) {
+			/* ACK 0 confirms the OACK */
+			if (s[1])
+				break;
+			acked = 1;
+		} else {
+			/* how many blocks of the window the client got */
+			acked = ntohs(s[1]) - (uint16_t)(x->base - 1);
+			if (acked > x->windowsize || acked > x->last - x->base + 1)
+				break;
+		}
+
+		if (!acked) {
+			/* the client lost a block, start over from there */
+			x->pending = 1;
+			break;
+		}
+
+		x->base += acked;
+		x->retries = 0;
+
+		if (x->base > x->last)
+			x->done = 1;
+		else
+			x->pending = 1;
+		break;
+	case TFTP_ERROR:
+		debug("tftpd: client error %d\n", ntohs(s[1]));
+		x->done = -ECONNABORTED;
+		break;
+	}
+}
+
+/*
+ * Parse the RRQ and open the file. Returns a TFTP error code, with *msg set
+ * to a description, or 0 on success.
+ */
+static int tftpd_parse_request(struct tftpd_xfer *x, const char **msg)
+{
+	char *p = x->request + 2, *end = x->request + x->request_len;
+	char *filename, *mode, *opt, *val;
+	struct stat s;
+	uint64_t blocks;
+	int payload = net_eth_udp_payload(x->con->edev) - 4;
+
+	if (ntohs(*(uint16_t *)x->request) != TFTP_RRQ) {
+		*msg = "read only server";
+		return TFTP_EACCESS;
+	}
+
+	filename = p;
+	p += strlen(p) + 1;
+	if (p >= end) {
+		*msg = "malformed request";
+		return TFTP_EBADOP;
+	}
+
+	mode = p;
+	p += strlen(p) + 1;
+	if (strcasecmp(mode, "octet")) {
+		*msg = "only octet mode is supported";
+		return TFTP_EUNDEF;
+	}
+
+	x->blksize = TFTP_BLOCK_SIZE;
+	x->windowsize = 1;
+	x->timeout = TFTPD_TIMEOUT;
+
+	while (p < end) {
+		opt = p;
+		p += strlen(p) + 1;
+		if (p >= end)
+			break;
+		val = p;
+		p += strlen(p) + 1;
+
+		if (!strcasecmp(opt, "blksize")) {
+			x->blksize = clamp_t(int, simple_strtoul(val, NULL, 10),
+					8, min(payload, TFTPD_MAX_BLKSIZE));
+		} else if (!strcasecmp(opt, "windowsize")) {
+			x->windowsize = clamp_t(int, simple_strtoul(val, NULL, 10),
+					1, TFTP_MAX_WINDOW_SIZE);
+		} else if (!strcasecmp(opt, "tsize")) {
+			x->tsize = 1;
+		} else if (!strcasecmp(opt, "timeout")) {
+			x->timeout = clamp_t(int, simple_strtoul(val, NULL, 10),
+					1, 255);
+		}
+	}
+
+	/* Without options the first DATA block acknowledges the request */
+	x->base = (x->blksize != TFTP_BLOCK_SIZE || x->windowsize > 1 ||
+			x->tsize || x->timeout != TFTPD_TIMEOUT) ? 0 : 1;
+
+	if (strstr(filename, "..")) {
+		*msg = "access violation";
+		return TFTP_EACCESS;
+	}
+
+	while (*filename == '/')
+		filename++;
+
+	x->path = concat_path_file(tftpd_root, filename);
+
+	/* open() first, it may have to complete a prefetch of the file */
+	x->fd = open(x->path, O_RDONLY);
+	if (x->fd < 0 || stat(x->path, &s) || !S_ISREG(s.st_mode)) {
+		*msg = "file not found";
+		return TFTP_ENOTFOUND;
+	}
+
+	x->size = s.st_size;
+
+	x->map = memmap(x->fd, PROT_READ);
+	if (x->map == (void *)-1)
+		x->map = NULL;
+
+	blocks = x->size;
+	do_div(blocks, x->blksize);
+	x->last = blocks + 1;
+
+	return 0;
+}
+
+static void tftpd_start(struct tftpd_xfer *x)
+{
+	const char *msg;
+	int ret;
+
+	x->start = get_time_ns();
+
+	x->con = net_udp_new(x->client, x->port, tftpd_handler, x);
+	if (IS_ERR(x->con)) {
+		x->done = PTR_ERR(x->con);
+		x->con = NULL;
+		return;
+	}
+
+	ret = tftpd_parse_request(x, &msg);
+	if (ret) {
+		tftpd_send_error(x->con, ret, msg);
+		x->done = -ENOENT;
+		return;
+	}
+
+	printf("tftpd: sending %s to %s (%lld bytes, blksize %d, windowsize %d)\n",
+			x->path, ip_to_string(x->client), x->size, x->blksize,
+			x->windowsize);
+
+	tftpd_send_window(x);
+}
+
+static void tftpd_free(struct tftpd_xfer *x)
+{
+	uint64_t ms = get_time_ns() - x->start;
+
+	if (x->done > 0) {
+		do_div(ms, MSECOND);
+		printf("tftpd: sent %s to %s in %llums\n", x->path,
+				ip_to_string(x->client), ms);
+	} else if (x->path) {
+		printf("tftpd: sending %s to %s failed: %s\n", x->path,
+				ip_to_string(x->client), strerror(-x->done));
+	}
+
+	list_del(&x->list);
+	if (x->con)
+		net_unregister(x->con);
+	if (x->fd >= 0)
+		close(x->fd);
+	free(x->request);
+	free(x->path);
+	free(x);
+}
+
+/*
+ * New requests are only queued here. Setting them up may need an ARP
+ * request, which must not be sent from within a receive handler.
+ */
+static void tftpd_listen_handler(void *ctx, char *packet, unsigned len)
+{
+	struct iphdr *ip = net_eth_to_iphdr(packet);
+	struct udphdr *udp = net_eth_to_udphdr(packet);
+	IPaddr_t client = net_read_ip(&ip->saddr);
+	uint16_t port = ntohs(udp->uh_sport);
+	struct tftpd_xfer *x;
+
+	len = net_eth_to_udplen(packet);
+	if (len < 4)
+		return;
+
+	/* a repeated request for a running transfer */
+	list_for_each_entry(x, &tftpd_xfers, list)
+		if (x->client == client && x->port == port)
+			return;
+
+	x = xzalloc(sizeof(*x));
+	x->client = client;
+	x->port = port;
+	x->fd = -1;
+	x->request_len = len;
+	/* terminate the last string of a malformed request */
+	x->request = xzalloc(len + 1);
+	memcpy(x->request, net_eth_to_udp_payload(packet), len);
+
+	list_add_tail(&x->list, &tftpd_xfers);
+}
+
+static int do_tftpd(int argc, char *argv[])
+{
+	struct net_connection *con;
+	struct tftpd_xfer *x, *tmp;
+	uint64_t idle;
+	int opt, timeout = 0, ret;
+
+	tftpd_root = "/";
+
+	while ((opt = getopt(argc, argv, "d:t:")) > 0) {
+		switch (opt) {
+		case 'd':
+			tftpd_root = optarg;
+			break;
+		case 't':
+			timeout = simple_strtoul(optarg, NULL, 0);
+			break;
+		default:
+			return COMMAND_ERROR_USAGE;
+		}
+	}
+
+	con = net_udp_new(0xffffffff, 0, tftpd_listen_handler, NULL);
+	if (IS_ERR(con)) {
+		printf("tftpd: %s\n", strerror(-PTR_ERR(con)));
+		return COMMAND_ERROR;
+	}
+
+	net_udp_bind(con, TFTP_PORT);
+
+	ret = eth_open(con->edev);
+	if (ret)
+		goto out;
+
+	printf("tftpd: serving %s, press ctrl-c to stop\n", tftpd_root);
+
+	idle = get_time_ns();
+
+	while (!ctrlc()) {
+		net_poll();
+
+		list_for_each_entry_safe(x, tmp, &tftpd_xfers, list) {
+			if (x->request) {
+				tftpd_start(x);
+				free(x->request);
+				x->request = NULL;
+			}
+
+			if (!x->done && x->pending) {
+				x->pending = 0;
+				tftpd_send_window(x);
+			} else if (!x->done &&
+					is_timeout(x->sent, x->timeout * SECOND)) {
+				if (++x->retries > TFTPD_MAX_RESEND)
+					x->done = -ETIMEDOUT;
+				else
+					tftpd_send_window(x);
+			}
+
+			if (x->done)
+				tftpd_free(x);
+		}
+
+		if (!list_empty(&tftpd_xfers))
+			idle = get_time_ns();
+		else if (timeout && is_timeout(idle, timeout * SECOND))
+			break;
+	}
+
+	ret = 0;
+out:
+	list_for_each_entry_safe(x, tmp, &tftpd_xfers, list) {
+		if (!x->done)
+			x->done = -EINTR;
+		tftpd_free(x);
+	}
+
+	net_unregister(con);
+
+	if (ret) {
+		printf("tftpd: %s\n", strerror(-ret));
+		return COMMAND_ERROR;
+	}
+
+	return 0;
+}
+
+BAREBOX_CMD_HELP_START(tftpd)
+BAREBOX_CMD_HELP_TEXT("Serve the files below DIR via TFTP until ctrl-c is pressed. Only")
+BAREBOX_CMD_HELP_TEXT("reading is supported, with the blksize, windowsize, tsize and")
+BAREBOX_CMD_HELP_TEXT("timeout options.")
+BAREBOX_CMD_HELP_TEXT("")
+BAREBOX_CMD_HELP_TEXT("Options:")
+BAREBOX_CMD_HELP_OPT ("-d DIR",  "directory to serve (default /)")
+BAREBOX_CMD_HELP_OPT ("-t SECS", "stop after SECS without a transfer")
+BAREBOX_CMD_HELP_END
+
+BAREBOX_CMD_START(tftpd)
+	.cmd		= do_tftpd,
+	BAREBOX_CMD_DESC("serve files via TFTP")
+	BAREBOX_CMD_OPTS("[-d DIR] [-t SECS]")
+	BAREBOX_CMD_GROUP(CMD_GRP_NET)
+	BAREBOX_CMD_HELP(cmd_tftpd_help)
+BAREBOX_CMD_END